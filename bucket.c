@@ -0,0 +1,589 @@
+#include <string.h>
+#include <time.h>
+
+#include "bucket.h"
+#include "process.h"
+#include "route.h"
+#include "stage.h"
+#include "tilera.h"
+#include "util.h"
+
+
+// Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
+//
+// #define INFO(F, ...) info(F, ## __VA_ARGS__)
+#define INFO(F, ...)
+
+
+// The forwarder groups.  Buckets of pinned routes go to the GROUPRESERVED
+// forwarders and all others go to the GROUPSHARED forwarders.  Spare
+// forwarders that are not running are in GROUPSPARE and get no buckets.
+//
+enum { GROUPSHARED, GROUPRESERVED, GROUPCOUNT, GROUPSPARE = GROUPCOUNT };
+
+// The names of the forwarder groups.
+//
+static const char *const groupName[GROUPCOUNT + 1] = {
+    [GROUPSHARED]   = "shared",
+    [GROUPRESERVED] = "reserved",
+    [GROUPSPARE]    = "spare"
+};
+
+
+// The rebalancer's state, which only the control thread touches.  Buckets
+// are numbered across all interfaces as in Process.bucket.
+//
+// .last[n] is the packet count on bucket n at the last pass.
+// .hold[n] is the number of passes before bucket n may move again.
+// .from[n] is the thread bucket n moved from in the last pass or 0.
+// .mark[n] is the .from[n] thread's packet count on bucket n at the move.
+// .passes counts the passes that moved buckets.
+// .moves counts the buckets moved.
+// .placed counts the buckets moved between groups.
+// .reordered counts packets that old threads took from moved buckets
+//            after the move, and which may be out of order.
+// .spreadBefore[i][g] and .spreadAfter[i][g] are the load spreads of
+//                     group g on interface i in percent of its mean load
+//                     before and after the last pass that moved.
+// .resizes counts the times the forwarders were added or removed.
+// .resizeMoves counts the buckets moved to resize.
+// .resizeReordered counts packets that may be out of order due to resizes.
+// .resizeDropped counts packets dropped while resizing.
+//
+static struct Balance {
+    unsigned long long last[ALLBUCKETCOUNT];
+    int hold[ALLBUCKETCOUNT];
+    int from[ALLBUCKETCOUNT];
+    unsigned long long mark[ALLBUCKETCOUNT];
+    unsigned long long passes;
+    unsigned long long moves;
+    unsigned long long placed;
+    unsigned long long reordered;
+    unsigned long long spreadBefore[MAXINTERFACES][GROUPCOUNT];
+    unsigned long long spreadAfter[MAXINTERFACES][GROUPCOUNT];
+    unsigned long long resizes;
+    unsigned long long resizeMoves;
+    unsigned long long resizeReordered;
+    unsigned long long resizeDropped;
+} balance;
+
+
+// Return the index after the last running forwarder in p.
+//
+static int forwarderEnd(const Process *p)
+{
+    return p->netioThreadIndex + p->netioThreadCount;
+}
+
+
+// Return the number of buckets on all the interfaces of p.
+//
+static int bucketCount(const Process *p)
+{
+    return p->interfaceCount * BUCKETCOUNT;
+}
+
+
+// Return the packets thread t took from bucket b, which are none unless
+// t reads the interface of b.
+//
+static unsigned long long packetsOn(const Thread *t, int b)
+{
+    if (b / BUCKETCOUNT != t->interface) return 0;
+    return t->bucketPackets[b % BUCKETCOUNT];
+}
+
+
+// Return the group of forwarder m in p.
+//
+static int groupOf(const Process *p, int m)
+{
+    const int end = forwarderEnd(p);
+    if (m >= end) return GROUPSPARE;
+    return m >= end - p->reserveCount ? GROUPRESERVED : GROUPSHARED;
+}
+
+
+// Set pinned[n] to 1 if bucket n carries a pinned route and to 0
+// otherwise.  Return the number of open pinned routes.
+//
+static int findPinnedBuckets(char *pinned)
+{
+    int result = 0;
+    memset(pinned, 0, ALLBUCKETCOUNT);
+    for (int n = 0; n < R30TOTALCHANNELS; ++n) {
+        const Route rt = routeFromPortOfArrival(PORTOFFSET + n);
+        if (rt.open && rt.pinned) {
+            ++result;
+            if (rt.bucket >= 0) pinned[rt.bucket] = 1;
+        }
+    }
+    return result;
+}
+
+
+// Write the busiest and least busy forwarders of group on interface i in
+// p by load into hot and cold, and their total load into total.  Return
+// the number of forwarders in group on i.
+//
+static int findHotAndCold(const Process *p, const unsigned long long *load,
+                          int i, int group, int *hot, int *cold,
+                          unsigned long long *total)
+{
+    int result = 0;
+    *hot = *cold = -1;
+    *total = 0;
+    for (int m = p->netioThreadIndex; m < p->threadCount; ++m) {
+        const int ok =
+            p->thread[m]->interface == i && groupOf(p, m) == group;
+        if (ok) {
+            if (*hot < 0 || load[m] > load[*hot]) *hot = m;
+            if (*cold < 0 || load[m] < load[*cold]) *cold = m;
+            *total += load[m];
+            ++result;
+        }
+    }
+    return result;
+}
+
+
+// Return the spread between the hot and cold loads as a percent of the
+// mean load of count forwarders carrying total.
+//
+static unsigned long long spreadOf(const unsigned long long *load,
+                                   int hot, int cold, int count,
+                                   unsigned long long total)
+{
+    if (count == 0 || total == 0) return 0;
+    return (100 * (load[hot] - load[cold]) * count) / total;
+}
+
+
+// Return the bucket on thread hot whose load is closest to half of gap and
+// is free to move, or -1 if moving any would not reduce the spread.
+//
+static int chooseBucket(const Process *p, const unsigned long long *delta,
+                        int hot, unsigned long long gap)
+{
+    int result = -1;
+    unsigned long long best = gap;
+    for (int n = 0; n < bucketCount(p); ++n) {
+        const int ok = p->bucket[n] == hot && balance.hold[n] == 0 &&
+            delta[n] > 0 && delta[n] < gap;
+        if (ok) {
+            const unsigned long long twice = 2 * delta[n];
+            const unsigned long long miss =
+                twice > gap ? twice - gap : gap - twice;
+            if (miss < best) {
+                best = miss;
+                result = n;
+            }
+        }
+    }
+    return result;
+}
+
+
+// Map bucket n to thread to in p using t's queue on the interface of n.
+//
+static void moveBucket(Process *p, Thread *t, int n, int to)
+{
+    INFO("%02d: moveBucket(%p, %p, %d, %d)", t->index, p, t, n, to);
+    const int from = p->bucket[n];
+    processLock(p);
+    p->bucket[n] = to;
+    processUnlock(p);
+    balance.from[n] = from;
+    balance.mark[n] = packetsOn(p->thread[from], n);
+    balance.hold[n] = BALANCEHOLD;
+    netio_queue_t *const q = processEgress(t, n / BUCKETCOUNT);
+    const int bucket = n % BUCKETCOUNT;
+    const netio_error_t err =
+        netio_input_bucket_configure(q, bucket, p->bucket + n, 1);
+    if (err != NETIO_NO_ERROR) {
+        error("%02d: netio_input_bucket_configure(%p, %d, %p, 1) "
+              "returned %d: %s", t->index, q, bucket, p->bucket + n,
+              err, netio_strerror(err));
+    }
+}
+
+
+// Return the packets old threads took from buckets moved since the last
+// call, which may be out of order.
+//
+static unsigned long long countReordered(const Process *p)
+{
+    unsigned long long result = 0;
+    for (int n = 0; n < bucketCount(p); ++n) {
+        const int from = balance.from[n];
+        if (from) {
+            result += packetsOn(p->thread[from], n) - balance.mark[n];
+            balance.from[n] = 0;
+        }
+    }
+    return result;
+}
+
+
+// Move every bucket in p that is in the wrong group for pinned onto the
+// least busy forwarder of the right group on its interface using t, and
+// update load with the bucket loads in delta.  Isolation beats balance,
+// so ignore the hysteresis and hold.  Return the number of buckets moved.
+//
+static int placeBuckets(Process *p, Thread *t, const char *pinned,
+                        const unsigned long long *delta,
+                        unsigned long long *load)
+{
+    int result = 0;
+    for (int n = 0; n < bucketCount(p); ++n) {
+        const int group = pinned[n] && p->reserveCount > 0
+            ? GROUPRESERVED : GROUPSHARED;
+        if (groupOf(p, p->bucket[n]) != group) {
+            const int i = n / BUCKETCOUNT;
+            int hot, cold;
+            unsigned long long total;
+            if (findHotAndCold(p, load, i, group, &hot, &cold, &total)) {
+                load[p->bucket[n]] -= delta[n];
+                load[cold] += delta[n];
+                moveBucket(p, t, n, cold);
+                ++result;
+            }
+        }
+    }
+    return result;
+}
+
+
+// Move buckets within group on interface i in p from the busiest to the
+// least busy forwarders using t, and update load with the bucket loads
+// in delta.  Return the number of buckets moved.
+//
+static int balanceGroup(Process *p, Thread *t, int i, int group,
+                        const unsigned long long *delta,
+                        unsigned long long *load)
+{
+    int hot, cold;
+    unsigned long long total;
+    const int count =
+        findHotAndCold(p, load, i, group, &hot, &cold, &total);
+    const unsigned long long before = spreadOf(load, hot, cold, count, total);
+    int result = 0;
+    while (count && result < BALANCEMOVES) {
+        const unsigned long long mean = total / count;
+        const int balanced =
+            100 * load[hot] <= (100 + BALANCEHYSTERESIS) * mean;
+        if (balanced) break;
+        const int n = chooseBucket(p, delta, hot, load[hot] - load[cold]);
+        if (n < 0) break;
+        moveBucket(p, t, n, cold);
+        load[hot] -= delta[n];
+        load[cold] += delta[n];
+        ++result;
+        findHotAndCold(p, load, i, group, &hot, &cold, &total);
+    }
+    if (result) {
+        const unsigned long long after =
+            spreadOf(load, hot, cold, count, total);
+        balance.spreadBefore[i][group] = before;
+        balance.spreadAfter[i][group] = after;
+        show("Rebalance moved %d %s buckets on %s: spread %llu%% before "
+             "and %llu%% after", result, groupName[group], p->interface[i],
+             before, after);
+    }
+    return result;
+}
+
+
+void bucketRebalance(Process *p, Thread *t)
+{
+    INFO("%02d: bucketRebalance(%p, %p)", t->index, p, t);
+    const unsigned long long reordered = countReordered(p);
+    balance.reordered += reordered;
+    if (reordered) {
+        show("Rebalance left %llu packets on old threads "
+             "that may be out of order", reordered);
+    }
+    for (int n = 0; n < bucketCount(p); ++n) {
+        if (balance.hold[n]) --balance.hold[n];
+    }
+    unsigned long long delta[ALLBUCKETCOUNT];
+    unsigned long long load[p->threadCount];
+    memset(load, 0, sizeof load);
+    for (int n = 0; n < bucketCount(p); ++n) {
+        unsigned long long packets = 0;
+        for (int m = p->netioThreadIndex; m < p->threadCount; ++m) {
+            packets += packetsOn(p->thread[m], n);
+        }
+        delta[n] = packets - balance.last[n];
+        balance.last[n] = packets;
+        load[p->bucket[n]] += delta[n];
+    }
+    char pinned[ALLBUCKETCOUNT];
+    findPinnedBuckets(pinned);
+    const int placed = placeBuckets(p, t, pinned, delta, load);
+    if (placed) show("Rebalance moved %d buckets between groups", placed);
+    int moves = placed;
+    for (int i = 0; i < p->interfaceCount; ++i) {
+        for (int g = 0; g < GROUPCOUNT; ++g) {
+            moves += balanceGroup(p, t, i, g, delta, load);
+        }
+    }
+    if (moves) {
+        ++balance.passes;
+        balance.moves += moves;
+        balance.placed += placed;
+    }
+}
+
+
+// Return the running forwarder on interface i in p in group with the most
+// buckets if most, or with the fewest buckets otherwise, skipping
+// forwarder not.
+//
+static int findByBuckets(const Process *p, int i, int group, int most,
+                         int not)
+{
+    int buckets[p->threadCount];
+    memset(buckets, 0, sizeof buckets);
+    for (int n = 0; n < bucketCount(p); ++n) ++buckets[p->bucket[n]];
+    int result = -1;
+    for (int m = p->netioThreadIndex; m < forwarderEnd(p); ++m) {
+        const int ok = m != not && p->thread[m]->interface == i &&
+            groupOf(p, m) == group;
+        if (ok) {
+            const int better = result < 0 ||
+                (most ? buckets[m] > buckets[result]
+                 : buckets[m] < buckets[result]);
+            if (better) result = m;
+        }
+    }
+    return result;
+}
+
+
+// Return the count of packets the forwarders in p have dropped.
+//
+static unsigned long long countForwarderDrops(const Process *p)
+{
+    unsigned long long result = 0;
+    for (int m = p->netioThreadIndex; m < p->threadCount; ++m) {
+        const Thread *const t = p->thread[m];
+        for (int n = 0; n < R30TOTALCHANNELS; ++n) result += t->drop[n];
+    }
+    return result;
+}
+
+
+// Sleep for RESIZEDRAINMS so packets in flight on moved buckets land.
+//
+static void sleepDrain(void)
+{
+    static const struct timespec drain = {
+        .tv_sec = RESIZEDRAINMS / 1000,
+        .tv_nsec = 1000000 * (RESIZEDRAINMS % 1000)
+    };
+    nanosleep(&drain, NULL);
+}
+
+
+// Wait until forwarder f goes RESIZEDRAINMS without a packet, or up to
+// RESIZEDRAINTRIES times that long.  Return 1 if f drained or 0 if not.
+//
+static int drainForwarder(const Thread *f)
+{
+    unsigned long long before = f->stages.busyPolls;
+    for (int n = 0; n < RESIZEDRAINTRIES; ++n) {
+        sleepDrain();
+        const unsigned long long after = f->stages.busyPolls;
+        if (after == before) return 1;
+        before = after;
+    }
+    return 0;
+}
+
+
+// Start the first spare forwarder in p and move a fair share of buckets
+// in its group on its interface onto it using t.  Return the number of
+// buckets moved or -1 if it did not start.
+//
+static int addForwarder(Process *p, Thread *t)
+{
+    const int k = forwarderEnd(p);
+    Thread *const f = p->thread[k];
+    INFO("%02d: addForwarder(%p, %p) thread %d", t->index, p, t, k);
+    f->start = p->thread[p->netioThreadIndex]->start;
+    if (!processStartThread(p, f)) {
+        f->start = NULL;
+        return -1;
+    }
+    processLock(p); ++p->netioThreadCount; processUnlock(p);
+    const int group = groupOf(p, k);
+    const int i = f->interface;
+    int count = 0, buckets = 0;
+    for (int m = p->netioThreadIndex; m < forwarderEnd(p); ++m) {
+        count += p->thread[m]->interface == i && groupOf(p, m) == group;
+    }
+    for (int n = i * BUCKETCOUNT; n < (i + 1) * BUCKETCOUNT; ++n) {
+        buckets += groupOf(p, p->bucket[n]) == group;
+    }
+    const int share = buckets / count;
+    int result = 0;
+    for (; result < share; ++result) {
+        const int from = findByBuckets(p, i, group, 1, k);
+        if (from < 0) break;
+        int n = 0;
+        while (n < bucketCount(p) && p->bucket[n] != from) ++n;
+        if (n == bucketCount(p)) break;
+        moveBucket(p, t, n, k);
+    }
+    return result;
+}
+
+
+// Move the buckets of the last running forwarder in p onto the others on
+// its interface using t, wait for it to drain, then stop it.  Return the
+// number of buckets moved, or -1 if it did not stop.
+//
+static int removeForwarder(Process *p, Thread *t)
+{
+    const int k = forwarderEnd(p) - 1;
+    Thread *const f = p->thread[k];
+    INFO("%02d: removeForwarder(%p, %p) thread %d", t->index, p, t, k);
+    const int i = f->interface;
+    int result = 0;
+    for (int n = 0; n < bucketCount(p); ++n) {
+        if (p->bucket[n] == k) {
+            int to = findByBuckets(p, i, groupOf(p, k), 0, k);
+            if (to < 0) to = findByBuckets(p, i, GROUPSHARED, 0, k);
+            moveBucket(p, t, n, to);
+            ++result;
+        }
+    }
+    if (!drainForwarder(f)) {
+        error("%02d: Thread %d did not drain in %d ms",
+              t->index, k, RESIZEDRAINMS * RESIZEDRAINTRIES);
+    }
+    processLock(p);
+    --p->netioThreadCount;
+    if (p->reserveCount >= p->netioThreadCount) {
+        p->reserveCount = p->netioThreadCount - 1;
+    }
+    processUnlock(p);
+    if (!processStopThread(p, f)) return -1;
+    f->start = NULL;
+    return result;
+}
+
+
+int bucketResize(Process *p, Thread *t, int count)
+{
+    INFO("%02d: bucketResize(%p, %p, %d)", t->index, p, t, count);
+    const int limit = p->transmitThreadIndex - p->netioThreadIndex;
+    if (count < p->interfaceCount || count > limit) {
+        error("%02d: Cannot run %d forwarders on %d forward CPUs",
+              t->index, count, limit);
+        return -1;
+    }
+    const int before = p->netioThreadCount;
+    const unsigned long long beginNs = clockNs(CLOCK_MONOTONIC);
+    const unsigned long long ingress = countIngressDrops(t);
+    const unsigned long long forwarder = countForwarderDrops(p);
+    balance.reordered += countReordered(p);
+    int moves = 0;
+    while (p->netioThreadCount != count) {
+        const int moved = p->netioThreadCount < count
+            ? addForwarder(p, t) : removeForwarder(p, t);
+        if (moved < 0) break;
+        moves += moved;
+    }
+    if (p->netioThreadCount > before) sleepDrain();
+    const unsigned long long reordered = countReordered(p);
+    const unsigned long long dropped =
+        countIngressDrops(t) - ingress + countForwarderDrops(p) - forwarder;
+    const unsigned long long us = (clockNs(CLOCK_MONOTONIC) - beginNs) / 1000;
+    ++balance.resizes;
+    balance.resizeMoves += moves;
+    balance.resizeReordered += reordered;
+    balance.resizeDropped += dropped;
+    show("%02d: Resized from %d to %d forwarders in %llu us: moved %d "
+         "buckets with %llu packets maybe out of order and %llu dropped",
+         t->index, before, p->netioThreadCount, us, moves,
+         reordered, dropped);
+    bucketRebalance(p, t);
+    return p->netioThreadCount == count ? 0 : -1;
+}
+
+
+void bucketShow(const Process *p)
+{
+    INFO("__: bucketShow(%p)", p);
+    unsigned long long packets[p->threadCount];
+    unsigned long long bytes[p->threadCount];
+    int buckets[p->threadCount];
+    memset(packets, 0, sizeof packets);
+    memset(bytes, 0, sizeof bytes);
+    memset(buckets, 0, sizeof buckets);
+    for (int n = 0; n < bucketCount(p); ++n) ++buckets[p->bucket[n]];
+    for (int m = p->netioThreadIndex; m < p->threadCount; ++m) {
+        const Thread *const t = p->thread[m];
+        for (int n = 0; n < BUCKETCOUNT; ++n) {
+            packets[m] += t->bucketPackets[n];
+            bytes[m] += t->bucketBytes[n];
+        }
+        if (packets[m] || buckets[m] || m < forwarderEnd(p)) {
+            show("Thread %2d on CPU %2d: %-8s %-7s %3d buckets "
+                 "%10llu packets %12llu bytes",
+                 t->index, t->cpu, p->interface[t->interface],
+                 groupName[groupOf(p, m)], buckets[m], packets[m], bytes[m]);
+        }
+    }
+    char pinned[ALLBUCKETCOUNT];
+    const int pinnedRoutes = findPinnedBuckets(pinned);
+    int pinnedBuckets = 0;
+    for (int n = 0; n < bucketCount(p); ++n) pinnedBuckets += pinned[n];
+    show("%d pinned routes in %d buckets on %d reserved forwarders",
+         pinnedRoutes, pinnedBuckets, p->reserveCount);
+    for (int i = 0; i < p->interfaceCount; ++i) {
+        for (int g = 0; g < GROUPCOUNT; ++g) {
+            char member[p->threadCount];
+            for (int m = 0; m < p->threadCount; ++m) {
+                member[m] = m >= p->netioThreadIndex &&
+                    p->thread[m]->interface == i && groupOf(p, m) == g;
+            }
+            int hot, cold;
+            unsigned long long total;
+            const int count =
+                findHotAndCold(p, packets, i, g, &hot, &cold, &total);
+            if (count) {
+                show("Group %-8s on %s: load spread is %llu%% of mean "
+                     "from thread %d to thread %d",
+                     groupName[g], p->interface[i],
+                     spreadOf(packets, hot, cold, count, total), hot, cold);
+                stageShowGroup(p, groupName[g], member);
+            }
+        }
+    }
+    if (balance.resizes) {
+        show("Resized forwarders %llu times moving %llu buckets "
+             "with %llu packets maybe out of order and %llu dropped",
+             balance.resizes, balance.resizeMoves,
+             balance.resizeReordered, balance.resizeDropped);
+    }
+    if (balance.moves) {
+        show("Rebalance moved %llu buckets (%llu between groups) "
+             "in %llu passes with %llu packets maybe out of order",
+             balance.moves, balance.placed, balance.passes,
+             balance.reordered);
+        for (int i = 0; i < p->interfaceCount; ++i) {
+            for (int g = 0; g < GROUPCOUNT; ++g) {
+                if (balance.spreadBefore[i][g]) {
+                    show("Last %s rebalance on %s took spread "
+                         "from %llu%% to %llu%%",
+                         groupName[g], p->interface[i],
+                         balance.spreadBefore[i][g],
+                         balance.spreadAfter[i][g]);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef INCLUDE_BUCKET_H
+#define INCLUDE_BUCKET_H
+
+
+// Rebalance the NETIO bucket map across the forwarding threads according
+// to the load measured on each bucket.
+//
+// The last Process.reserveCount forwarders are reserved for the buckets
+// of pinned routes, and the rest share all other buckets.  Each pass
+// first moves buckets into their right group, then balances each group.
+// A pinned route's bucket is learned from its packets, so a newly pinned
+// route moves on the first pass after its traffic arrives.  Buckets come
+// from a flow hash, so other routes hashing into a pinned bucket ride
+// along on the reserved forwarders.
+//
+// Each forwarder reads one interface, and buckets move only between the
+// forwarders of their own interface, so each interface balances alone.
+
+
+// The control thread rebalances every BALANCEMS milliseconds.  It moves
+// buckets only when the busiest forwarder carries BALANCEHYSTERESIS
+// percent more packets than the mean.  It moves at most BALANCEMOVES
+// buckets in a pass, and leaves a moved bucket where it is for
+// BALANCEHOLD passes.  Each move can reorder the packets in flight on a
+// bucket, so these limits keep reordering rare.
+//
+#define BALANCEMS (1000)
+#define BALANCEHYSTERESIS (25)
+#define BALANCEMOVES (4)
+#define BALANCEHOLD (10)
+
+// Resizing waits for a removed forwarder to go RESIZEDRAINMS without a
+// packet before stopping it, and gives up after RESIZEDRAINTRIES waits.
+// A forwarder stops only after its queue drains, so resizing loses no
+// packets, but packets in flight on moved buckets may arrive out of order.
+//
+#define RESIZEDRAINMS (10)
+#define RESIZEDRAINTRIES (100)
+
+
+// Defined in process.h.
+//
+struct Process;
+struct Thread;
+
+// Measure the load on each bucket in p since the last call, move pinned
+// buckets to the reserved forwarders and others off of them, then move
+// hot buckets from the busiest forwarders in each group to the least busy
+// ones with netio_input_bucket_configure() on t's queue for the interface.
+//
+extern void bucketRebalance(struct Process *p, struct Thread *t);
+
+// Start or stop forwarders in p until count run, moving buckets onto new
+// forwarders and draining them off of removed ones with t's queues.  Show
+// the packets that may be out of order or dropped while resizing.  Return
+// 0 or -1 if count forwarders are not running or count is fewer than the
+// interfaces.
+//
+extern int bucketResize(struct Process *p, struct Thread *t, int count);
+
+// Show the load spread, utilization, and packet latency of each group of
+// forwarders and the rebalancing history on the INFO log.
+//
+extern void bucketShow(const struct Process *p);
+
+
+#endif // INCLUDE_BUCKET_H
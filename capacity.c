@@ -0,0 +1,516 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "route.h"
+#include "util.h"
+
+
+static const char usage[] =
+    "                                                                     \n"
+    "%s: Predict the load on each forwarder of a switch from a channel    \n"
+    "    lineup on stdin.  You can build and run %s on any Unix system    \n"
+    "    because it does not depend on Tilera libraries.                  \n"
+    "                                                                     \n"
+    "Usage: %s [-propose] <forwarders> <cycles> <mhz> [<interfaces>       \n"
+    "           [<depth>]]                                                \n"
+    "                                                                     \n"
+    "Where: <forwarders> is the number of forwarders the switch runs, up  \n"
+    "             to %d.                                                  \n"
+    "       <cycles> is the cycles a forwarder spends on each packet, as  \n"
+    "             the switch shows for 'Thread n: ... packets at <cycles> \n"
+    "             cycles each' in its stats.                              \n"
+    "       <mhz> is the cycles per microsecond of the switch's tiles, as \n"
+    "             the switch shows when it stops.                         \n"
+    "       <interfaces> is the number of interfaces the switch forwards  \n"
+    "             on, up to %d.  The default is 1.                        \n"
+    "       <depth> is the packets a forwarder's queue holds before the   \n"
+    "             interface drops them.  The default is %d.               \n"
+    "                                                                     \n"
+    "Each route on stdin is a route command with a \"bps\" member giving  \n"
+    "the bits per second of its channel.  A \"size\" gives its Ethernet   \n"
+    "frame size, or it is %d bytes.  A \"source\" gives the UDP source    \n"
+    "port of its packets, or it is the \"from\" port.  An \"ingress\"     \n"
+    "gives the interface its packets arrive on, or it is 0.               \n"
+    "                                                                     \n"
+    "Buckets go to forwarders as initializeNetio() maps them.  A route    \n"
+    "lands in the \"bucket\" the switch's dump shows for it.  Otherwise,  \n"
+    "since the interface's flow hash is not public, %s hashes the UDP     \n"
+    "ports of the route's packets evenly into the %d buckets instead.     \n"
+    "                                                                     \n"
+    "%s shows each forwarder's routes, packets per second, load, mean     \n"
+    "queue, and the chance its queue fills, taking each queue as M/M/1.   \n"
+    "Then it shows the hottest forwarder and its headroom, both as the    \n"
+    "buckets start and as well as the rebalancer could spread them.       \n"
+    "                                                                     \n"
+    "With -propose, %s moves the routes to new \"from\" ports that spread \n"
+    "their load, heaviest route first, and writes the routes to stdout.   \n"
+    "Then it shows the load on stderr.  The proposal assumes the hash, so \n"
+    "check it against the buckets the switch dumps after it runs.         \n"
+    "                                                                     \n"
+    "Example: %s 8 900 866 < lineup.json                                  \n"
+    "                                                                     \n";
+
+// Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
+//
+// #define INFO(F, ...) info(F, ## __VA_ARGS__)
+#define INFO(F, ...)
+
+
+// The most forwarders a switch can run on its tiles, and the interfaces
+// and buckets of a switch as MAXINTERFACES and BUCKETCOUNT in process.h,
+// which needs Tilera headers.
+//
+#define CAPACITYFORWARDERS (64)
+#define CAPACITYINTERFACES (2)
+#define CAPACITYBUCKETS (512)
+
+// A route without a "size" sends frames of CAPACITYDEFAULTSIZE bytes,
+// which is 7 MPEG-TS packets in UDP over IPv4 and Ethernet.
+//
+#define CAPACITYDEFAULTSIZE (1358)
+
+// By default a forwarder's queue holds CAPACITYDEPTH packets.
+//
+#define CAPACITYDEPTH (1024)
+
+// A forwarder over CAPACITYHOT percent load is in trouble.
+//
+#define CAPACITYHOT (80)
+
+
+// Describe this program's validated command line.
+//
+typedef struct CapacityCommandLine {
+    const char *av0;
+    int propose;
+    int forwarders;
+    int cycles;
+    int mhz;
+    int interfaces;
+    int depth;
+} CapacityCommandLine;
+
+
+// Validate the command line (ac, av) and return the results.
+//
+static const CapacityCommandLine validateCapacityUsage(int ac,
+                                                       const char *av[])
+{
+    INFO("__: validateCapacityUsage(%d, %p)", ac, av);
+    const char *av0 = strrchr(av[0], "/"[0]); av0 = av0? 1 + av0: av[0];
+    CapacityCommandLine result = {
+        .av0 = av0, .interfaces = 1, .depth = CAPACITYDEPTH
+    };
+    result.propose = ac > 1 && 0 == strcmp(av[1], "-propose");
+    if (result.propose) {
+        --ac;
+        ++av;
+    }
+    if (ac > 3) {
+        result.forwarders = atoi(av[1]);
+        result.cycles = atoi(av[2]);
+        result.mhz = atoi(av[3]);
+    }
+    if (ac > 4) result.interfaces = atoi(av[4]);
+    if (ac > 5) result.depth = atoi(av[5]);
+    const int ok = ac > 3 && ac < 7 &&
+        result.forwarders > 0 && result.forwarders <= CAPACITYFORWARDERS &&
+        result.cycles > 0 && result.mhz > 0 && result.depth > 0 &&
+        result.interfaces > 0 && result.interfaces <= CAPACITYINTERFACES &&
+        result.interfaces <= result.forwarders;
+    if (!ok) {
+        fprintf(stderr, usage, av0, av0, av0, CAPACITYFORWARDERS,
+                CAPACITYINTERFACES, CAPACITYDEPTH, CAPACITYDEFAULTSIZE,
+                av0, CAPACITYBUCKETS, av0, av0, av0);
+        exit(1);
+    }
+    return result;
+}
+
+
+// A route in the lineup.
+//
+// .rt is the route.
+// .bps is the bits per second of its channel.
+// .size is the size of its Ethernet frames.
+// .source is the UDP source port of its packets.
+// .ingress is the interface its packets arrive on.
+// .bucket is the bucket the switch dumped for it, or -1.
+// .pps is its packets per second.
+//
+typedef struct CapacityRoute {
+    Route rt;
+    int bps;
+    int size;
+    int source;
+    int ingress;
+    int bucket;
+    double pps;
+} CapacityRoute;
+
+
+// The load of a lineup on a switch.
+//
+// .b2q[i][n] is the forwarder bucket n on interface i maps to.
+// .bucketPps[i][n] is the packets per second in bucket n on interface i.
+// .pps[f] is the packets per second forwarder f gets.
+// .routes[f] counts the routes forwarder f gets.
+//
+typedef struct CapacityLoad {
+    int b2q[CAPACITYINTERFACES][CAPACITYBUCKETS];
+    double bucketPps[CAPACITYINTERFACES][CAPACITYBUCKETS];
+    double pps[CAPACITYFORWARDERS];
+    int routes[CAPACITYFORWARDERS];
+} CapacityLoad;
+
+
+// Read all of fd into a new buffer and set *size to its size.  Return
+// the buffer or exit.
+//
+static char *readAll(int fd, size_t *size)
+{
+    size_t capacity = 1 << 16;
+    char *result = malloc(capacity);
+    *size = 0;
+    while (result) {
+        if (*size == capacity) {
+            capacity *= 2;
+            char *const more = realloc(result, capacity);
+            if (!more) free(result);
+            result = more;
+            if (!result) break;
+        }
+        const ssize_t count = read(fd, result + *size, capacity - *size);
+        if (count == 0) return result;
+        if (count > 0) {
+            *size += count;
+        } else if (errno != EINTR) {
+            error("__: read(%d) failed with errno %d: %s",
+                  fd, errno, strerror(errno));
+            exit(1);
+        }
+    }
+    error("__: Cannot allocate %zu bytes for stdin", capacity);
+    exit(1);
+}
+
+
+// Parse into route the routes in the size bytes of JSON at s, and return
+// how many there are.  Show and skip anything that is not an open route
+// with a "bps" for an interface of cl.
+//
+static int parseRoutes(const CapacityCommandLine *cl, const char *s,
+                       size_t size, CapacityRoute *route)
+{
+    Json j;
+    jsonInitialize(&j, s, size);
+    JsonMember m[JSONMEMBERS];
+    int result = 0;
+    int count = 0;
+    while ((count = jsonObject(&j, m, JSONMEMBERS)) != JSONEND) {
+        if (count == JSONPARTIAL) {
+            error("__: Input ends inside: %.*s",
+                  (int)(size - j.begin), s + j.begin);
+            break;
+        }
+        if (count == JSONERROR) {
+            error("__: Cannot parse: %.*s",
+                  (int)(j.at - j.begin), s + j.begin);
+            continue;
+        }
+        const JsonToken *const sizeToken = jsonFind(m, count, "size");
+        const JsonToken *const source = jsonFind(m, count, "source");
+        const JsonToken *const ingress = jsonFind(m, count, "ingress");
+        const JsonToken *const bucket = jsonFind(m, count, "bucket");
+        CapacityRoute r = {
+            .rt = routeFromJson(m, count),
+            .size = CAPACITYDEFAULTSIZE, .bucket = -1
+        };
+        r.source = r.rt.poa;
+        const int ok = r.rt.poa >= 0 && r.rt.dst.port > 0 &&
+            result < R30TOTALCHANNELS &&
+            jsonInt(jsonFind(m, count, "bps"), &r.bps) && r.bps > 0 &&
+            (!sizeToken || jsonInt(sizeToken, &r.size)) && r.size > 0 &&
+            (!source || jsonInt(source, &r.source)) &&
+            (!ingress || jsonInt(ingress, &r.ingress)) &&
+            r.ingress >= 0 && r.ingress < cl->interfaces &&
+            (!bucket || jsonInt(bucket, &r.bucket));
+        if (!ok) {
+            error("__: Skipping: %.*s", (int)(j.at - j.begin), s + j.begin);
+            continue;
+        }
+        if (r.bucket >= 0 && r.bucket / CAPACITYBUCKETS != r.ingress) {
+            r.bucket = -1;
+        }
+        r.pps = r.bps / (8.0 * r.size);
+        route[result++] = r;
+    }
+    return result;
+}
+
+
+// Return a stand-in for the interface's flow hash of a UDP packet from
+// port source to port poa.  This mixes the ports evenly over the bits
+// of the result as the hardware hash is meant to.
+//
+static unsigned int flowHash(int source, int poa)
+{
+    unsigned int result = (source << 16) ^ poa;
+    result ^= result >> 16;
+    result *= 0x85ebca6b;
+    result ^= result >> 13;
+    result *= 0xc2b2ae35;
+    result ^= result >> 16;
+    return result;
+}
+
+
+// Return the bucket on its interface of the packets of r, ignoring the
+// bucket the switch dumped if hash is true.
+//
+static int routeBucket(const CapacityRoute *r, int hash)
+{
+    if (!hash && r->bucket >= 0) return r->bucket % CAPACITYBUCKETS;
+    return flowHash(r->source, r->rt.poa) % CAPACITYBUCKETS;
+}
+
+
+// Map the buckets of load to the forwarders of cl as initializeNetio()
+// does.  Forwarder f reads interface f % cl->interfaces, and the buckets
+// of each interface go to its forwarders in turn.
+//
+static void mapBuckets(const CapacityCommandLine *cl, CapacityLoad *load)
+{
+    for (int i = 0; i < cl->interfaces; ++i) {
+        int forwarders[CAPACITYFORWARDERS];
+        int count = 0;
+        for (int f = i; f < cl->forwarders; f += cl->interfaces) {
+            forwarders[count++] = f;
+        }
+        for (int n = 0; n < CAPACITYBUCKETS; ++n) {
+            load->b2q[i][n] = forwarders[n % count];
+        }
+    }
+}
+
+
+// Add the count routes at route into load, hashing them all if hash is
+// true.
+//
+static void addRoutes(CapacityLoad *load, const CapacityRoute *route,
+                      int count, int hash)
+{
+    for (int n = 0; n < count; ++n) {
+        const CapacityRoute *const r = route + n;
+        const int b = routeBucket(r, hash);
+        const int f = load->b2q[r->ingress][b];
+        load->bucketPps[r->ingress][b] += r->pps;
+        load->pps[f] += r->pps;
+        ++load->routes[f];
+    }
+}
+
+
+// Return the share of its cycles a forwarder of cl spends on pps packets
+// per second.
+//
+static double utilization(const CapacityCommandLine *cl, double pps)
+{
+    return pps * cl->cycles / (1e6 * cl->mhz);
+}
+
+
+// Return the chance that a forwarder of cl at utilization u has a full
+// queue, taking the queue as M/M/1.  Real video arrives more evenly, so
+// this errs high.
+//
+static double dropRisk(const CapacityCommandLine *cl, double u)
+{
+    if (u >= 1) return 1;
+    double result = 1;
+    for (int n = 0; n < cl->depth && result > 0; ++n) result *= u;
+    return result;
+}
+
+
+// Return the utilization of the busiest forwarder on interface i of cl
+// if the rebalancer spread the buckets of load as evenly as it could,
+// moving the hottest bucket to the least loaded forwarder first.
+//
+static double balancedPeak(const CapacityCommandLine *cl,
+                           const CapacityLoad *load, int i)
+{
+    double pps[CAPACITYFORWARDERS] = {};
+    int moved[CAPACITYBUCKETS] = {};
+    for (int k = 0; k < CAPACITYBUCKETS; ++k) {
+        int hot = -1;
+        for (int n = 0; n < CAPACITYBUCKETS; ++n) {
+            if (moved[n]) continue;
+            if (hot < 0 || load->bucketPps[i][n] > load->bucketPps[i][hot]) {
+                hot = n;
+            }
+        }
+        if (load->bucketPps[i][hot] == 0) break;
+        int cool = i;
+        for (int f = i; f < cl->forwarders; f += cl->interfaces) {
+            if (pps[f] < pps[cool]) cool = f;
+        }
+        pps[cool] += load->bucketPps[i][hot];
+        moved[hot] = 1;
+    }
+    double result = 0;
+    for (int f = i; f < cl->forwarders; f += cl->interfaces) {
+        const double u = utilization(cl, pps[f]);
+        if (u > result) result = u;
+    }
+    return result;
+}
+
+
+// Show on out the load of the count routes in load on the forwarders of
+// cl.
+//
+static void showLoad(FILE *out, const CapacityCommandLine *cl,
+                     const CapacityLoad *load, int count)
+{
+    double total = 0;
+    int hottest = 0;
+    for (int f = 0; f < cl->forwarders; ++f) {
+        const double u = utilization(cl, load->pps[f]);
+        const double queue = u < 1 ? u * u / (1 - u) : -1;
+        total += load->pps[f];
+        if (load->pps[f] > load->pps[hottest]) hottest = f;
+        fprintf(out, "Forwarder %2d on interface %d: %4d routes %10.0f "
+                "packets/s load %5.1f%% queue ", f, f % cl->interfaces,
+                load->routes[f], load->pps[f], 100 * u);
+        if (queue < 0) {
+            fprintf(out, "   grows");
+        } else {
+            fprintf(out, "%8.1f", queue);
+        }
+        fprintf(out, " full %.1e%s\n", dropRisk(cl, u),
+                100 * u > CAPACITYHOT ? " hot" : "");
+    }
+    const double u = utilization(cl, load->pps[hottest]);
+    fprintf(out, "%d routes carry %.0f packets/s for %d forwarders at %d "
+            "cycles each\n", count, total, cl->forwarders, cl->cycles);
+    fprintf(out, "Hottest forwarder %d is at %.1f%% load with %.1f%% "
+            "headroom and its queue full %.1e of the time\n",
+            hottest, 100 * u, u < 1 ? 100 * (1 - u) : 0.0, dropRisk(cl, u));
+    for (int i = 0; i < cl->interfaces; ++i) {
+        int hot = 0;
+        for (int n = 0; n < CAPACITYBUCKETS; ++n) {
+            if (load->bucketPps[i][n] > load->bucketPps[i][hot]) hot = n;
+        }
+        const double peak = balancedPeak(cl, load, i);
+        fprintf(out, "Interface %d rebalanced peaks at %.1f%% load, and "
+                "its hottest bucket %d alone is %.1f%%\n", i, 100 * peak,
+                i * CAPACITYBUCKETS + hot,
+                100 * utilization(cl, load->bucketPps[i][hot]));
+    }
+}
+
+
+// Compare the packets per second of routes at a and b, heaviest first.
+//
+static int heavierRoute(const void *a, const void *b)
+{
+    const double pa = ((const CapacityRoute *)a)->pps;
+    const double pb = ((const CapacityRoute *)b)->pps;
+    return pa < pb ? 1 : pa > pb ? -1 : 0;
+}
+
+
+// Move the count routes at route onto new "from" ports that spread their
+// load over the forwarders of cl, with load mapping the buckets.  Give
+// each route, heaviest first, the free port that puts it on the least
+// loaded forwarder and then in the least loaded bucket.  A route whose
+// "source" was its "from" port keeps them equal.
+//
+static void proposePorts(const CapacityCommandLine *cl, CapacityLoad *load,
+                         CapacityRoute *route, int count)
+{
+    static char used[R30TOTALCHANNELS];
+    qsort(route, count, sizeof *route, heavierRoute);
+    for (int n = 0; n < count; ++n) {
+        CapacityRoute *const r = route + n;
+        const int same = r->source == r->rt.poa;
+        const int i = r->ingress;
+        int best = -1, bestBucket = 0;
+        for (int port = 0; port < R30TOTALCHANNELS; ++port) {
+            if (used[port]) continue;
+            const int poa = PORTOFFSET + port;
+            const int b = flowHash(same ? poa : r->source, poa)
+                % CAPACITYBUCKETS;
+            const int f = load->b2q[i][b];
+            const int g = best < 0 ? 0 : load->b2q[i][bestBucket];
+            const int better = best < 0 || load->pps[f] < load->pps[g] ||
+                (load->pps[f] == load->pps[g] &&
+                 load->bucketPps[i][b] < load->bucketPps[i][bestBucket]);
+            if (better) {
+                best = port;
+                bestBucket = b;
+            }
+        }
+        used[best] = 1;
+        r->rt.poa = PORTOFFSET + best;
+        if (same) r->source = r->rt.poa;
+        r->bucket = -1;
+        const int f = load->b2q[i][bestBucket];
+        load->bucketPps[i][bestBucket] += r->pps;
+        load->pps[f] += r->pps;
+        ++load->routes[f];
+    }
+}
+
+
+// Write the count routes at route to out as route commands with every
+// member routeToString() writes, and the members only capacity reads.
+//
+static void writeRoutes(FILE *out, const CapacityRoute *route, int count)
+{
+    for (int n = 0; n < count; ++n) {
+        const CapacityRoute *const r = route + n;
+        const unsigned char *const i = r->rt.dst.ip;
+        const unsigned char *const m = r->rt.dst.mac;
+        fprintf(out, "{ \"from\" : %d , \"port\" : %d , \"ip\" : \"" IPFMT
+                "\" , \"mac\" : \"" MACFMT "\" , \"priority\" : %d , "
+                "\"egress\" : %d ,\n  \"rate\" : %d , \"burst\" : %d , "
+                "\"shape\" : %d , \"shapeBurst\" : %d ,\n  \"bps\" : %d , "
+                "\"size\" : %d , \"source\" : %d , \"ingress\" : %d }\n",
+                r->rt.poa, r->rt.dst.port, i[0], i[1], i[2], i[3],
+                m[0], m[1], m[2], m[3], m[4], m[5], r->rt.priority,
+                r->rt.egress, r->rt.rate, r->rt.burst, r->rt.shape,
+                r->rt.shapeBurst, r->bps, r->size, r->source, r->ingress);
+    }
+}
+
+
+int main(int ac, const char *av[])
+{
+    INFO("__: main(%d, %p)", ac, av);
+    const CapacityCommandLine cl = validateCapacityUsage(ac, av);
+    errorInitialize(cl.av0);
+    size_t size = 0;
+    char *const s = readAll(0, &size);
+    static CapacityRoute route[R30TOTALCHANNELS];
+    const int count = parseRoutes(&cl, s, size, route);
+    static CapacityLoad load;
+    mapBuckets(&cl, &load);
+    if (cl.propose) {
+        proposePorts(&cl, &load, route, count);
+        writeRoutes(stdout, route, count);
+        showLoad(stderr, &cl, &load, count);
+    } else {
+        addRoutes(&load, route, count, 0);
+        showLoad(stdout, &cl, &load, count);
+    }
+    free(s);
+    const int status = count ? 0 : 1;
+    INFO("__: Exiting with status %d", status);
+    return status;
+}
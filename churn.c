@@ -0,0 +1,572 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "churn.h"
+#include "json.h"
+#include "packets.h"
+#include "route.h"
+#include "util.h"
+
+
+// Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
+//
+// #define INFO(F, ...) info(F, ## __VA_ARGS__)
+#define INFO(F, ...)
+
+
+// The number of log2 buckets in a ChurnLatency histogram.  Bucket n
+// counts samples of [1 << n, 1 << (n + 1)) nanoseconds, and the last
+// bucket also counts anything longer.
+//
+#define CHURNHISTOGRAMCOUNT (40)
+
+
+// Latency samples, which packet threads add to concurrently.
+//
+// .count is the number of samples.
+// .max is the largest sample.
+// .histogram counts samples in log2 buckets.
+//
+typedef struct ChurnLatency {
+    unsigned long long count;
+    unsigned long long max;
+    unsigned long long histogram[CHURNHISTOGRAMCOUNT];
+} ChurnLatency;
+
+
+// What churn measures at one rate.
+//
+// .sent counts the route changes sent to the switch.
+// .skipped counts changes not sent because the route's last change had
+//          not yet shown up in its packets.
+// .acked is the sequence number of the last change the switch acked.
+// .nacks counts changes the switch nacked.
+// .inflight counts packets that arrived on a route's old port after the
+//           change was sent and before one arrived on the new port.
+// .misrouted counts packets that arrived on a route's old port after one
+//            arrived on the new port.
+// .stale counts packets sent after the switch acked a change that still
+//        arrived on the route's old port.
+// .wrong counts packets that arrived at a port and addresses that were
+//        never together one of their route's destinations, as a torn or
+//        misprogrammed route would send them.
+// .ack is the time from sending a change to its ack.
+// .propagate is the time from sending a change to the first packet on
+//            the route's new port.
+//
+typedef struct ChurnStats {
+    int sent;
+    int skipped;
+    int acked;
+    int nacks;
+    unsigned long long inflight;
+    unsigned long long misrouted;
+    unsigned long long stale;
+    unsigned long long wrong;
+    ChurnLatency ack;
+    ChurnLatency propagate;
+} ChurnStats;
+
+
+// What happened to the packets of one churned route.  The route's home
+// and away ports can arrive on different packet threads, so they add to
+// these concurrently, except .changes, which only churnRun() writes.
+//
+// .next is one more than the highest packet number received.
+// .packets counts the packets received.
+// .gaps counts the packet numbers skipped over, lost or late.
+// .late counts packets that arrived after a higher numbered one.
+// .misrouted, .stale, and .wrong count as in ChurnStats.
+// .changes counts the changes sent for the route.
+//
+typedef struct ChurnCounts {
+    unsigned long long next;
+    unsigned long long packets;
+    unsigned long long gaps;
+    unsigned long long late;
+    unsigned long long misrouted;
+    unsigned long long stale;
+    unsigned long long wrong;
+    unsigned long long changes;
+} ChurnCounts;
+
+
+// The last change sent for a route.
+//
+// .id numbers the change from 1 or is 0 for no change.
+// .seq is the sequence number of the command to the switch.
+// .from and .to are the ports the change moved the route between.
+// .sentNs, .ackNs, and .firstNs are when the change was sent, acked, and
+//          first showed up in a packet on .to, or 0 if not yet.
+// .ackedBelow is the route's packet number when the ack came back, so
+//             every packet at or above it should arrive on .to.
+// .begin is the route's ChurnCounts when the change was sent.
+//
+typedef struct ChurnChange {
+    int id;
+    int seq;
+    int from;
+    int to;
+    unsigned long long sentNs;
+    volatile unsigned long long ackNs;
+    volatile unsigned long long firstNs;
+    volatile unsigned long long ackedBelow;
+    ChurnCounts begin;
+} ChurnChange;
+
+
+// The number of routes the tester opened, and the first churned routes
+// of those, or 0 when not churning.
+//
+static int openRoutes;
+static int churnRoutes;
+
+// The addresses of the home and away destinations, with no port.
+//
+static Endpoint homeEndpoint;
+static Endpoint awayEndpoint;
+
+// The sequence number of the last route change sent, and the id of the
+// last change.
+//
+static int seq;
+static int lastId;
+
+// The next route to change.
+//
+static int cursor;
+
+// The measurements at the current rate.
+//
+static ChurnStats stats;
+
+// The port route n should arrive on, the port a change to route n has
+// not yet shown up on or 0, the last change of route n, what happened to
+// its packets, and what had happened when churning at the current rate
+// began.
+//
+static volatile int current[CHURNMAXROUTES];
+static volatile int pending[CHURNMAXROUTES];
+static ChurnChange change[CHURNMAXROUTES];
+static ChurnCounts counts[CHURNMAXROUTES];
+static ChurnCounts base[CHURNMAXROUTES];
+
+// When each change in the window was sent and which route it changed,
+// indexed by sequence number.
+//
+static unsigned long long sentNs[CHURNWINDOW];
+static int sentRoute[CHURNWINDOW];
+
+
+// Count the latency sample ns into l.
+//
+static void latencyCount(ChurnLatency *l, unsigned long long ns)
+{
+    int n = 0;
+    while (n < CHURNHISTOGRAMCOUNT - 1 && ns >> (n + 1)) ++n;
+    __sync_fetch_and_add(&l->histogram[n], 1);
+    __sync_fetch_and_add(&l->count, 1);
+    unsigned long long max = l->max;
+    while (ns > max && !__sync_bool_compare_and_swap(&l->max, max, ns)) {
+        max = l->max;
+    }
+}
+
+
+// Return an upper bound in microseconds on the percent percentile of the
+// samples in l.
+//
+static unsigned long long percentileUs(const ChurnLatency *l, int percent)
+{
+    const unsigned long long want = (l->count * percent + 99) / 100;
+    unsigned long long sofar = 0;
+    int n = 0;
+    for (; n < CHURNHISTOGRAMCOUNT - 1; ++n) {
+        sofar += l->histogram[n];
+        if (sofar >= want) break;
+    }
+    const unsigned long long ns = 1ULL << (n + 1);
+    return (ns < l->max ? ns : l->max) / 1000;
+}
+
+
+// Return the packets lost from the gaps and late packets in a count.
+//
+static unsigned long long lost(unsigned long long gaps,
+                               unsigned long long late)
+{
+    return gaps > late ? gaps - late : 0;
+}
+
+
+// Count into c the gap or lateness of the packet numbered number.
+//
+static void countNumber(ChurnCounts *c, unsigned long long number)
+{
+    unsigned long long next = c->next;
+    while (number >= next) {
+        if (__sync_bool_compare_and_swap(&c->next, next, number + 1)) {
+            if (number > next) __sync_fetch_and_add(&c->gaps, number - next);
+            return;
+        }
+        next = c->next;
+    }
+    __sync_fetch_and_add(&c->late, 1);
+}
+
+
+void churnInitialize(int routes, int subset, const Endpoint *home,
+                     Endpoint *away)
+{
+    INFO("__: churnInitialize(%d, %d, %p, %p)", routes, subset, home, away);
+    openRoutes = routes < CHURNMAXROUTES ? routes : CHURNMAXROUTES;
+    churnRoutes = subset > 0 && subset < openRoutes ? subset : openRoutes;
+    for (int n = 0; n < churnRoutes; ++n) current[n] = PORTOFFSET + n;
+    homeEndpoint = *home;
+    homeEndpoint.port = 0;
+    awayEndpoint = homeEndpoint;
+    awayEndpoint.ip[3] ^= 1;
+    awayEndpoint.mac[0] ^= 2;           // flip the locally administered bit
+    *away = awayEndpoint;
+}
+
+
+// Return true if a packet arriving on poa at mac and ip could have come
+// from route n with its destination at home or away, whether or not the
+// route had that destination when the packet was sent.
+//
+static int rightDestination(int n, int poa, const unsigned char *mac,
+                            const unsigned char *ip)
+{
+    const int home = PORTOFFSET + n;
+    const int churned = n < churnRoutes;
+    const Endpoint *const e = poa == home ? &homeEndpoint
+        : churned && poa == home + openRoutes ? &awayEndpoint : NULL;
+    return e && 0 == memcmp(mac, e->mac, sizeof e->mac) &&
+        0 == memcmp(ip, e->ip, sizeof e->ip);
+}
+
+
+int churnArrival(int poa, const unsigned char *mac, const unsigned char *ip,
+                 int source, unsigned long long number)
+{
+    const int n = source - PORTOFFSET;
+    if (n < 0 || n >= openRoutes) return poa;
+    const int home = PORTOFFSET + n;
+    const int right = rightDestination(n, poa, mac, ip);
+    if (n >= churnRoutes) {
+        if (!right) __sync_fetch_and_add(&stats.wrong, 1);
+        return home;
+    }
+    ChurnCounts *const c = &counts[n];
+    __sync_fetch_and_add(&c->packets, 1);
+    countNumber(c, number);
+    if (!right) {
+        __sync_fetch_and_add(&c->wrong, 1);
+        __sync_fetch_and_add(&stats.wrong, 1);
+        return home;
+    }
+    const int target = pending[n];
+    if (target == poa) {
+        if (__sync_bool_compare_and_swap(&pending[n], target, 0)) {
+            const unsigned long long now = clockNs(CLOCK_MONOTONIC);
+            change[n].firstNs = now;
+            latencyCount(&stats.propagate, now - change[n].sentNs);
+        }
+    } else if (target) {
+        __sync_fetch_and_add(&stats.inflight, 1);
+    } else if (poa != current[n]) {
+        __sync_fetch_and_add(&c->misrouted, 1);
+        __sync_fetch_and_add(&stats.misrouted, 1);
+    }
+    if (poa != current[n] && number >= change[n].ackedBelow) {
+        __sync_fetch_and_add(&c->stale, 1);
+        __sync_fetch_and_add(&stats.stale, 1);
+    }
+    return home;
+}
+
+
+// Show route n's change as a line of JSON on stdout if it has one.
+//
+static void showChange(int n)
+{
+    const ChurnChange *const x = &change[n];
+    if (!x->id) return;
+    const ChurnCounts *const c = &counts[n];
+    const ChurnCounts *const b = &x->begin;
+    const unsigned long long ackNs = x->ackNs, firstNs = x->firstNs;
+    printf("{ \"change\" : %d , \"route\" : %d , \"from\" : %d ,"
+           " \"to\" : %d , \"ackUs\" : %lld , \"firstUs\" : %lld ,"
+           " \"packets\" : %llu , \"lost\" : %llu , \"reordered\" : %llu ,"
+           " \"misrouted\" : %llu , \"stale\" : %llu , \"wrong\" : %llu }\n",
+           x->id, PORTOFFSET + n, x->from, x->to,
+           ackNs ? (long long)(ackNs - x->sentNs) / 1000 : -1LL,
+           firstNs ? (long long)(firstNs - x->sentNs) / 1000 : -1LL,
+           c->packets - b->packets,
+           lost(c->gaps - b->gaps, c->late - b->late), c->late - b->late,
+           c->misrouted - b->misrouted, c->stale - b->stale,
+           c->wrong - b->wrong);
+}
+
+
+// Show each churned route that changed at the current rate as a line of
+// JSON on stdout.
+//
+static void showRoutes(void)
+{
+    for (int n = 0; n < churnRoutes; ++n) {
+        const ChurnCounts *const c = &counts[n];
+        const ChurnCounts *const b = &base[n];
+        if (c->changes == b->changes) continue;
+        printf("{ \"route\" : %d , \"changes\" : %llu , \"packets\" : %llu ,"
+               " \"lost\" : %llu , \"reordered\" : %llu ,"
+               " \"misrouted\" : %llu , \"stale\" : %llu ,"
+               " \"wrong\" : %llu }\n",
+               PORTOFFSET + n, c->changes - b->changes,
+               c->packets - b->packets,
+               lost(c->gaps - b->gaps, c->late - b->late), c->late - b->late,
+               c->misrouted - b->misrouted, c->stale - b->stale,
+               c->wrong - b->wrong);
+    }
+}
+
+
+// Send on fd a sequenced change of the next route to its other port.
+// Return 1 if the route's last change has not shown up yet, so nothing
+// was sent.  Otherwise return 0.
+//
+static int changeRoute(int fd)
+{
+    const int n = cursor;
+    cursor = (cursor + 1) % churnRoutes;
+    if (pending[n]) return 1;
+    const int home = PORTOFFSET + n;
+    const int port = current[n] == home ? home + openRoutes : home;
+    Route rt = routeFromPortOfArrival(home);
+    rt.dst = port == home ? homeEndpoint : awayEndpoint;
+    rt.dst.port = port;
+    char route[999];
+    const int size = routeToString(&rt, route, sizeof route);
+    char buffer[sizeof route + 32];
+    const int total = size < 0 ? -1 :
+        snprintf(buffer, sizeof buffer, "{ \"seq\" : %d , %s", seq + 1,
+                 strchr(route, '{') + 1);
+    if (total < 0 || total >= sizeof buffer) {
+        error("__: changeRoute(%d) cannot encode route %d", fd, n);
+        return 0;
+    }
+    showChange(n);
+    ++seq;
+    ++stats.sent;
+    ++counts[n].changes;
+    const ChurnChange x = {
+        .id = ++lastId, .seq = seq, .from = current[n], .to = port,
+        .sentNs = clockNs(CLOCK_MONOTONIC), .ackedBelow = ~0ULL,
+        .begin = counts[n]
+    };
+    change[n] = x;
+    sentNs[seq % CHURNWINDOW] = x.sentNs;
+    sentRoute[seq % CHURNWINDOW] = n;
+    __sync_synchronize();
+    pending[n] = port;
+    current[n] = port;
+    __sync_synchronize();
+    sendControl(fd, buffer, total + 1);
+    return 0;
+}
+
+
+// Note that the switch acked change s at ns.
+//
+static void ackChange(int s, unsigned long long ns)
+{
+    latencyCount(&stats.ack, ns - sentNs[s % CHURNWINDOW]);
+    const int n = sentRoute[s % CHURNWINDOW];
+    if (change[n].seq == s) {
+        change[n].ackedBelow = packetsSent(n);
+        change[n].ackNs = ns;
+    }
+}
+
+
+// Read size bytes from fd into buffer.  Return 0 or -1 on EOF or error.
+//
+static int readAll(int fd, char *buffer, size_t size)
+{
+    while (size > 0) {
+        const int rSize = read(fd, buffer, size);
+        if (rSize <= 0) {
+            error("__: readAll(%d) read(%d, %p, %zu) returned %d "
+                  "with errno %d: %s", fd, fd, buffer, size, rSize,
+                  errno, strerror(errno));
+            return -1;
+        }
+        buffer += rSize;
+        size -= rSize;
+    }
+    return 0;
+}
+
+
+// Read an ack or nack from fd, and count it.  Return 0 or -1 on error.
+//
+static int readReply(int fd)
+{
+    int size = 0;
+    char buffer[999];
+    if (readAll(fd, (char *)&size, sizeof size)) return -1;
+    if (size <= 0 || size > sizeof buffer) {
+        error("__: readReply(%d) got size %d", fd, size);
+        return -1;
+    }
+    if (readAll(fd, buffer, size)) return -1;
+    const unsigned long long ns = clockNs(CLOCK_MONOTONIC);
+    Json j;
+    JsonMember m[JSONMEMBERS];
+    jsonInitialize(&j, buffer, size);
+    const int count = jsonObject(&j, m, JSONMEMBERS);
+    int ack = 0;
+    int nack = 0;
+    if (jsonInt(jsonFind(m, count, "ack"), &ack)) {
+        for (; stats.acked < ack; ++stats.acked) {
+            ackChange(stats.acked + 1, ns);
+        }
+    } else if (jsonInt(jsonFind(m, count, "nack"), &nack)) {
+        ++stats.nacks;
+        error("__: readReply(%d) got nack: %.*s", fd, size, buffer);
+    } else {
+        error("__: readReply(%d) got: %.*s", fd, size, buffer);
+    }
+    return 0;
+}
+
+
+// Wait up to ns nanoseconds for a reply on fd and read it.  Return 1 if
+// a reply was read, 0 if none came, or -1 if the connection failed.
+//
+static int waitReply(int fd, unsigned long long ns)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    const struct timespec ts = {
+        .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL
+    };
+    const int ready = ppoll(&pfd, 1, &ts, NULL);
+    if (ready < 0 && errno != EINTR) {
+        error("__: waitReply(%d) ppoll() returned %d with errno %d: %s",
+              fd, ready, errno, strerror(errno));
+        return -1;
+    }
+    return ready > 0 ? readReply(fd) ? -1 : 1 : 0;
+}
+
+
+// Read every reply already waiting on fd without blocking, so acks are
+// timed when they arrive rather than when churning next waits.  Return 0
+// or -1 if the connection failed.
+//
+static int drainReplies(int fd)
+{
+    int result = 1;
+    while (result > 0) result = waitReply(fd, 0);
+    return result;
+}
+
+
+// Show the measurements of churning at rate for ns nanoseconds, where
+// the last ack came ackNs after churning began.
+//
+static void showStats(int rate, unsigned long long ns,
+                      unsigned long long ackNs)
+{
+    const ChurnLatency *const a = &stats.ack;
+    const ChurnLatency *const l = &stats.propagate;
+    int unseen = 0;
+    unsigned long long gaps = 0, late = 0;
+    for (int n = 0; n < churnRoutes; ++n) {
+        unseen += pending[n] != 0;
+        gaps += counts[n].gaps - base[n].gaps;
+        late += counts[n].late - base[n].late;
+    }
+    const double perSecond = ackNs ? 1e9 * stats.acked / ackNs : 0;
+    printf("{ \"rate\" : %d , \"seconds\" : %.3f , \"routes\" : %d ,"
+           " \"churned\" : %d , \"sent\" : %d , \"skipped\" : %d ,"
+           " \"acked\" : %d , \"nacks\" : %d , \"applyPerSecond\" : %.0f ,"
+           " \"ackUs\" : { \"p50\" : %llu , \"p99\" : %llu ,"
+           " \"max\" : %llu } ,"
+           " \"propagateUs\" : { \"count\" : %llu , \"p50\" : %llu ,"
+           " \"p99\" : %llu , \"max\" : %llu } ,"
+           " \"lost\" : %llu , \"reordered\" : %llu , \"inflight\" : %llu ,"
+           " \"misrouted\" : %llu , \"stale\" : %llu , \"wrong\" : %llu ,"
+           " \"unseen\" : %d }\n",
+           rate, ns / 1e9, openRoutes,
+           churnRoutes, stats.sent, stats.skipped,
+           stats.acked, stats.nacks, perSecond,
+           percentileUs(a, 50), percentileUs(a, 99), a->max / 1000,
+           l->count, percentileUs(l, 50),
+           percentileUs(l, 99), l->max / 1000,
+           lost(gaps, late), late, stats.inflight,
+           stats.misrouted, stats.stale, stats.wrong,
+           unseen);
+    fflush(stdout);
+}
+
+
+int churnRun(int fd, int rate, int seconds)
+{
+    INFO("__: churnRun(%d, %d, %d)", fd, rate, seconds);
+    static const unsigned long long second = 1000000000ULL;
+    static const ChurnStats zeroStats;
+    static const unsigned long long settleNs = 1000000000ULL;
+    stats = zeroStats;
+    stats.acked = seq;
+    memcpy(base, counts, sizeof base);
+    const int first = seq;
+    const unsigned long long begin = clockNs(CLOCK_MONOTONIC);
+    const unsigned long long end = begin + seconds * second;
+    unsigned long long ackNs = 0;
+    int fail = 0;
+    unsigned long long now = begin;
+    while (!fail && now < end) {
+        const int acked = stats.acked;
+        fail = drainReplies(fd);
+        if (fail) break;
+        const int tries = stats.sent + stats.skipped;
+        const unsigned long long dueNs = rate ?
+            begin + tries * second / rate : now;
+        const int open = seq - stats.acked < CHURNWINDOW;
+        if (open && dueNs <= now) {
+            if (changeRoute(fd) && rate) ++stats.skipped;
+        } else {
+            const unsigned long long waitNs = open ? dueNs - now : second;
+            const unsigned long long left = end - now;
+            fail = waitReply(fd, waitNs < left ? waitNs : left) < 0;
+        }
+        if (stats.acked != acked) ackNs = clockNs(CLOCK_MONOTONIC) - begin;
+        now = clockNs(CLOCK_MONOTONIC);
+    }
+    const unsigned long long ns = now - begin;
+    const unsigned long long settle = now + settleNs;
+    while (!fail && stats.acked < seq && now < settle) {
+        fail = waitReply(fd, settle - now) < 0;
+        now = clockNs(CLOCK_MONOTONIC);
+    }
+    if (stats.acked > first) ackNs = now - begin;
+    stats.acked -= first;
+    for (int n = 0; n < churnRoutes; ++n) {
+        showChange(n);
+        change[n].id = 0;
+    }
+    showRoutes();
+    showStats(rate, ns, ackNs);
+    const int result = fail || stats.stale || stats.wrong;
+    if (result) {
+        error("__: Churn at rate %d failed with %llu stale and %llu wrong "
+              "packets", rate, stats.stale, stats.wrong);
+    }
+    return result;
+}
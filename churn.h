@@ -0,0 +1,67 @@
+#ifndef INCLUDE_CHURN_H
+#define INCLUDE_CHURN_H
+
+
+// Change routes on the switch while the tester's packets flow through
+// it, and measure how fast the switch applies the changes and how soon
+// its forwarders use them.
+//
+// Churn flips the destination of route n between its home endpoint, the
+// tester's IP and MAC addresses at port PORTOFFSET + n, and its away
+// endpoint, another IP and MAC address at port PORTOFFSET + n + routes,
+// where routes is the number of routes the tester opened.  Packets coming
+// back to either endpoint count for route n, which is the source port the
+// tester sent them from.
+//
+// The packets of every route show whether the switch ever sent one to a
+// destination the route never had, such as the home port at the away
+// addresses, as a torn copy of a route would.  They also show packets
+// sent to the old destination after the switch acked a change.  The
+// packets of each churned route also show the loss and reordering around
+// each change.
+
+
+#include "route.h"
+#include "util.h"
+
+
+// The most routes churn can flip, since each needs an away port too.
+//
+#define CHURNMAXROUTES (R30TOTALCHANNELS / 2)
+
+// The most rates one tester run can churn at.
+//
+#define CHURNRATES (8)
+
+// The most sequenced route changes in flight to the switch at once.
+//
+#define CHURNWINDOW (1024)
+
+
+// Churn the first subset of the routes the tester opened, or all of them
+// if subset is 0, between home and the away endpoint set in *away.  The
+// tester must take packets for the away MAC address too.  Churn nothing
+// if routes is 0.
+//
+extern void churnInitialize(int routes, int subset, const Endpoint *home,
+                            Endpoint *away);
+
+// Return the port of arrival of the route that packet number sent from
+// source and arriving on poa at the MAC address mac and IP address ip
+// belongs to, and count the arrival in the measurements.  Packet threads
+// call this on every packet.
+//
+extern int churnArrival(int poa, const unsigned char *mac,
+                        const unsigned char *ip, int source,
+                        unsigned long long number);
+
+// Change routes at rate changes per second for seconds over the control
+// connection fd.  Then show as lines of JSON on stdout each change, each
+// route that changed, and a summary of the measurements.  A rate of 0
+// changes routes as fast as the switch acks them.  Return 0 or 1 if a
+// packet went to a stale or wrong port, or the connection failed.
+//
+extern int churnRun(int fd, int rate, int seconds);
+
+
+#endif // INCLUDE_CHURN_H
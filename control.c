@@ -1,16 +1,26 @@
 #include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <poll.h>
+
+#include <arch/cycle.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 
+#include "bucket.h"
 #include "control.h"
+#include "json.h"
 #include "process.h"
 #include "route.h"
+#include "stage.h"
+#include "tap.h"
 #include "tilera.h"
+#include "trace.h"
 #include "util.h"
 
 
@@ -19,6 +29,46 @@
 #define INFO(F, ...)
 
 
+// The state of the control event loop, which runs on one thread at a time.
+//
+// .listenFd is the socket listening on CONTROLPORT or -1.
+// .acceptFd is the accepted control connection or -1.
+// .tap is the TAP device served by the loop or -1.
+// .done is true once a client sent the command to stop the switch.
+// .balanced is the cycle count at the last rebalance.
+// .polled is the cycle count when the last poll() returned or 0.
+// .gap has the cycles from one poll() return to the next poll() call,
+//      which bounds how long a command waits before the loop sees it.
+// .command has the cycles to read and handle each command.
+// .seq is the sequence number of the last command handled.
+// .acked is the sequence number last acked.
+// .unacked counts the commands handled since the last ack.
+// .have is the number of bytes read into .input and not yet handled.
+// .input holds what has arrived of the commands on .acceptFd, so the
+//        loop never blocks waiting for the rest of one.
+// .queued is the number of bytes of replies in .output not yet sent.
+// .output holds the acks and nacks .acceptFd has not taken yet, so the
+//         loop never blocks sending them.
+//
+static struct Control {
+    int listenFd;
+    int acceptFd;
+    int tap;
+    int done;
+    unsigned long long balanced;
+    unsigned long long polled;
+    StageStat gap;
+    StageStat command;
+    int seq;
+    int acked;
+    int unacked;
+    int have;
+    char input[2 * CONTROLCOMMANDSIZE];
+    int queued;
+    char output[CONTROLREPLYSIZE];
+} control = { .listenFd = -1, .acceptFd = -1, .tap = -1 };
+
+
 // Show example program command lines to run against this switch.
 //
 static void showTesterCommandLine(Thread *t, int fd)
@@ -44,97 +94,579 @@ static void showTesterCommandLine(Thread *t, int fd)
     show("%02d: Run ./tester " IPFMT " %s " IPFMT " " MACFMT
          " <routes> <packets> seconds>",
          t->index, cip[0], cip[1], cip[2], cip[3],
-         p->interface, fip[0], fip[1], fip[2], fip[3],
+         p->interface[0], fip[0], fip[1], fip[2], fip[3],
          mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
     show("%02d: Or run ./driver " IPFMT " %d",
          t->index, cip[0], cip[1], cip[2], cip[3], CONTROLPORT);
-    show("%02d: Send video UDP to " IPFMT " (" MACFMT ")",
-         t->index, fip[0], fip[1], fip[2], fip[3],
-         mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    for (int n = 0; n < p->interfaceCount; ++n) {
+        const unsigned char *const m = p->mac[n];
+        show("%02d: Send video UDP to " IPFMT " (" MACFMT ") on %s",
+             t->index, fip[0], fip[1], fip[2], fip[3],
+             m[0], m[1], m[2], m[3], m[4], m[5], p->interface[n]);
+    }
 }
 
 
-// Read size bytes from fd into buffer.  Return size or -1 on EOF.
+// Read into control.input what has arrived on fd without waiting for
+// more.  Return 0 or -1 on EOF or error.
 //
-static int readControlStuff(int fd, char *buffer, size_t size)
+static int readControlStuff(int fd)
 {
-    const int result = size;
-    buffer[0] = ""[0];                  // Nul out the buffer.
-    char *p = buffer;
-    while (size > 0) {
-        const int rSize = read(fd, p, size);
-        if (rSize < 0) {
-            error("__: readControlStuff(%d) read(%d, %p, %zu) returned %d "
-                  "with errno %d: %s", fd, fd, p, size, rSize,
-                  errno, strerror(errno));
-            return -1;
-        } else if (rSize == 0) {
-            info("__:  readControlStuff(%d) "
-                 "read(%d, %p, %zu) returned 0 for EOF",
-                 fd, fd, p, size);
+    char *const p = control.input + control.have;
+    const size_t size = sizeof control.input - control.have;
+    if (size == 0) return 0;
+    const ssize_t rSize = recv(fd, p, size, MSG_DONTWAIT);
+    if (rSize > 0) {
+        control.have += rSize;
+        return 0;
+    }
+    if (rSize < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if (rSize == 0) {
+        info("__:  readControlStuff(%d) recv(%d, %p, %zu) returned 0 for EOF",
+             fd, fd, p, size);
+    } else {
+        error("__: readControlStuff(%d) recv(%d, %p, %zu) returned %zd "
+              "with errno %d: %s", fd, fd, p, size, rSize,
+              errno, strerror(errno));
+    }
+    return -1;
+}
+
+
+// Return the size of the next command in control.input, 0 if it is the
+// command to stop the switch, -1 if it has not all arrived yet, or -2 if
+// its size is bad.
+//
+static int nextCommand(void)
+{
+    int size = -1;
+    if (control.have < sizeof size) return -1;
+    memcpy(&size, control.input, sizeof size);
+    if (size < 0 || size >= CONTROLCOMMANDSIZE) return -2;
+    return control.have - sizeof size < size ? -1 : size;
+}
+
+
+// Show how long commands waited for and spent in the control loop on t.
+//
+static void controlShow(Thread *t)
+{
+    const Process *const p = t->process;
+    show("%02d: Control loop on CPU %d serves %s",
+         t->index, t->cpu,
+         p->topology.controlForwards ? "commands between packets"
+         : control.tap < 0 ? "commands" : "commands and TAP");
+    stageShowStat("Control gap", &control.gap);
+    stageShowStat("Control command", &control.command);
+}
+
+
+// Write into the size bytes at buffer a control string formatted from
+// format and args, the way sendControl() sends it.  Return the number of
+// bytes written or 0 if they do not fit.
+//
+static size_t vframe(char *buffer, size_t size, const char *format,
+                     va_list args)
+{
+    const int count = size > sizeof count ?
+        vsnprintf(buffer + sizeof count, size - sizeof count, format, args)
+        : -1;
+    if (count < 0 || sizeof count + count + 1 > size) return 0;
+    const int result = count + 1;
+    memcpy(buffer, &result, sizeof result);
+    return sizeof result + result;
+}
+
+
+// Call vframe() on format and the arguments after it.
+//
+static size_t frame(char *buffer, size_t size, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    const size_t result = vframe(buffer, size, format, args);
+    va_end(args);
+    return result;
+}
+
+
+// Send on fd the replies still queued, then the generation of the
+// routing table and its open routes, packing their strings into as few
+// writes as fit.  Return 0 or -1 on error.
+//
+static int dumpRoutes(int fd)
+{
+    static char buffer[1 << 16];
+    if (writeAll(fd, control.output, control.queued)) return -1;
+    control.queued = 0;
+    int open = 0;
+    for (int n = 0; n < R30TOTALCHANNELS; ++n) {
+        open += routeFromPortOfArrival(PORTOFFSET + n).open;
+    }
+    size_t size = frame(buffer, sizeof buffer, JSONDUMPFMT,
+                        routeGeneration(), open);
+    for (int n = 0; n < R30TOTALCHANNELS; ++n) {
+        const Route rt = routeFromPortOfArrival(PORTOFFSET + n);
+        if (!rt.open) continue;
+        const unsigned char *const i = rt.dst.ip;
+        const unsigned char *const m = rt.dst.mac;
+        size_t more = 0;
+        while (0 == (more = frame(buffer + size, sizeof buffer - size,
+                                  JSONDUMPROUTEFMT, rt.poa, rt.dst.port,
+                                  i[0], i[1], i[2], i[3],
+                                  m[0], m[1], m[2], m[3], m[4], m[5],
+                                  rt.priority, rt.egress, rt.rate, rt.burst,
+                                  rt.shape, rt.shapeBurst, rt.bucket))) {
+            if (writeAll(fd, buffer, size)) return -1;
+            size = 0;
+        }
+        size += more;
+    }
+    return writeAll(fd, buffer, size);
+}
+
+
+// Handle the control command named name with the count members at m of
+// the JSON string s on t.  Return 0 or the reason to nack the command.
+//
+// "trace" freezes the flight recorder rings and dumps them into TRACEFILE.
+// "stats" shows the live stage accounting for the forwarding threads.
+// "idle" sets how long forwarders spin and sleep on empty queues.
+// "buckets" shows the bucket load across forwarders and rebalancing.
+// "reserve" sets how many forwarders serve only pinned routes.
+// "pin" and "unpin" move routes onto or off of the reserved forwarders.
+// "forwarders" starts or stops forwarders to change how many run, unless
+// the control loop forwards too, since draining buckets takes it about a
+// second.
+// "dump" sends back the generation of the routing table and its routes,
+// unless the control loop forwards too, since the dump is large enough
+// to block on the connection.
+// "close" closes every route to an "ip", "ip" and "port", or "mac".
+// "redirect" sends every route to one of those to the "ip" and "mac" of
+// the object "to" instead, and to its "port" if it has one.
+//
+static const char *handleCommand(Thread *t, const char *name,
+                                 const JsonMember *m, int count,
+                                 const char *s)
+{
+    INFO("%02d: handleCommand(%p, %s, %p, %d, %p)",
+         t->index, t, name, m, count, s);
+    Process *const p = t->process;
+    if (0 == strcmp(name, "trace")) {
+        const int fail = traceDump(p, TRACEFILE);
+        if (fail) {
+            error("%02d: traceDump(%p, %s) failed with errno %d: %s",
+                  t->index, p, TRACEFILE, errno, strerror(errno));
+            return CONTROLNACKFAILED;
+        }
+        show("%02d: Dumped packet trace into %s", t->index, TRACEFILE);
+    } else if (0 == strcmp(name, "stats")) {
+        stageShow(p);
+        controlShow(t);
+    } else if (0 == strcmp(name, "buckets")) {
+        bucketShow(p);
+    } else if (0 == strcmp(name, "dump")) {
+        if (p->topology.controlForwards) {
+            error("%02d: Cannot stall forwarding to dump routes "
+                  "with controlforward=1: %s", t->index, s);
+            return CONTROLNACKFAILED;
+        }
+        if (dumpRoutes(control.acceptFd)) {
+            error("%02d: Cannot send the route dump with errno %d: %s",
+                  t->index, errno, strerror(errno));
+            return CONTROLNACKFAILED;
+        }
+    } else if (0 == strcmp(name, "reserve")) {
+        int tiles = -1;
+        const int ok = jsonInt(jsonFind(m, count, "tiles"), &tiles) &&
+            tiles >= 0 && tiles < p->netioThreadCount;
+        if (!ok) {
+            error("%02d: Reserve fewer than the %d forwarders: %s",
+                  t->index, p->netioThreadCount, s);
+            return CONTROLNACKARGUMENT;
+        }
+        processLock(p); p->reserveCount = tiles; processUnlock(p);
+        show("%02d: Reserved %d forwarders for pinned routes",
+             t->index, tiles);
+        bucketRebalance(p, t);
+    } else if (0 == strcmp(name, "forwarders")) {
+        int forwarders = 0;
+        if (!jsonInt(jsonFind(m, count, "count"), &forwarders)) {
+            error("%02d: Cannot parse forwarders count: %s", t->index, s);
+            return CONTROLNACKARGUMENT;
+        }
+        if (p->topology.controlForwards) {
+            error("%02d: Cannot stall forwarding to resize forwarders "
+                  "with controlforward=1: %s", t->index, s);
+            return CONTROLNACKFAILED;
+        }
+        if (bucketResize(p, t, forwarders)) return CONTROLNACKFAILED;
+    } else if (0 == strcmp(name, "pin") || 0 == strcmp(name, "unpin")) {
+        const int pinned = 0 == strcmp(name, "pin");
+        int poa = 0;
+        unsigned char ip[4] = {};
+        int ok = jsonInt(jsonFind(m, count, "from"), &poa) && poa > 0;
+        if (!ok) {
+            poa = 0;
+            ok = jsonIp(jsonFind(m, count, "ip"), ip);
+        }
+        if (!ok) {
+            error("%02d: Cannot parse pin 'from' port or 'ip': %s",
+                  t->index, s);
+            return CONTROLNACKARGUMENT;
+        }
+        const int routes = routePin(poa, ip, pinned);
+        show("%02d: %s %d routes",
+             t->index, pinned ? "Pinned" : "Unpinned", routes);
+        bucketRebalance(p, t);
+    } else if (0 == strcmp(name, "close")) {
+        Endpoint dst = {};
+        const int key = routeKeyFromJson(m, count, &dst);
+        if (key < 0) {
+            error("%02d: Cannot parse close 'ip', 'port', or 'mac': %s",
+                  t->index, s);
+            return CONTROLNACKARGUMENT;
+        }
+        const int routes = routeCloseMatching(key, &dst);
+        p->routeCount += routes;
+        show("%02d: Closed %d routes", t->index, routes);
+    } else if (0 == strcmp(name, "redirect")) {
+        Endpoint dst = {}, to = {};
+        const int key = routeKeyFromJson(m, count, &dst);
+        const JsonToken *const object = jsonFind(m, count, "to");
+        JsonMember toM[JSONMEMBERS];
+        int toCount = -1;
+        if (object && object->type == JSONOBJECT) {
+            Json j;
+            jsonInitialize(&j, object->s, object->size);
+            toCount = jsonObject(&j, toM, JSONMEMBERS);
+        }
+        const JsonToken *const port =
+            toCount < 0 ? NULL : jsonFind(toM, toCount, "port");
+        const int ok = key >= 0 && toCount >= 0 &&
+            jsonIp(jsonFind(toM, toCount, "ip"), to.ip) &&
+            jsonMac(jsonFind(toM, toCount, "mac"), to.mac) &&
+            (!port || (jsonInt(port, &to.port) && to.port > 0));
+        if (!ok) {
+            error("%02d: Cannot parse redirect 'ip', 'port', or 'mac' "
+                  "and 'to': %s", t->index, s);
+            return CONTROLNACKARGUMENT;
+        }
+        const int routes = routeRedirect(key, &dst, &to);
+        p->routeCount += routes;
+        show("%02d: Redirected %d routes", t->index, routes);
+    } else if (0 == strcmp(name, "idle")) {
+        int spin = -1, sleep = -1;
+        const int ok = jsonInt(jsonFind(m, count, "spin"), &spin) &&
+            jsonInt(jsonFind(m, count, "sleep"), &sleep) &&
+            spin >= 0 && sleep >= 0;
+        if (!ok) {
+            error("%02d: Cannot parse idle 'spin' and 'sleep': %s",
+                  t->index, s);
+            return CONTROLNACKARGUMENT;
+        }
+        processLock(p);
+        p->idleSpinUs = spin;
+        p->idleSleepUs = sleep;
+        processUnlock(p);
+        show("%02d: Forwarders spin %d us then sleep up to %d us",
+             t->index, spin, sleep);
+    } else {
+        error("%02d: Unknown command '%s' in: %s", t->index, name, s);
+        return CONTROLNACKCOMMAND;
+    }
+    return NULL;
+}
+
+
+// Open or close the route described by the count members at m of the JSON
+// string s on t.  Return 0 or the reason to nack the route.
+//
+static const char *handleRoute(Thread *t, const JsonMember *m, int count,
+                               const char *s)
+{
+    Process *const p = t->process;
+    Route rt = routeFromJson(m, count);
+    if (rt.poa < 0) {
+        error("%02d: Cannot parse route: %s", t->index, s);
+        return CONTROLNACKPARSE;
+    }
+    if (rt.egress >= p->interfaceCount) {
+        error("%02d: Route %d egress %d is not one of %d interfaces",
+              t->index, rt.poa, rt.egress, p->interfaceCount);
+        return CONTROLNACKEGRESS;
+    }
+    if (rt.dst.port > 0) {
+        routeSetCycles(&rt, p->cyclesPerUs);
+        routeOpen(&rt);
+    } else {
+        routeClose(&rt);
+    }
+    ++p->routeCount;
+    return NULL;
+}
+
+
+// More bytes than the JSON string of one ack or nack takes.
+//
+static const int replySize = 99;
+
+
+// Queue in control.output the JSON string formatted from format and its
+// arguments, the way sendControl() sends it.
+//
+static void reply(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    control.queued += vframe(control.output + control.queued,
+                             sizeof control.output - control.queued,
+                             format, args);
+    va_end(args);
+}
+
+
+// Send on fd what fd takes of control.output without blocking.  Return 0
+// or -1 on error.
+//
+static int sendReplies(int fd)
+{
+    while (control.queued > 0) {
+        const ssize_t wSize =
+            send(fd, control.output, control.queued, MSG_DONTWAIT);
+        if (wSize < 0 && errno == EINTR) continue;
+        if (wSize < 0 && errno == EAGAIN) return 0;
+        if (wSize <= 0) {
+            error("__: sendReplies(%d) send(%d, %p, %d) returned %zd "
+                  "with errno %d: %s", fd, fd, control.output,
+                  control.queued, wSize, errno, strerror(errno));
             return -1;
-        } else {
-            p += rSize;
-            size -= rSize;
         }
+        control.queued -= wSize;
+        memmove(control.output, control.output + wSize, control.queued);
     }
-    return result;
+    return 0;
+}
+
+
+// Return true if control.output has room for a nack and an ack.
+//
+static int roomToReply(void)
+{
+    const int room = sizeof control.output - control.queued;
+    return room >= 2 * (sizeof (int) + replySize);
+}
+
+
+// Ack every command through control.seq if it has not been acked.
+//
+static void ackControl(void)
+{
+    if (control.acked != control.seq) {
+        reply(JSONACKFMT, control.seq);
+        control.acked = control.seq;
+        control.unacked = 0;
+    }
+}
+
+
+// Return true if no whole command waits in control.input or on fd.
+//
+static int drained(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return nextCommand() == -1 && poll(&pfd, 1, 0) <= 0;
 }
 
 
-// Read and handle route control strings from fd.  Return 1 on EOF or error.
+// Close the control connection on t to listen for the next one.
+//
+static void hangUp(Thread *t)
+{
+    INFO("%02d: hangUp(%p) on fd %d", t->index, t, control.acceptFd);
+    close(control.acceptFd);
+    control.acceptFd = -1;
+    control.seq = control.acked = control.unacked = control.have = 0;
+    control.queued = 0;
+}
+
+
+// Handle on t the control string of size bytes at buffer from fd.
+//
+// A command with a "seq" number is acked or nacked on fd.  The switch
+// nacks a failed command right away, and acks the commands through the
+// last one handled once no command waits to be read, or after every
+// CONTROLACKEVERY commands while they keep coming.  Both wait in
+// control.output until fd takes them.
+//
+static void handleString(Thread *t, int fd, char *buffer, int size)
+{
+    buffer[size] = ""[0];
+    INFO("%02d: handleString(%p, %d, %p, %d) got:\n%s",
+         t->index, t, fd, buffer, size, buffer);
+    Json j;
+    JsonMember m[JSONMEMBERS];
+    jsonInitialize(&j, buffer, size);
+    const int count = jsonObject(&j, m, JSONMEMBERS);
+    const JsonToken *const command =
+        count < 0 ? NULL : jsonFind(m, count, "command");
+    const char *nack = CONTROLNACKPARSE;
+    if (count < 0) {
+        error("%02d: Cannot parse: %s", t->index, buffer);
+    } else if (command) {
+        char name[32];
+        jsonString(command, name, sizeof name);
+        nack = handleCommand(t, name, m, count, buffer);
+    } else {
+        nack = handleRoute(t, m, count, buffer);
+    }
+    int seq = 0;
+    const int sequenced =
+        count >= 0 && jsonInt(jsonFind(m, count, "seq"), &seq);
+    if (sequenced) {
+        control.seq = seq;
+        if (nack) reply(JSONNACKFMT, seq, nack);
+        ++control.unacked;
+        if (control.unacked >= CONTROLACKEVERY || drained(fd)) {
+            ackControl();
+        }
+    }
+}
+
+
+// Send what replies fd takes, then read what has arrived on fd and
+// handle each route control string it completes while control.output
+// has room to reply.  Return 1 on the command to stop the switch.
+// Otherwise return 0.  On EOF or error close fd to wait for another
+// control connection.
 //
 static int handleOneRoute(Thread *t, int fd)
 {
-    info("%02d: handleOneRoute(%p, %d)", t->index, t, fd);
-    char buffer[999];
-    int size = -1;
-    const int sizeSize = readControlStuff(fd, (char *)&size, sizeof size);
-    if (sizeSize == sizeof size) {
+    INFO("%02d: handleOneRoute(%p, %d)", t->index, t, fd);
+    const int fail = sendReplies(fd) || readControlStuff(fd);
+    for (int size = nextCommand(); size >= 0 && roomToReply();
+         size = nextCommand()) {
         if (size == 0) {
-            INFO("%02d: readControlStuff(%d, %p, %zu) got EOF",
-                 t->index, fd, &size, sizeof size);
-        } else if (size > sizeof buffer) {
-            error("%02d: readControlStuff(%d, %p, %zu) got size %d",
-                  t->index, fd, &size, sizeof size, size);
-        } else {
-            const ssize_t rtSize = read(fd, buffer, size);
-            if (rtSize == size) {
-                info("%02d: readControlStuff(%d, %p, %zu) got:\n%s",
-                     t->index, fd, buffer, size, buffer);
-                const Route rt = routeFromString(buffer);
-                if (rt.dst.port > 0) routeOpen(&rt); else routeClose(&rt);
-                ++t->process->routeCount;
-                return 0;
-            } else {
-                error("%02d: readControlStuff(%d, %p, %zu) returned %zd",
-                      t->index, fd, buffer, size, rtSize);
-            }
+            INFO("%02d: handleOneRoute(%p, %d) got stop", t->index, t, fd);
+            ackControl();
+            writeAll(fd, control.output, control.queued);
+            control.queued = 0;
+            return 1;
         }
+        char buffer[CONTROLCOMMANDSIZE];
+        memcpy(buffer, control.input + sizeof size, size);
+        control.have -= sizeof size + size;
+        memmove(control.input, control.input + sizeof size + size,
+                control.have);
+        handleString(t, fd, buffer, size);
     }
-    return 1;
+    if (nextCommand() == -2) {
+        int size = -1;
+        memcpy(&size, control.input, sizeof size);
+        error("%02d: handleOneRoute(%p, %d) got size %d",
+              t->index, t, fd, size);
+        hangUp(t);
+    } else if (fail || sendReplies(fd)) {
+        hangUp(t);
+    }
+    return 0;
 }
 
 
-int controlRoutes(struct Thread *t)
+// Listen for a control connection on t, and serve the TAP device from
+// the event loop if the topology puts TAP on the control CPU.
+//
+static void openControl(Thread *t)
 {
-    INFO("%02d: controlRoutes(%p)", t->index, t);
+    INFO("%02d: openControl(%p)", t->index, t);
     Process *const p = t->process;
-    const int listenFd = listenTcpPort("0.0.0.0", CONTROLPORT);
-    showTesterCommandLine(t, listenFd);
+    control.listenFd = listenTcpPort("0.0.0.0", CONTROLPORT);
+    showTesterCommandLine(t, control.listenFd);
+    if (p->topology.tap == TOPOLOGYCONTROL) control.tap = p->tap;
+    control.balanced = get_cycle_count();
+}
+
+
+// Accept the control connection on t.  Return 1 on error or 0.
+//
+static int acceptControl(Thread *t)
+{
+    INFO("%02d: acceptControl(%p)", t->index, t);
     struct sockaddr_in address;
     socklen_t addressSize = sizeof address;
-    const int acceptFd =
-        accept(listenFd, (struct sockaddr *)&address, &addressSize);
-    if (acceptFd == -1) {
+    control.acceptFd =
+        accept(control.listenFd, (struct sockaddr *)&address, &addressSize);
+    if (control.acceptFd == -1) {
         error("%02d: accept(%d, %p, %p) returned %d with errno %d: %s",
-              t->index, listenFd, &address, &addressSize, acceptFd,
-              errno, strerror(errno));
+              t->index, control.listenFd, &address, &addressSize,
+              control.acceptFd, errno, strerror(errno));
+        return 1;
+    }
+    const int one = 1;
+    setsockopt(control.acceptFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    return 0;
+}
+
+
+int controlPoll(struct Thread *t, int timeoutMs)
+{
+    // INFO("%02d: controlPoll(%p, %d)", t->index, t, timeoutMs); // spew
+    Process *const p = t->process;
+    if (control.done) return 1;
+    if (control.listenFd < 0) openControl(t);
+    const int fd = control.acceptFd < 0 ? control.listenFd : control.acceptFd;
+    const int events = control.acceptFd < 0 ? POLLIN
+        : (control.have < sizeof control.input ? POLLIN : 0) |
+          (control.queued ? POLLOUT : 0);
+    struct pollfd pfd[2] = {
+        { .fd = fd,          .events = events },
+        { .fd = control.tap, .events = POLLIN }
+    };
+    const unsigned long long begin = get_cycle_count();
+    if (control.polled) stageCount(&control.gap, begin - control.polled);
+    const int count = poll(pfd, 2, timeoutMs);
+    control.polled = get_cycle_count();
+    if (count < 0 && errno != EINTR) {
+        error("%02d: poll(%p, 2, %d) on fds %d and %d returned %d "
+              "with errno %d: %s", t->index, pfd, timeoutMs, fd, control.tap,
+              count, errno, strerror(errno));
+        control.done = 1;
+    }
+    if (count > 0 && (pfd[1].revents & POLLIN)) {
+        const int open = tapToQueue(p->thread[1], control.tap, &t->queue);
+        if (!open) control.tap = -1;
+    }
+    if (count > 0 && pfd[0].revents) {
+        if (control.acceptFd < 0) {
+            control.done = acceptControl(t);
+        } else {
+            control.done = handleOneRoute(t, control.acceptFd);
+            stageCount(&control.command, get_cycle_count() - control.polled);
+        }
+    }
+    const unsigned long long balance = 1000ULL * BALANCEMS * p->cyclesPerUs;
+    if (!control.done && control.polled - control.balanced >= balance) {
+        bucketRebalance(p, t);
+        control.balanced = get_cycle_count();
+    }
+    return control.done;
+}
+
+
+int controlRoutes(struct Thread *t)
+{
+    INFO("%02d: controlRoutes(%p)", t->index, t);
+    Process *const p = t->process;
+    if (p->topology.controlForwards) {
+        processLock(p);
+        while (!p->controlDone) processWait(p);
+        processUnlock(p);
+        controlShow(p->thread[p->netioThreadIndex]);
     } else {
-        int done = 0;
-        while (!done) done = handleOneRoute(t, acceptFd);
+        while (!controlPoll(t, BALANCEMS)) continue;
+        controlShow(t);
     }
-    close(acceptFd);
-    close(listenFd);
+    if (control.acceptFd >= 0) close(control.acceptFd);
+    close(control.listenFd);
     return p->routeCount;
 }
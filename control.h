@@ -4,16 +4,54 @@
 
 // Listen on CONTROLPORT for JSON route controls sent to the switch.
 
+// The control loop serves the control connection and, when the topology
+// puts TAP on the control CPU, the TAP device from one poll() call on one
+// thread.  It rebalances buckets every BALANCEMS milliseconds.  When the
+// topology has the control CPU forward, the first forwarder runs the
+// loop without blocking between packets: whenever its queue is empty,
+// and after every CONTROLPOLLMASK + 1 packets while it is busy.  The loop
+// reads only what has arrived and keeps any partial command for later,
+// and sends only the acks and nacks the connection takes without
+// blocking, so a slow client cannot stall it.
+//
+#define CONTROLPOLLMASK (0xff)
+
+// While sequenced commands keep arriving, the control loop acks them
+// after every CONTROLACKEVERY of them, and otherwise once it has handled
+// every command waiting on the control connection.
+//
+#define CONTROLACKEVERY (256)
+
+// The most bytes in one control string, counting a terminating NUL.
+//
+#define CONTROLCOMMANDSIZE (1000)
+
+// The most bytes of acks and nacks the control loop holds for a client
+// that is not reading them.  It handles no more commands until they go.
+//
+#define CONTROLREPLYSIZE (1 << 12)
+
+
 // Defined in process.h.
 //
 struct Thread;
 
 // Use t to listen for JSON route control strings on the
-// t->process->control file descriptor.
+// t->process->control file descriptor.  When the topology has the
+// control CPU forward, wait instead for the forwarder running the control
+// loop to see the command to stop the switch.  A control connection that
+// closes without that command just lets another client connect.
 //
-// On EOF return the number of routing commands received.
+// Once stopped return the number of routing commands received.
 //
 extern int controlRoutes(struct Thread *t);
 
+// Run the control loop once on t, waiting up to timeoutMs milliseconds
+// for a command or TAP packet.  Return 1 once a client has sent the
+// command to stop the switch or the control socket failed.  Otherwise
+// return 0.
+//
+extern int controlPoll(struct Thread *t, int timeoutMs);
+
 
 #endif // INCLUDE_CONTROL_H
@@ -1,26 +1,57 @@
-#include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "json.h"
 #include "route.h"
 #include "util.h"
 
 
 static const char usage[] =
     "                                                                     \n"
-    "%s: Send route commands from stdin to a UDP switch at <ip>:<port>.   \n"
+    "%s: Send route commands from stdin to UDP switches at <ip>:<port>.  \n"
     "    You can build and run %s on any Unix system because id does not  \n"
     "    depend on Tilera libraries.                                      \n"
     "                                                                     \n"
-    "Usage: %s <ip> [<port>]                                              \n"
+    "Usage: %s <ip> [<port> [<window>]]                                   \n"
+    "   or: %s -sync <ip> [<port> [<window>]]                             \n"
+    "   or: %s -parse                                                     \n"
     "                                                                     \n"
     "Where: <ip> is the dotted-decimal IPv4 address string for the        \n"
-    "            command interface on the UDP switch.                     \n"
+    "            command interface on the UDP switch.  Push the same      \n"
+    "            commands to up to %d switches at once with a list such   \n"
+    "            as '10.0.0.1,10.0.0.2:5000' where each can have its own  \n"
+    "            port.                                                    \n"
     "       <port> is the integer TCP port number for the command         \n"
     "              interface on the UDP switch.  The default is %d.       \n"
+    "       <window> is how many commands can be in flight to each        \n"
+    "              switch before it acks them.  The default is %d.        \n"
+    "       -parse only parses the commands on stdin and shows how many   \n"
+    "              routes per second parse.                               \n"
+    "                                                                     \n"
+    "The commands are JSON objects in any format and key order, and may   \n"
+    "be wrapped in arrays and separated by commas.  They go to every      \n"
+    "switch over non-blocking connections in writes of up to %d bytes.    \n"
+    "Each command gets a \"seq\" number, which the switch acks once it     \n"
+    "has handled the command, or nacks with a \"reason\" if it failed.     \n"
+    "Then %s shows how long each switch took to connect, to take the      \n"
+    "commands, and to ack them, with the round trip time of each command. \n"
+    "Run it while the switch forwards to see how load delays commands.    \n"
+    "                                                                     \n"
+    "With -sync, stdin is the desired state of the route table.  Then %s  \n"
+    "dumps each switch's routes and sends only the opens and closes that  \n"
+    "make them match, and shows how long that took and how many changed.  \n"
+    "The switch keeps running after a sync, but stops after a push.       \n"
     "                                                                     \n"
     "Example: %s 172.17.3.126 %d                                          \n"
     "                                                                     \n";
@@ -31,15 +62,69 @@ static const char usage[] =
 #define INFO(F, ...)
 
 
+// The most switches driver pushes commands to at once.
+//
+#define DRIVERSWITCHES (64)
+
+// The most bytes driver writes to a switch at once.
+//
+#define DRIVERWRITESIZE (1 << 18)
+
+// The number of command ends driver first allocates room for.
+//
+#define DRIVERENDS (1 << 12)
+
+// By default driver writes a switch up to DRIVERWINDOW commands past the
+// last one it acked.
+//
+#define DRIVERWINDOW (4096)
+
+
 // Describe this program's validated command line.
 //
 typedef struct DriverCommandLine {
     const char *av0;
-    const char *ips;
-    unsigned char ip[4];
-    int port;
+    const char *ips[DRIVERSWITCHES];
+    int port[DRIVERSWITCHES];
+    int count;
+    int window;
+    int parse;
+    int sync;
 } DriverCommandLine;
 
+
+// Split the comma-separated list of switches s into cl, where each switch
+// is <ip> or <ip>:<port> and port is the default.  Return 0 if s lists 1
+// to DRIVERSWITCHES valid switches.  Otherwise return -1.
+//
+static int switchesFromString(DriverCommandLine *cl, const char *s, int port)
+{
+    cl->count = 0;
+    while (cl->count < DRIVERSWITCHES) {
+        const size_t size = strcspn(s, ",");
+        char *const ips = strndup(s, size);
+        char *const colon = ips ? strchr(ips, ':') : NULL;
+        int portN = port;
+        if (colon) {
+            *colon = ""[0];
+            char *end = NULL;
+            portN = strtol(colon + 1, &end, 10);
+            if (*end) portN = 0;
+        }
+        if (!ips || !validIpString(ips) || portN <= 0) {
+            free(ips);
+            return -1;
+        }
+        cl->ips[cl->count] = ips;
+        cl->port[cl->count] = portN;
+        ++cl->count;
+        if (s[size] == ""[0]) return 0;
+        s += size + 1;
+    }
+    return -1;
+}
+
+
 // Validate the command line (ac, av) and return the results.
 //
 static const DriverCommandLine validateDriverUsage(int ac, const char *av[])
@@ -49,65 +134,708 @@ static const DriverCommandLine validateDriverUsage(int ac, const char *av[])
     fprintf(stderr, "%s command line:", av0);
     for (int n = 0; n < ac; ++n) fprintf(stderr, " '%s'", av[n]);
     fprintf(stderr, "\n");
-    DriverCommandLine result = { .av0 = av0, .port = CONTROLPORT };
-    int ok = ac > 1 && validIpString(av[1]);
-    if (ok) {
-        result.ips = av[1];
-        ok = ipFromString(result.ip, result.ips);
-    }
-    if (ok && ac > 2) {
-        result.port = atoi(av[2]);
-        ok = result.port > 0;
+    DriverCommandLine result = { .av0 = av0, .window = DRIVERWINDOW };
+    result.parse = ac == 2 && 0 == strcmp(av[1], "-parse");
+    if (result.parse) return result;
+    result.sync = ac > 1 && 0 == strcmp(av[1], "-sync");
+    if (result.sync) {
+        --ac;
+        ++av;
     }
+    const int port = ac > 2 ? atoi(av[2]) : CONTROLPORT;
+    if (ac > 3) result.window = atoi(av[3]);
+    const int ok = ac > 1 && ac < 5 && port > 0 && result.window > 0 &&
+        0 == switchesFromString(&result, av[1], port);
     if (!ok) {
-        fprintf(stderr, usage, av0, av0, av0, CONTROLPORT, av0, CONTROLPORT);
+        fprintf(stderr, usage, av0, av0, av0, av0, av0, DRIVERSWITCHES,
+                CONTROLPORT, DRIVERWINDOW, DRIVERWRITESIZE, av0, av0,
+                av0, CONTROLPORT);
         exit(1);
     }
     return result;
 }
 
 
-// Write at r the next route described in the JSON stream s.
-// Return 1 on EOF.  Otherwise return 0.
+// JSON text read from a file descriptor.
+//
+// .fd is the file descriptor to read.
+// .eof is true after .fd returns EOF or fails.
+// .size is the number of bytes of text in .buffer.
+// .j tokenizes the text in .buffer in place.
+// .buffer holds the unparsed text, which slides to its start whenever
+//         jsonObject() runs out of text, so each byte is parsed once.
+//
+typedef struct DriverInput {
+    int fd;
+    int eof;
+    size_t size;
+    Json j;
+    char buffer[1 << 16];
+} DriverInput;
+
+
+// Read more text into in after what jsonObject() has not parsed yet.
 //
-// Add lines from s to static buffer until its content can be successfully
-// parsed into a route.  Maintain the size of the current string in sofar.
+static void readMore(DriverInput *in)
+{
+    size_t rest = in->size - in->j.at;
+    memmove(in->buffer, in->buffer + in->j.at, rest);
+    if (rest == sizeof in->buffer) {
+        error("__: Discarding a JSON object over %zu bytes", rest);
+        rest = 0;
+    }
+    ssize_t count = -1;
+    do {
+        count = read(in->fd, in->buffer + rest, sizeof in->buffer - rest);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0) {
+        error("__: read(%d, %p, %zu) returned %zd with errno %d: %s",
+              in->fd, in->buffer + rest, sizeof in->buffer - rest, count,
+              errno, strerror(errno));
+    }
+    in->eof = count <= 0;
+    in->size = rest + (count > 0 ? count : 0);
+    jsonInitialize(&in->j, in->buffer, in->size);
+}
+
+
+// Parse into the JSONMEMBERS at m the next object in in.  Return the
+// count of members in the object or JSONEND when in has no more objects.
+// Then the object is the text in [in->j.begin, in->j.at) of in->buffer.
 //
-static int routeFromStream(Route *r, FILE *s)
+static int nextObject(DriverInput *in, JsonMember *m)
 {
-    static char buffer[999];
-    static size_t sofar;
     while (1) {
-        assert(sofar < sizeof buffer);
-        fgets(buffer + sofar, sizeof buffer - sofar, s);
-        if (feof(s)) return 1;
-        if (ferror(s)) {
-            error("__: fgets(%p, %zu, %p) failed with errno %d: %s",
-                  buffer + sofar, sizeof buffer - sofar, s,
-                  errno, strerror(errno));
-            clearerr(s);
+        const int count = jsonObject(&in->j, m, JSONMEMBERS);
+        if (count >= 0) return count;
+        if (count == JSONERROR) {
+            error("__: Cannot parse: %.*s",
+                  (int)(in->j.at - in->j.begin), in->buffer + in->j.begin);
+        } else if (in->eof) {
+            if (count == JSONPARTIAL) {
+                error("__: Input ends inside: %.*s",
+                      (int)(in->size - in->j.begin),
+                      in->buffer + in->j.begin);
+            }
+            return JSONEND;
+        } else {
+            readMore(in);
+        }
+    }
+}
+
+
+// Parse the routes and commands on in without sending them anywhere, and
+// show how fast they parse.
+//
+static void parseOnly(DriverInput *in)
+{
+    const unsigned long long begin = clockNs(CLOCK_MONOTONIC);
+    int routes = 0, commands = 0, bad = 0;
+    JsonMember m[JSONMEMBERS];
+    int count = 0;
+    while (JSONEND != (count = nextObject(in, m))) {
+        if (jsonFind(m, count, "command")) {
+            ++commands;
+        } else if (routeFromJson(m, count).poa < 0) {
+            ++bad;
+        } else {
+            ++routes;
+        }
+    }
+    const double seconds = (clockNs(CLOCK_MONOTONIC) - begin) / 1e9;
+    printf("Parsed %d routes, %d commands, and %d bad routes in %.3f s\n",
+           routes, commands, bad, seconds);
+    printf("Parsed %.0f routes per second\n",
+           seconds > 0 ? routes / seconds : 0.0);
+}
+
+
+// The control commands encoded for every switch in the order read.
+//
+// .s holds each command as its int size followed by its size bytes, the
+//    way sendControl() sends it, so any run of it can go in one write().
+// .size is the number of bytes encoded at .s so far.
+// .capacity is the number of bytes allocated at .s.
+// .end is the offset in .s after the command with "seq" n + 1 at .end[n].
+// .ends is the number of offsets allocated at .end.
+// .count is the number of commands at .s with a "seq" number.
+// .routes and .commands count the routes and commands encoded.
+// .complete is true when .s ends with the command that stops a switch,
+//           which has no "seq" number.
+//
+typedef struct DriverOutput {
+    char *s;
+    size_t size;
+    size_t capacity;
+    size_t *end;
+    int ends;
+    int count;
+    int routes;
+    int commands;
+    int complete;
+} DriverOutput;
+
+
+// Return p grown by realloc() to size bytes or exit.
+//
+static void *grow(void *p, size_t size)
+{
+    void *const result = realloc(p, size);
+    if (!result) {
+        error("__: realloc(%p, %zu) failed with errno %d: %s",
+              p, size, errno, strerror(errno));
+        exit(1);
+    }
+    return result;
+}
+
+
+// Append to out a command of size bytes at s.
+//
+static void appendCommand(DriverOutput *out, const char *s, int size)
+{
+    const size_t need = out->size + sizeof size + size;
+    if (need > out->capacity) {
+        size_t capacity = out->capacity ? out->capacity : DRIVERWRITESIZE;
+        while (capacity < need) capacity *= 2;
+        out->s = grow(out->s, capacity);
+        out->capacity = capacity;
+    }
+    memcpy(out->s + out->size, &size, sizeof size);
+    memcpy(out->s + out->size + sizeof size, s, size);
+    out->size = need;
+}
+
+
+// Append to out the count bytes of the JSON object at s with a "seq"
+// member numbering it first.  Return 0 or -1 if it does not fit.
+//
+static int appendSequenced(DriverOutput *out, const char *s, int count)
+{
+    const char *const brace = memchr(s, "{"[0], count);
+    if (!brace) return -1;
+    const int skip = brace + 1 - s;
+    char buffer[999];
+    const int size = snprintf(buffer, sizeof buffer, "{ \"seq\" : %d , %.*s",
+                              out->count + 1, count - skip, brace + 1);
+    if (size <= 0 || size >= sizeof buffer) return -1;
+    appendCommand(out, buffer, 1 + size);
+    if (out->count == out->ends) {
+        out->ends = out->ends ? 2 * out->ends : DRIVERENDS;
+        out->end = grow(out->end, out->ends * sizeof *out->end);
+    }
+    out->end[out->count++] = out->size;
+    return 0;
+}
+
+
+// Encode into out the commands on in until out grows by at least limit
+// bytes.  Finish out with the command to stop a switch at the end of in.
+//
+static void encodeMore(DriverInput *in, DriverOutput *out, size_t limit)
+{
+    limit += out->size;
+    JsonMember m[JSONMEMBERS];
+    while (!out->complete && out->size < limit) {
+        const int count = nextObject(in, m);
+        const char *const s = in->buffer + in->j.begin;
+        const int size = in->j.at - in->j.begin;
+        if (count == JSONEND) {
+            appendCommand(out, "", 0);
+            out->complete = 1;
+        } else if (jsonFind(m, count, "command")) {
+            if (appendSequenced(out, s, size)) {
+                error("__: Command is too big: %.*s", size, s);
+            } else {
+                ++out->commands;
+            }
+        } else {
+            char route[999];
+            const Route r = routeFromJson(m, count);
+            const int rSize = r.poa < 0 ? -1 :
+                routeToString(&r, route, sizeof route);
+            if (rSize > 0 && 0 == appendSequenced(out, route, rSize - 1)) {
+                ++out->routes;
+            } else {
+                error("__: Cannot parse route: %.*s", size, s);
+            }
+        }
+    }
+}
+
+
+// The number of log2 buckets in a DriverLatency histogram.  Bucket n
+// counts samples of [1 << n, 1 << (n + 1)) nanoseconds, and the last
+// bucket also counts anything longer.
+//
+#define DRIVERHISTOGRAMCOUNT (40)
+
+
+// Round-trip latency from writing a command to a switch to its ack.
+//
+// .count is the number of samples.
+// .ns is the sum of the samples.
+// .min and .max are the extreme samples, valid only when .count > 0.
+// .histogram counts samples in log2 buckets.
+//
+typedef struct DriverLatency {
+    unsigned long long count;
+    unsigned long long ns;
+    unsigned long long min;
+    unsigned long long max;
+    unsigned long long histogram[DRIVERHISTOGRAMCOUNT];
+} DriverLatency;
+
+
+// Count the latency sample ns into l.
+//
+static void latencyCount(DriverLatency *l, unsigned long long ns)
+{
+    if (l->count == 0 || ns < l->min) l->min = ns;
+    if (ns > l->max) l->max = ns;
+    ++l->count;
+    l->ns += ns;
+    int n = 0;
+    while (n < DRIVERHISTOGRAMCOUNT - 1 && ns >> (n + 1)) ++n;
+    ++l->histogram[n];
+}
+
+
+// Return an upper bound on the percent percentile of the samples in l.
+//
+static unsigned long long percentile(const DriverLatency *l, int percent)
+{
+    const unsigned long long want = (l->count * percent + 99) / 100;
+    unsigned long long sofar = 0;
+    int n = 0;
+    for (; n < DRIVERHISTOGRAMCOUNT - 1; ++n) {
+        sofar += l->histogram[n];
+        if (sofar >= want) break;
+    }
+    return 1ULL << (n + 1) < l->max ? 1ULL << (n + 1) : l->max;
+}
+
+
+// A switch that driver pushes commands to.
+//
+// .ips and .port are where its control port listens.
+// .fd is the non-blocking socket connected to it, or -1 when done.
+// .connected is true once the connection completes.
+// .sent is how many bytes of the DriverOutput it has been sent.
+// .written is the "seq" of the last command written to it whole.
+// .acked is the last "seq" it acked.
+// .nacks counts the commands it nacked.
+// .failed is true if the connection failed.
+// .connectNs, .sentNs, and .doneNs are the nanoseconds after the push
+//            began when the connection completed, when the switch was
+//            last written, and when the switch acked every command.
+// .writtenNs has the nanoseconds when each command in flight was written
+//            whole, indexed by its "seq" modulo the window.
+// .rtt has the round-trip latency of every command acked.
+// .window is how many commands can be in flight to the switch.
+// .out is the DriverOutput to push to the switch.
+// .desired is the desired route table when syncing, or 0 when pushing.
+// .dump is the switch's route table when syncing, indexed by port of
+//       arrival less PORTOFFSET.
+// .dumpCount is the number of open routes the switch has when syncing,
+//            or -1 until it says.
+// .dumped is the number of its routes read into .dump.
+// .generation is the generation of the switch's route table.
+// .dumpNs is the nanoseconds after the push began when .dump was full.
+// .size is the number of reply bytes read into .reply.
+// .reply holds the start of the acks and nacks not handled yet.
+//
+typedef struct DriverSwitch {
+    const char *ips;
+    int port;
+    int fd;
+    int connected;
+    size_t sent;
+    int written;
+    int acked;
+    int nacks;
+    int failed;
+    unsigned long long connectNs;
+    unsigned long long sentNs;
+    unsigned long long doneNs;
+    unsigned long long *writtenNs;
+    DriverLatency rtt;
+    int window;
+    DriverOutput *out;
+    const Route *desired;
+    Route *dump;
+    int dumpCount;
+    int dumped;
+    unsigned int generation;
+    unsigned long long dumpNs;
+    size_t size;
+    char reply[999];
+} DriverSwitch;
+
+
+// Start a non-blocking connection to the switch at sw->ips:sw->port.
+//
+static void connectSwitch(DriverSwitch *sw)
+{
+    INFO("__: connectSwitch(%p) to %s:%d", sw, sw->ips, sw->port);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(sw->port),
+    };
+    inet_aton(sw->ips, &addr.sin_addr);
+    sw->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    const int one = 1;
+    const int ok = sw->fd >= 0 &&
+        0 == setsockopt(sw->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one) &&
+        0 == fcntl(sw->fd, F_SETFL, O_NONBLOCK | fcntl(sw->fd, F_GETFL)) &&
+        (0 == connect(sw->fd, (struct sockaddr *)&addr, sizeof addr) ||
+         errno == EINPROGRESS);
+    if (!ok) {
+        error("__: Cannot connect to %s:%d with errno %d: %s",
+              sw->ips, sw->port, errno, strerror(errno));
+        if (sw->fd >= 0) close(sw->fd);
+        sw->fd = -1;
+        sw->failed = 1;
+    }
+}
+
+
+// Close the connection to sw and note that it failed if failed is true.
+//
+static void closeSwitch(DriverSwitch *sw, int failed, const char *why)
+{
+    if (failed) {
+        error("__: Switch %s:%d %s after %zu bytes with errno %d: %s",
+              sw->ips, sw->port, why, sw->sent, errno, strerror(errno));
+    }
+    close(sw->fd);
+    sw->fd = -1;
+    sw->failed = failed;
+}
+
+
+// Return the offset in sw->out up to which sw may be sent commands.
+//
+static size_t sendLimit(const DriverSwitch *sw)
+{
+    const DriverOutput *const out = sw->out;
+    const int last = sw->acked + sw->window;
+    if (last < out->count) return out->end[last - 1];
+    if (out->complete) return out->size;
+    return out->count ? out->end[out->count - 1] : 0;
+}
+
+
+// Return true if routes a and b forward the same way.
+//
+static int sameRoute(const Route *a, const Route *b)
+{
+    return a->dst.port == b->dst.port &&
+        0 == memcmp(a->dst.ip, b->dst.ip, sizeof a->dst.ip) &&
+        0 == memcmp(a->dst.mac, b->dst.mac, sizeof a->dst.mac) &&
+        a->priority == b->priority && a->egress == b->egress &&
+        a->rate == b->rate && a->burst == b->burst &&
+        a->shape == b->shape && a->shapeBurst == b->shapeBurst;
+}
+
+
+// Append to sw->out the opens and closes that change the routes sw dumped
+// into its desired routes, and complete sw->out.
+//
+static void appendChanges(DriverSwitch *sw)
+{
+    DriverOutput *const out = sw->out;
+    for (int n = 0; n < R30TOTALCHANNELS; ++n) {
+        const Route *const want = sw->desired + n;
+        const Route *const have = sw->dump + n;
+        const int change = want->open ?
+            !have->open || !sameRoute(want, have) : have->open;
+        if (change) {
+            const Route close = { .poa = PORTOFFSET + n, .dst.port = -1 };
+            char route[999];
+            const int size = routeToString(want->open ? want : &close,
+                                           route, sizeof route);
+            if (size > 0 && 0 == appendSequenced(out, route, size - 1)) {
+                ++out->routes;
+            }
+        }
+    }
+    out->complete = 1;
+}
+
+
+// Handle the route table dump in the count members at m from sw at ns.
+//
+static void handleDump(DriverSwitch *sw, const JsonMember *m, int count,
+                       unsigned long long ns)
+{
+    const JsonToken *const dump = jsonFind(m, count, "dump");
+    int generation = 0;
+    if (dump) {
+        jsonInt(dump, &generation);
+        jsonInt(jsonFind(m, count, "count"), &sw->dumpCount);
+        sw->generation = generation;
+    } else {
+        const Route rt = routeFromJson(m, count);
+        if (rt.poa >= 0 && rt.dst.port > 0) {
+            sw->dump[rt.poa - PORTOFFSET] = rt;
+            sw->dump[rt.poa - PORTOFFSET].open = 1;
+        }
+        ++sw->dumped;
+    }
+    if (sw->dumped == sw->dumpCount) {
+        sw->dumpNs = ns;
+        appendChanges(sw);
+    }
+}
+
+
+// Handle the ack, nack, or dump in the size bytes at s from sw at ns.
+//
+static void handleReply(DriverSwitch *sw, const char *s, int size,
+                        unsigned long long ns)
+{
+    Json j;
+    JsonMember m[JSONMEMBERS];
+    jsonInitialize(&j, s, size);
+    const int count = jsonObject(&j, m, JSONMEMBERS);
+    int seq = 0;
+    if (count >= 0 && jsonInt(jsonFind(m, count, "ack"), &seq)) {
+        if (seq > sw->written) seq = sw->written;
+        for (; sw->acked < seq; ++sw->acked) {
+            const int n = (sw->acked + 1) % sw->window;
+            latencyCount(&sw->rtt, ns - sw->writtenNs[n]);
+        }
+    } else if (count >= 0 && jsonInt(jsonFind(m, count, "nack"), &seq)) {
+        const JsonToken *const reason = jsonFind(m, count, "reason");
+        char why[32] = "";
+        if (reason) jsonString(reason, why, sizeof why);
+        error("__: Switch %s:%d nacked command %d for '%s'",
+              sw->ips, sw->port, seq, why);
+        ++sw->nacks;
+        if (sw->desired && !sw->out->complete) {
+            error("__: Switch %s:%d cannot dump, so send every route",
+                  sw->ips, sw->port);
+            appendChanges(sw);
+        }
+    } else if (count >= 0 && sw->desired && !sw->out->complete) {
+        handleDump(sw, m, count, ns);
+    } else {
+        error("__: Switch %s:%d sent: %.*s", sw->ips, sw->port, size, s);
+    }
+}
+
+
+// Read and handle the replies from sw at ns.  Return 0 or -1 on EOF or
+// error.
+//
+static int readReplies(DriverSwitch *sw, unsigned long long ns)
+{
+    const ssize_t count =
+        read(sw->fd, sw->reply + sw->size, sizeof sw->reply - sw->size);
+    if (count == 0) return -1;
+    if (count < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    sw->size += count;
+    size_t at = 0;
+    int size = 0;
+    while (sw->size - at >= sizeof size) {
+        memcpy(&size, sw->reply + at, sizeof size);
+        if (size < 0 || size > sizeof sw->reply - sizeof size) return -1;
+        if (sw->size - at < sizeof size + size) break;
+        handleReply(sw, sw->reply + at + sizeof size, size, ns);
+        at += sizeof size + size;
+    }
+    sw->size -= at;
+    memmove(sw->reply, sw->reply + at, sw->size);
+    return 0;
+}
+
+
+// Return true when sw has been sent and has acked all of sw->out.
+//
+static int finished(const DriverSwitch *sw)
+{
+    const DriverOutput *const out = sw->out;
+    return out->complete && sw->sent == out->size && sw->acked == out->count;
+}
+
+
+// Handle the poll() events in revents on sw at ns.
+//
+static void serviceSwitch(DriverSwitch *sw, short revents,
+                          unsigned long long ns)
+{
+    const DriverOutput *const out = sw->out;
+    if (!sw->connected && revents) {
+        int fail = 0;
+        socklen_t size = sizeof fail;
+        getsockopt(sw->fd, SOL_SOCKET, SO_ERROR, &fail, &size);
+        errno = fail;
+        if (fail) {
+            closeSwitch(sw, 1, "refused connection");
+            return;
+        }
+        sw->connected = 1;
+        sw->connectNs = ns;
+    }
+    if ((revents & POLLIN) && readReplies(sw, ns)) {
+        closeSwitch(sw, 1, "closed connection");
+        return;
+    }
+    const size_t limit = sendLimit(sw);
+    if ((revents & POLLOUT) && sw->sent < limit) {
+        const size_t want = limit - sw->sent;
+        const size_t size = want < DRIVERWRITESIZE ? want : DRIVERWRITESIZE;
+        const ssize_t count = write(sw->fd, out->s + sw->sent, size);
+        if (count > 0) {
+            sw->sent += count;
+            for (; sw->written < out->count; ++sw->written) {
+                if (out->end[sw->written] > sw->sent) break;
+                sw->writtenNs[(sw->written + 1) % sw->window] = ns;
+            }
+            sw->sentNs = ns;
+        } else if (errno != EAGAIN && errno != EINTR) {
+            closeSwitch(sw, 1, "failed write");
+            return;
+        }
+    } else if ((revents & (POLLERR | POLLHUP)) && !(revents & POLLIN)) {
+        closeSwitch(sw, 1, "hung up");
+        return;
+    }
+    if (finished(sw)) {
+        sw->doneNs = ns;
+        closeSwitch(sw, 0, "finished");
+    }
+}
+
+
+// Show how long each of the count switches at sw took to take its
+// commands.  Return the number of switches that failed.
+//
+static int showSwitches(const DriverSwitch *sw, int count)
+{
+    int result = 0;
+    for (int n = 0; n < count; ++n) {
+        const DriverOutput *const out = sw[n].out;
+        const DriverLatency *const l = &sw[n].rtt;
+        if (sw[n].desired && sw[n].dumped == sw[n].dumpCount) {
+            show("__: %s:%d had %d routes at generation %u, dumped in "
+                 "%.3f ms, and took %d changes",
+                 sw[n].ips, sw[n].port, sw[n].dumpCount, sw[n].generation,
+                 sw[n].dumpNs / 1e6, out->routes);
+        } else if (n == 0 || out != sw[n - 1].out) {
+            show("__: Pushed %d routes and %d commands in %zu bytes",
+                 out->routes, out->commands, out->size);
+        }
+        if (sw[n].failed) {
+            show("__: %s:%d failed after %zu bytes with %d of %d acked",
+                 sw[n].ips, sw[n].port, sw[n].sent, sw[n].acked, out->count);
+            ++result;
         } else {
-            int ip[4];
-            unsigned int mac[6];
-            const int count =
-                sscanf(buffer, JSONROUTEFMT, &r->poa, &r->dst.port,
-                       ip + 0, ip + 1, ip + 2, ip + 3,
-                       mac + 0, mac + 1, mac + 2, mac + 3, mac + 4, mac + 5);
-            if (count == 12) {
-                for (int n = 0; n < 4; ++n) {
-                    r->dst.ip[n]  = (unsigned char)ip[n];
-                }
-                for (int n = 0; n < 6; ++n) {
-                    r->dst.mac[n] = (unsigned char)mac[n];
-                }
-                sofar = 0;
-                return 0;
+            const double seconds = sw[n].doneNs / 1e9;
+            show("__: %s:%d connected in %.3f ms, sent in %.3f ms, "
+                 "acked in %.3f ms: %.1f MB/s, %.0f routes/s, %d nacks",
+                 sw[n].ips, sw[n].port, sw[n].connectNs / 1e6,
+                 sw[n].sentNs / 1e6, sw[n].doneNs / 1e6,
+                 seconds > 0 ? out->size / seconds / 1e6 : 0.0,
+                 seconds > 0 ? out->routes / seconds : 0.0, sw[n].nacks);
+        }
+        if (l->count) {
+            show("__: %s:%d round trip us: min %llu avg %llu p50 %llu "
+                 "p99 %llu max %llu", sw[n].ips, sw[n].port,
+                 l->min / 1000, l->ns / l->count / 1000,
+                 percentile(l, 50) / 1000, percentile(l, 99) / 1000,
+                 l->max / 1000);
+        }
+    }
+    return result;
+}
+
+
+// Read into desired the route table described on in.
+//
+static void readDesired(DriverInput *in, Route *desired)
+{
+    JsonMember m[JSONMEMBERS];
+    int count = 0;
+    while (JSONEND != (count = nextObject(in, m))) {
+        const Route rt = routeFromJson(m, count);
+        if (jsonFind(m, count, "command") || rt.poa < 0) {
+            error("__: Not a route: %.*s",
+                  (int)(in->j.at - in->j.begin), in->buffer + in->j.begin);
+        } else {
+            desired[rt.poa - PORTOFFSET] = rt;
+            desired[rt.poa - PORTOFFSET].open = rt.dst.port > 0;
+        }
+    }
+}
+
+
+// Push the commands on in to the switches in cl at once, or sync them to
+// the desired route table on in.  Return the number of switches that
+// failed.
+//
+// When pushing, encode the commands once, a DRIVERWRITESIZE chunk at a
+// time, for every switch.  When syncing, first ask each switch to dump
+// its routes, then encode only the changes each needs.  Write each switch
+// as much as its socket takes whenever poll() says it can take more, but
+// no more than cl->window commands past the last one it acked, so a slow
+// switch does not hold up the others.
+//
+static int pushAll(DriverInput *in, const DriverCommandLine *cl)
+{
+    static DriverSwitch sw[DRIVERSWITCHES];
+    static DriverOutput out[DRIVERSWITCHES];
+    static Route desired[R30TOTALCHANNELS];
+    if (cl->sync) readDesired(in, desired);
+    const unsigned long long begin = clockNs(CLOCK_MONOTONIC);
+    for (int n = 0; n < cl->count; ++n) {
+        const DriverSwitch swN = {
+            .ips = cl->ips[n], .port = cl->port[n], .window = cl->window,
+            .writtenNs = grow(NULL, cl->window * sizeof *swN.writtenNs),
+            .out = cl->sync ? out + n : out,
+            .desired = cl->sync ? desired : NULL,
+            .dump = cl->sync ? calloc(R30TOTALCHANNELS, sizeof *swN.dump)
+            : NULL,
+            .dumpCount = -1
+        };
+        sw[n] = swN;
+        if (cl->sync) {
+            const char dump[] = "{ \"command\" : \"dump\" }";
+            appendSequenced(sw[n].out, dump, sizeof dump - 1);
+        }
+        connectSwitch(sw + n);
+    }
+    while (1) {
+        struct pollfd pfd[DRIVERSWITCHES];
+        int live = 0;
+        for (int n = 0; n < cl->count; ++n) {
+            const int more = sw[n].sent < sendLimit(sw + n);
+            const struct pollfd pfdN = {
+                .fd = sw[n].fd,
+                .events = sw[n].connected && !more ? POLLIN : POLLIN | POLLOUT
+            };
+            pfd[n] = pfdN;
+            live += sw[n].fd >= 0;
+        }
+        if (live == 0) break;
+        const int encode = !cl->sync && !out->complete;
+        if (encode) encodeMore(in, out, DRIVERWRITESIZE);
+        const int count = poll(pfd, cl->count, encode ? 0 : -1);
+        if (count < 0 && errno != EINTR) {
+            error("__: poll(%p, %d, -1) returned %d with errno %d: %s",
+                  pfd, cl->count, count, errno, strerror(errno));
+            exit(1);
+        }
+        const unsigned long long ns = clockNs(CLOCK_MONOTONIC) - begin;
+        for (int n = 0; count > 0 && n < cl->count; ++n) {
+            if (pfd[n].fd >= 0 && pfd[n].revents) {
+                serviceSwitch(sw + n, pfd[n].revents, ns);
             }
-            sofar = strlen(buffer);
         }
     }
-    assert(0);
-    return 1;
+    return showSwitches(sw, cl->count);
 }
 
 
@@ -116,18 +844,10 @@ int main(int ac, const char *av[])
     INFO("__: main(%d, %p)", ac, av);
     const DriverCommandLine cl = validateDriverUsage(ac, av);
     errorInitialize(cl.av0);
-    const int fd = connectTcpPort(cl.ips, cl.port);
-    const int eofIsFail = setvbuf(stdin, NULL, _IOLBF, 0);
-    INFO("__: setvbuf() returned %d where EOF is %d", eofIsFail, EOF);
-    int done = 0;
-    while (!done) {
-        Route r = {};
-        done = routeFromStream(&r, stdin);
-        if (done) {
-            stopSwitch(fd);
-        } else {
-            routeSendControl(fd, &r);
-        }
+    static DriverInput in = { .fd = 0 };
+    if (cl.parse) {
+        parseOnly(&in);
+        return 0;
     }
-    return 0;
+    return pushAll(&in, &cl) ? 1 : 0;
 }
@@ -0,0 +1,133 @@
+#include <limits.h>
+#include <unistd.h>
+
+#include "flood.h"
+#include "process.h"
+#include "route.h"
+#include "util.h"
+
+
+// Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
+//
+// #define INFO(F, ...) info(F, ## __VA_ARGS__)
+#define INFO(F, ...)
+
+
+// One trial of flooding route 0.
+//
+// .bps is the rate each route is committed to or 0 if unpoliced.
+// .sent[0] and .received[0] count the packets of route 0.
+// .sent[1] and .received[1] count the packets of the other routes.
+//
+typedef struct FloodTrial {
+    int bps;
+    unsigned long long sent[2];
+    unsigned long long received[2];
+} FloodTrial;
+
+
+// Return the packets lost when received of sent came back.
+//
+static unsigned long long lost(unsigned long long sent,
+                               unsigned long long received)
+{
+    return sent > received ? sent - received : 0;
+}
+
+
+// Add into t what the NETIO threads of p have sent and received.
+//
+static void countThreads(const Process *p, FloodTrial *t)
+{
+    const int end = p->netioThreadIndex + p->netioThreadCount;
+    for (int m = p->netioThreadIndex; m < end; ++m) {
+        const Thread *const thread = p->thread[m];
+        for (int n = 0; n < p->routeCount; ++n) {
+            t->sent[n > 0] += thread->send[n];
+            t->received[n > 0] += thread->recv[n];
+        }
+    }
+}
+
+
+// Commit each route of p to bps bits per second, or stop policing them if
+// bps is 0, by sending route commands on fd.  Give the switch a second to
+// apply them.
+//
+static void policeRoutes(Process *p, int fd, int bps)
+{
+    INFO("__: policeRoutes(%p, %d, %d)", p, fd, bps);
+    for (int n = 0; n < p->routeCount; ++n) {
+        Route rt = routeFromPortOfArrival(PORTOFFSET + n);
+        if (!rt.open) continue;
+        rt.rate = bps;
+        rt.burst = ROUTEBURSTDEFAULT;
+        routeOpen(&rt);
+        routeSendControl(fd, &rt);
+    }
+    sleep(1);
+}
+
+
+// Flood route 0 of p for seconds with its routes committed to bps, then
+// wait for the stragglers.  Send at rate and flood route 0 times as
+// fast.  Return what happened.
+//
+static FloodTrial runTrial(Process *p, int fd, int bps, unsigned int rate,
+                           int times, int seconds)
+{
+    policeRoutes(p, fd, bps);
+    FloodTrial before = {};
+    countThreads(p, &before);
+    p->flood = times;
+    p->rate = rate;
+    sleep(seconds);
+    p->rate = 0;
+    sleep(FLOODDRAINSECONDS);
+    FloodTrial result = { .bps = bps };
+    countThreads(p, &result);
+    for (int n = 0; n < 2; ++n) {
+        result.sent[n] -= before.sent[n];
+        result.received[n] -= before.received[n];
+    }
+    return result;
+}
+
+
+// Show the trial at t on p.
+//
+static void showTrial(const Process *p, const FloodTrial *t)
+{
+    const unsigned long long lost0 = lost(t->sent[0], t->received[0]);
+    const unsigned long long lost1 = lost(t->sent[1], t->received[1]);
+    if (t->bps) {
+        show("__: Flood policed at %d bits/s per route:", t->bps);
+    } else {
+        show("__: Flood unpoliced:");
+    }
+    show("__:     route 0 sent %llu and lost %llu (%.3f%%)",
+         t->sent[0], lost0, t->sent[0] ? 100.0 * lost0 / t->sent[0] : 0.0);
+    show("__:     %d other routes sent %llu and lost %llu (%.3f%%)",
+         p->routeCount - 1, t->sent[1], lost1,
+         t->sent[1] ? 100.0 * lost1 / t->sent[1] : 0.0);
+}
+
+
+int floodRun(Process *p, int fd, int bps, int times, int seconds)
+{
+    INFO("__: floodRun(%p, %d, %d, %d, %d)", p, fd, bps, times, seconds);
+    const unsigned long long pps =
+        1ULL * p->routeCount * bps / (8 * p->packetSize);
+    const unsigned int rate = pps > UINT_MAX ? UINT_MAX : pps ? pps : 1;
+    show("__: Flood route 0 at %d times %d bits/s for %d seconds",
+         times, bps, seconds);
+    const FloodTrial open = runTrial(p, fd, 0, rate, times, seconds);
+    const FloodTrial policed = runTrial(p, fd, bps, rate, times, seconds);
+    p->flood = 0;
+    showTrial(p, &open);
+    showTrial(p, &policed);
+    const int sent = open.sent[0] + open.sent[1] > 0 &&
+        policed.sent[0] + policed.sent[1] > 0;
+    if (!sent) error("__: Flood sent no packets");
+    return sent ? 0 : 1;
+}
@@ -0,0 +1,33 @@
+#ifndef INCLUDE_FLOOD_H
+#define INCLUDE_FLOOD_H
+
+
+// Measure from the tester how well the switch's policers keep a flood on
+// one route from starving the others.
+//
+// The tester sends on every route at the same rate, except route 0, which
+// it floods at several times that rate as a misbehaving encoder would.
+// It runs one trial with the routes unpoliced, then one with each route
+// committed to the rate of the others, and shows the packets route 0 and
+// its neighbors lost in each.  The switch shows the packets it policed,
+// and the cycles policing took in its "police" stage.
+
+
+struct Process;                         // defined in process.h
+
+// Wait FLOODDRAINSECONDS after each trial for the last packets to come
+// back before counting them.
+//
+#define FLOODDRAINSECONDS (2)
+
+
+// Run the flood trials of seconds each on p, with each route sending bps
+// bits per second and route 0 sending times as many packets.  Send the
+// route commands that police the routes on fd.  Return 0 or 1 if nothing
+// was sent.
+//
+extern int floodRun(struct Process *p, int fd, int bps, int times,
+                    int seconds);
+
+
+#endif // INCLUDE_FLOOD_H
@@ -1,13 +1,18 @@
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <arch/cycle.h>
 #include <tmc/cpus.h>
 
+#include "control.h"
 #include "forward.h"
+#include "pipe.h"
 #include "process.h"
 #include "route.h"
+#include "shape.h"
 #include "tilera.h"
 #include "util.h"
 
@@ -132,42 +137,306 @@ static void updateUdpPacket(const PacketInfo *pi, const Route *rt, int poa)
 }
 
 
-// Send the NETIO packet described by pi on t->queue or drop it.
-// Maintain the per-route packet counters here.
-// Return 1 if the packet buffer must be freed with
-// netio_free_buffer(&t->queue, pkt).  Otherwise return 0.
+// Send the NETIO packet described by pi out interface egress on behalf of
+// t with priority.  A packet buffer belongs to the interface that received
+// it, so copy the packet into a buffer from t's queue on egress, and set
+// its source MAC to that interface's.  Report any error but a full queue,
+// and return the result of the send, or of getting the buffer if there is
+// none.
+//
+// The copy costs each crossing packet a memcpy().  The perf2.txt cases
+// measure two interfaces against one with no packet crossing.
+//
+static netio_error_t sendOnOtherInterface(Thread *t, const PacketInfo *pi,
+                                          int egress, int priority)
+{
+    INFO("%02d: sendOnOtherInterface(%p, %p, %d, %d)",
+         t->index, t, pi, egress, priority);
+    static const int sourceMacOffset = 6;
+    const Process *const p = t->process;
+    netio_queue_t *const q = processEgress(t, egress);
+    netio_pkt_t pkt;
+    const netio_error_t err = netio_get_buffer(q, &pkt, pi->l2Length, 1);
+    if (err != NETIO_NO_ERROR) {
+        error("%02d: netio_get_buffer(%p, %p, %d, 1) returned %d: %s",
+              t->index, q, &pkt, pi->l2Length, err, netio_strerror(err));
+        return err;
+    }
+    netio_populate_buffer(&pkt);
+    NETIO_PKT_SET_L2_LENGTH(&pkt, pi->l2Length);
+    unsigned char *const data = NETIO_PKT_L2_DATA(&pkt);
+    memcpy(data, pi->l2Data, pi->l2Length);
+    memcpy(data + sourceMacOffset, p->mac[egress], sizeof p->mac[egress]);
+    netio_pkt_flush(&pkt, pi->l2Length);
+    netio_pkt_fence();
+    const netio_error_t result = sendPacketOrShed(t, q, &pkt, priority);
+    if (result == NETIO_NO_ERROR) {
+        ++t->crossed;
+    } else {
+        if (result != NETIO_QUEUE_FULL) {
+            error("%02d: netio_send_packet(%p, %p) returned %d: %s",
+                  t->index, q, &pkt, result, netio_strerror(result));
+        }
+        const netio_error_t fail = netio_free_buffer(q, &pkt);
+        if (fail != NETIO_NO_ERROR) {
+            error("%02d: netio_free_buffer(%p, %p) returned %d: %s",
+                  t->index, q, &pkt, fail, netio_strerror(fail));
+        }
+    }
+    return result;
+}
+
+
+// Free the NETIO packet at pkt that arrived on interface for t.
+//
+static void forwardFree(Thread *t, int interface, netio_pkt_t *pkt)
+{
+    netio_queue_t *const q = processEgress(t, interface);
+    const netio_error_t err = netio_free_buffer(q, pkt);
+    if (err != NETIO_NO_ERROR) {
+        error("%02d: netio_free_buffer(%p, %p) returned %d: %s",
+              t->index, q, pkt, err, netio_strerror(err));
+    }
+}
+
+
+// Send the rewritten packet described by pi, which arrived on interface,
+// for route rt from t.  Send on another interface if rt->egress is not
+// interface.  Maintain the per-route packet counters, the trace ring, and
+// the stage accounting, counting transit from begin.  Return 1 if the
+// packet buffer must be freed with forwardFree().  Otherwise return 0.
 //
-static int forwardPacketOnQueueOrDrop(Thread *t, const PacketInfo *pi)
+static int forwardSend(Thread *t, const PacketInfo *pi, const Route *rt,
+                       int interface, unsigned long long begin)
 {
-    INFO("%02d: forwardPacketOnQueueOrDrop(%p, %p) with poa %d",
-         t->index, t, pi, pi->poa);
+    const unsigned long long before = get_cycle_count();
+    netio_queue_t *const q = processEgress(t, interface);
+    const int crossing = rt->egress != interface;
+    const netio_error_t err = crossing
+        ? sendOnOtherInterface(t, pi, rt->egress, rt->priority)
+        : sendPacketOrShed(t, q, pi->pkt, rt->priority);
+    const unsigned long long after = get_cycle_count();
+    stageCount(t->stages.stage + STAGESEND, after - before);
+    if (err == NETIO_NO_ERROR) {
+        ++t->send[rt->index];
+        stageCount(&t->stages.transit, after - begin);
+        if (rt->shape && t->shaper) {
+            shapeDeparted(t->shaper, rt, pi->l2Length, after,
+                          &t->stages.departureJitter);
+        }
+        traceRecord(&t->trace, after, pi->poa,
+                    pi->l2Length, pi->status, TRACEFORWARD, err);
+        return crossing;
+    }
+    if (err != NETIO_QUEUE_FULL && !crossing) {
+        error("%02d: netio_send_packet(%p, %p) returned %d: %s",
+              t->index, q, pi->pkt, err, netio_strerror(err));
+    }
+    ++t->drop[rt->index];
+    traceRecord(&t->trace, after, pi->poa,
+                pi->l2Length, pi->status, TRACEDROP, err);
+    return 1;
+}
+
+
+// Return t's shaper, allocating it on t's tile when t first shapes a
+// packet, so threads that never do hold no shaper.
+//
+static Shaper *forwardShaper(Thread *t)
+{
+    if (!t->shaper) {
+        t->shaper = processAllocate(t->process, t->cpu, sizeof *t->shaper);
+        shapeInitialize(t->shaper);
+    }
+    return t->shaper;
+}
+
+
+// Send the rewritten packet described by pi on the shaped route rt from t
+// if it is due, or hold it in t's shaper until it is.  Otherwise drop it.
+// Return as forwardSend() does.
+//
+static int forwardShape(Thread *t, const PacketInfo *pi, const Route *rt,
+                        int interface, unsigned long long begin)
+{
+    const PipeEntry e = {
+        .pkt = *pi->pkt, .pi = *pi, .rt = *rt,
+        .interface = interface, .begin = begin
+    };
+    const unsigned long long now = get_cycle_count();
+    const int held =
+        shapeHold(forwardShaper(t), &e, now, &t->stages.arrivalJitter);
+    stageCount(t->stages.stage + STAGESHAPE, get_cycle_count() - now);
+    if (held == 0) return forwardSend(t, pi, rt, interface, begin);
+    if (held > 0) {
+        ++t->shapeHeld;
+        return 0;
+    }
+    ++t->shapeFull;
+    ++t->drop[rt->index];
+    traceRecord(&t->trace, now, pi->poa,
+                pi->l2Length, pi->status, TRACEDROP, NETIO_QUEUE_FULL);
+    return 1;
+}
+
+
+// Rewrite the packet described by pi, which arrived on interface, for
+// route rt and send it for t, or hold it for later if rt is shaped.
+// Count transit from begin.  Return 1 if the packet buffer must be freed
+// with forwardFree().  Otherwise return 0.
+//
+static int forwardRoute(Thread *t, const PacketInfo *pi, const Route *rt,
+                        int interface, unsigned long long begin)
+{
+    INFO("%02d: forwardRoute(%p, %p, %p, %d, %llu) with poa %d",
+         t->index, t, pi, rt, interface, begin, pi->poa);
+    StageStat *const stage = t->stages.stage;
+    const unsigned long long before = get_cycle_count();
+    netio_populate_buffer(pi->pkt);
+    updateUdpPacket(pi, rt, pi->poa);
+    // dumpPacket(pi->pkt, "./dump-switch.dat");
+    const unsigned long long updated = get_cycle_count();
+    stageCount(stage + STAGEUPDATE, updated - before);
+    netio_pkt_finv(pi->l2Data, pi->allHeadersSize);
+    netio_pkt_fence();
+    stageCount(stage + STAGEFLUSH, get_cycle_count() - updated);
+    if (rt->shape) return forwardShape(t, pi, rt, interface, begin);
+    return forwardSend(t, pi, rt, interface, begin);
+}
+
+
+// Send the packets t's shaper holds that are due.
+//
+static void forwardShaped(Thread *t)
+{
+    PipeEntry e;
+    while (shapeRelease(t->shaper, get_cycle_count(), &e)) {
+        e.pi.pkt = &e.pkt;
+        e.pi.md = NETIO_PKT_METADATA(&e.pkt);
+        if (forwardSend(t, &e.pi, &e.rt, e.interface, e.begin)) {
+            forwardFree(t, e.interface, &e.pkt);
+        }
+    }
+}
+
+
+// Send everything t's shaper holds whether it is due or not, as t stops.
+//
+static void forwardDrainShaper(Thread *t)
+{
+    PipeEntry e;
+    while (t->shaper && shapeDrain(t->shaper, &e)) {
+        e.pi.pkt = &e.pkt;
+        e.pi.md = NETIO_PKT_METADATA(&e.pkt);
+        if (forwardSend(t, &e.pi, &e.rt, e.interface, e.begin)) {
+            forwardFree(t, e.interface, &e.pkt);
+        }
+    }
+}
+
+
+// Pass the packet described by pi on route rt to a transmit thread in
+// pipeline mode, counting transit from begin.  Choose the transmit thread
+// by port of arrival so the packets of a route stay in order.  Return 0
+// if the packet went into the ring.  Otherwise count a drop and return 1
+// so t frees the packet buffer.
+//
+static int forwardToPipe(Thread *t, const PacketInfo *pi, const Route *rt,
+                         unsigned long long begin)
+{
+    INFO("%02d: forwardToPipe(%p, %p, %p, %llu) with poa %d",
+         t->index, t, pi, rt, begin, pi->poa);
+    const Process *const p = t->process;
+    const int count = p->threadCount - p->transmitThreadIndex;
+    const int m = p->transmitThreadIndex + pi->poa % count;
+    Pipe *const pipe = p->thread[m]->pipe + t->index - p->netioThreadIndex;
+    const PipeEntry e = {
+        .pkt = *pi->pkt, .pi = *pi, .rt = *rt,
+        .interface = t->interface, .begin = begin
+    };
+    if (pipePush(pipe, &e)) return 0;
+    ++t->pipeFull;
+    ++t->drop[rt->index];
+    traceRecord(&t->trace, get_cycle_count(), pi->poa,
+                pi->l2Length, pi->status, TRACEDROP, NETIO_QUEUE_FULL);
+    return 1;
+}
+
+
+// The cycle count at which each policed route has sent all it has
+// committed to.  Forwarders on any tile may take a route's packets while
+// its buckets move, so they share these without a lock.
+//
+static volatile unsigned long long policeDue[R30TOTALCHANNELS];
+
+
+// Return 1 if the packet described by pi on the policed route rt at cycle
+// now would put the route more than rt->burstCycles ahead of its rate.
+// Otherwise charge the packet's bytes to the route and return 0.  This
+// is a virtual scheduling token bucket: a compare-and-swap moves the
+// route's due cycle forward, and a forwarder that loses the race to
+// another tries again.
+//
+static int policePacket(const PacketInfo *pi, const Route *rt,
+                        unsigned long long now)
+{
+    volatile unsigned long long *const due = policeDue + rt->index;
+    const unsigned long long cost =
+        rt->byteCycles * pi->l2Length >> ROUTEPOLICESHIFT;
+    for (;;) {
+        const unsigned long long old = *due;
+        const unsigned long long from = old > now ? old : now;
+        if (from + cost - now > rt->burstCycles) return 1;
+        if (__sync_bool_compare_and_swap(due, old, from + cost)) return 0;
+    }
+}
+
+
+// Look up the route for the NETIO packet described by pi on t->queue, and
+// forward the packet or drop it.  Drop packets over a policed route's
+// rate before rewriting them.  Pass the rest to a transmit thread in
+// pipeline mode.  Count transit from begin.  Return 1 if the packet
+// buffer must be freed with netio_free_buffer(&t->queue, pkt).
+// Otherwise return 0.
+//
+static int forwardPacketOnQueueOrDrop(Thread *t, const PacketInfo *pi,
+                                      unsigned long long begin)
+{
+    INFO("%02d: forwardPacketOnQueueOrDrop(%p, %p, %llu) with poa %d",
+         t->index, t, pi, begin, pi->poa);
+    const Process *const p = t->process;
+    const unsigned long long before = get_cycle_count();
     const Route const rt = routeFromPortOfArrival(pi->poa);
+    const unsigned long long after = get_cycle_count();
+    stageCount(t->stages.stage + STAGEROUTE, after - before);
     if (rt.index < 0) {
         error("%02d: forwardPacketOnQueueOrDrop(%p, %p) with poa %d index %d",
               t->index, t, pi, pi->poa, rt.index);
         assert(rt.index >= 0);
     }
     ++t->recv[rt.index];
+    const int bucket = t->interface * BUCKETCOUNT + pi->bucket;
+    if (rt.bucket != bucket) routeNoteBucket(pi->poa, bucket);
     if (pi->status == NETIO_PKT_STATUS_OK) {
         INFO("%02d: forwardPacketOnQueueOrDrop(%p, %p) poa ==  %d",
              t->index, t, pi, pi->poa);
-        if (rt.open) {
-            netio_populate_buffer(pi->pkt);
-            updateUdpPacket(pi, &rt, pi->poa);
-            // dumpPacket(pi->pkt, "./dump-switch.dat");
-            netio_pkt_finv(pi->l2Data, pi->allHeadersSize);
-            netio_pkt_fence();
-            netio_error_t err = NETIO_QUEUE_FULL;
-            while (err == NETIO_QUEUE_FULL) {
-                err = netio_send_packet(&t->queue, pi->pkt);
+        if (rt.open && rt.rate) {
+            const unsigned long long now = get_cycle_count();
+            const int policed = policePacket(pi, &rt, now);
+            const unsigned long long checked = get_cycle_count();
+            stageCount(t->stages.stage + STAGEPOLICE, checked - now);
+            if (policed) {
+                ++t->policed[rt.index];
+                traceRecord(&t->trace, checked, pi->poa, pi->l2Length,
+                            pi->status, TRACEPOLICE, NETIO_NO_ERROR);
+                return 1;
             }
-            if (err == NETIO_NO_ERROR) {
-                ++t->send[rt.index];
-                return 0;
+        }
+        if (rt.open) {
+            if (p->transmitThreadIndex < p->threadCount) {
+                return forwardToPipe(t, pi, &rt, begin);
             }
-            error("%02d:nnetio_send_packet(%p, %p) returned %d: %s",
-                  t->index, &t->queue, pi->pkt,
-                  err, netio_strerror(err));
+            return forwardRoute(t, pi, &rt, t->interface, begin);
         }
         error("%02d: No route for port %d", t->index, pi->poa);
     } else {
@@ -175,23 +444,32 @@ static int forwardPacketOnQueueOrDrop(Thread *t, const PacketInfo *pi)
               t->index, pi->status, netio_strerror(pi->status));
     }
     ++t->drop[rt.index];
+    traceRecord(&t->trace, after, pi->poa,
+                pi->l2Length, pi->status, TRACEDROP, NETIO_NO_ERROR);
     return 1;
 }
 
 
-// Dispatch the NETIO packet at pkt from t->queue.  Return 1 if the packet
-// buffer must be freed with netio_free_buffer(&t->queue, pkt).  Otherwise
-// return 0.
+// Dispatch the NETIO packet at pkt from t->queue polled at cycle begin.
+// Return 1 if the packet buffer must be freed with
+// netio_free_buffer(&t->queue, pkt).  Otherwise return 0.
 //
-static int forwardPacketOnQueueOrTap(Thread *t, netio_pkt_t *pkt)
+static int forwardPacketOnQueueOrTap(Thread *t, netio_pkt_t *pkt,
+                                     unsigned long long begin)
 {
-    INFO("%02d: forwardPacketOnQueueOrTap(%p, %p)", t->index, t, pkt);
+    INFO("%02d: forwardPacketOnQueueOrTap(%p, %p, %llu)",
+         t->index, t, pkt, begin);
     Process *const p = t->process;
-    int result = 1;
+    const unsigned long long before = get_cycle_count();
     const PacketInfo pi = parsePacket(p, pkt);
+    const unsigned long long after = get_cycle_count();
+    stageCount(t->stages.stage + STAGEPARSE, after - before);
     ++t->status[pi.status];
-    if (pi.isUdpForMe) return forwardPacketOnQueueOrDrop(t, &pi);
+    ++t->bucketPackets[pi.bucket];
+    t->bucketBytes[pi.bucket] += pi.l2Length;
+    if (pi.isUdpForMe) return forwardPacketOnQueueOrDrop(t, &pi, begin);
     ++t->tap;
+    traceRecord(&t->trace, after, 0, pi.l2Length, pi.status, TRACETAP, 0);
     const int wCount = write(p->tap, pi.l2Data, pi.l2Length);
     if (wCount < 0) {
         error("%02d: write(%d, %p, %zu) returned %d with errno %d: %s",
@@ -202,18 +480,29 @@ static int forwardPacketOnQueueOrTap(Thread *t, netio_pkt_t *pkt)
 }
 
 
-// Forward a UDP packet for t->queue.
+// Forward a UDP packet for t->queue.  Account for the poll as idle if
+// there is no packet, and as busy until the packet is dispatched if there
+// is one.  Return 0 if there was no packet.  Otherwise return 1.
 //
-static void forwardPackets(Thread *t)
+static int forwardPackets(Thread *t)
 {
     // INFO("%02d: forwardPackets(%p)", t->index, t); // too much spew
     netio_queue_t *const q = &t->queue;
+    Stages *const s = &t->stages;
     int packetSent = 0;
     netio_pkt_t pkt;
+    const unsigned long long begin = get_cycle_count();
     netio_error_t err = netio_get_packet(q, &pkt);
-    if (err != NETIO_NOPKT) {
+    const unsigned long long polled = get_cycle_count();
+    if (err == NETIO_NOPKT) {
+        ++s->idlePolls;
+        s->idleCycles += polled - begin;
+        return 0;
+    } else {
         if (err == NETIO_NO_ERROR) {
-            const int freePacketBuffer = forwardPacketOnQueueOrTap(t, &pkt);
+            stageCount(s->stage + STAGEPOLL, polled - begin);
+            const int freePacketBuffer =
+                forwardPacketOnQueueOrTap(t, &pkt, begin);
             if (freePacketBuffer) {
                 err = netio_free_buffer(q, &pkt);
                 if (err != NETIO_NO_ERROR) {
@@ -225,25 +514,215 @@ static void forwardPackets(Thread *t)
             error("%02d: netio_get_packet(%p, %p) returned %d: %s",
                   t->index, q, &pkt, err, netio_strerror(err));
         }
+        const unsigned long long cycles = get_cycle_count() - begin;
+        ++s->busyPolls;
+        s->busyCycles += cycles;
+        stageCount(&s->packet, cycles);
     }
+    return 1;
 }
 
 
-void *forwardStart(void *v)
+// Take a packet from the next nonempty ring of transmit thread t after
+// *next, and rewrite and send it.  Account for the poll as idle if every
+// ring is empty, and as busy until the packet is sent if one is not.
+// Return 0 if there was no packet.  Otherwise return 1.
+//
+static int transmitPackets(Thread *t, int *next)
+{
+    // INFO("%02d: transmitPackets(%p, %p)", t->index, t, next);
+    Stages *const s = &t->stages;
+    const unsigned long long begin = get_cycle_count();
+    PipeEntry e;
+    int found = 0;
+    for (int n = 0; !found && n < t->pipeCount; ++n) {
+        found = pipePop(t->pipe + *next, &e);
+        *next = *next + 1 == t->pipeCount ? 0 : *next + 1;
+    }
+    const unsigned long long polled = get_cycle_count();
+    if (!found) {
+        ++s->idlePolls;
+        s->idleCycles += polled - begin;
+        return 0;
+    }
+    stageCount(s->stage + STAGEPOLL, polled - begin);
+    stageCount(s->stage + STAGERING, polled - e.begin);
+    e.pi.pkt = &e.pkt;
+    e.pi.md = NETIO_PKT_METADATA(&e.pkt);
+    if (forwardRoute(t, &e.pi, &e.rt, e.interface, e.begin)) {
+        forwardFree(t, e.interface, &e.pkt);
+    }
+    const unsigned long long cycles = get_cycle_count() - begin;
+    ++s->busyPolls;
+    s->busyCycles += cycles;
+    stageCount(&s->packet, cycles);
+    return 1;
+}
+
+
+// Track how long a forwarder has found its queue empty.
+//
+// .since is the cycle count at the first empty poll or 0 while busy.
+// .sleepNs is the length of the last sleep or 0 while spinning.
+// .beginNs is the monotonic clock when the forwarder started.
+//
+typedef struct Idle {
+    unsigned long long since;
+    unsigned long long sleepNs;
+    unsigned long long beginNs;
+} Idle;
+
+
+// Update the CPU and wall time the forwarder on t has used since idle
+// began.
+//
+static void forwardUpdateCpu(Thread *t, const Idle *idle)
+{
+    t->stages.cpuNs = clockNs(CLOCK_THREAD_CPUTIME_ID);
+    t->stages.wallNs = clockNs(CLOCK_MONOTONIC) - idle->beginNs;
+}
+
+
+// Found a packet on t->queue, so start spinning again.
+//
+static void forwardWake(Idle *idle)
+{
+    idle->since = idle->sleepNs = 0;
+}
+
+
+// Found t->queue empty, so spin until p->idleSpinUs pass, then sleep
+// for exponentially longer periods up to p->idleSleepUs.  Keep spinning
+// while t's shaper holds packets, so they leave when they are due.
+//
+static void forwardIdle(Thread *t, Idle *idle)
+{
+    const Process *const p = t->process;
+    if (t->shaper && t->shaper->count) return;
+    const unsigned long long now = get_cycle_count();
+    if (idle->since == 0) {
+        idle->since = now;
+        return;
+    }
+    const unsigned long long sleepMaxNs = 1000ULL * p->idleSleepUs;
+    const unsigned long long spin = p->cyclesPerUs * p->idleSpinUs;
+    if (sleepMaxNs == 0 || now - idle->since < spin) return;
+    idle->sleepNs = idle->sleepNs ? 2 * idle->sleepNs : IDLEMINSLEEPNS;
+    if (idle->sleepNs > sleepMaxNs) idle->sleepNs = sleepMaxNs;
+    const struct timespec ts = {
+        .tv_sec  = idle->sleepNs / 1000000000ULL,
+        .tv_nsec = idle->sleepNs % 1000000000ULL
+    };
+    nanosleep(&ts, NULL);
+    const unsigned long long slept = get_cycle_count() - now;
+    const unsigned long long asked = p->cyclesPerUs * idle->sleepNs / 1000;
+    stageCount(&t->stages.oversleep, slept > asked ? slept - asked : 0);
+    ++t->stages.sleeps;
+    t->stages.sleepCycles += slept;
+    forwardUpdateCpu(t, idle);
+}
+
+
+// Run the control loop on t without blocking.  Return 0 after waking
+// main() when the control connection has closed.  Otherwise return 1.
+//
+static int forwardControl(Thread *t)
 {
-    Thread *const t = (Thread *)v;
     Process *const p = t->process;
-    INFO("%02d: forwardStart(p)", t->index, t);
+    if (controlPoll(t, 0)) {
+        processLock(p); p->controlDone = 1; processNotify(p); processUnlock(p);
+        return 0;
+    }
+    return 1;
+}
+
+
+// Bind the caller to the CPU of thread t.
+//
+static void forwardSetCpu(const Thread *t)
+{
     const int fail = tmc_cpus_set_my_cpu(t->cpu);
     if (fail) {
         error("%02d: tmc_cpus_set_my_cpu(%d) returned %d for thread %2d",
               t->index, t->cpu, fail, t->index);
     }
+}
+
+
+void *forwardStart(void *v)
+{
+    Thread *const t = (Thread *)v;
+    Process *const p = t->process;
+    INFO("%02d: forwardStart(p)", t->index, t);
+    forwardSetCpu(t);
     registerQueueReadWrite(t);
     processLock(p); t->alert = 0; processNotify(p); processUnlock(p);
-    while (!t->alert) forwardPackets(t);
+    Idle idle = { .beginNs = clockNs(CLOCK_MONOTONIC) };
+    unsigned int polls = 0;
+    int hostControl =
+        p->topology.controlForwards && t->index == p->netioThreadIndex;
+    while (!t->alert) {
+        if (t->shaper && t->shaper->count) forwardShaped(t);
+        if (forwardPackets(t)) {
+            forwardWake(&idle);
+            ++polls;
+            if ((polls & 0xffff) == 0) forwardUpdateCpu(t, &idle);
+            if (hostControl && (polls & CONTROLPOLLMASK) == 0) {
+                hostControl = forwardControl(t);
+            }
+        } else {
+            if (hostControl) hostControl = forwardControl(t);
+            forwardIdle(t, &idle);
+        }
+    }
+    forwardDrainShaper(t);
+    forwardUpdateCpu(t, &idle);
     INFO("%02d: forwardStart(%p) alerted", t->index, t);
     unregisterQueue(t);
     processLock(p); t->alert = 0; processNotify(p); processUnlock(p);
     return t;
 }
+
+
+void *forwardTransmit(void *v)
+{
+    Thread *const t = (Thread *)v;
+    Process *const p = t->process;
+    INFO("%02d: forwardTransmit(%p)", t->index, t);
+    forwardSetCpu(t);
+    registerQueueWrite(t);
+    processLock(p); t->alert = 0; processNotify(p); processUnlock(p);
+    Idle idle = { .beginNs = clockNs(CLOCK_MONOTONIC) };
+    unsigned int polls = 0;
+    int next = 0;
+    while (!t->alert) {
+        if (t->shaper && t->shaper->count) forwardShaped(t);
+        if (transmitPackets(t, &next)) {
+            forwardWake(&idle);
+            ++polls;
+            if ((polls & 0xffff) == 0) forwardUpdateCpu(t, &idle);
+        } else {
+            forwardIdle(t, &idle);
+        }
+    }
+    while (transmitPackets(t, &next)) continue;
+    forwardDrainShaper(t);
+    forwardUpdateCpu(t, &idle);
+    INFO("%02d: forwardTransmit(%p) alerted", t->index, t);
+    unregisterQueue(t);
+    processLock(p); t->alert = 0; processNotify(p); processUnlock(p);
+    return t;
+}
+
+
+void forwardInitializePipeline(Process *p)
+{
+    INFO("__: forwardInitializePipeline(%p)", p);
+    const int count = p->transmitThreadIndex - p->netioThreadIndex;
+    for (int m = p->transmitThreadIndex; m < p->threadCount; ++m) {
+        Thread *const t = p->thread[m];
+        t->pipe = processAllocate(p, t->cpu, count * sizeof *t->pipe);
+        t->pipeCount = count;
+        t->start = forwardTransmit;
+    }
+}
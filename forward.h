@@ -5,11 +5,28 @@
 // Receive and send packets to forward them according to route commands
 // in the switch program.
 
+
+// Defined in process.h.
+//
+struct Process;
+
 // Start forwarding UDP packets according to their port of arrival on
 // thread.  This is a pthread_create() start function where thread is
 // a (Thread *) cast to (void *).
 //
 extern void *forwardStart(void *thread);
 
+// Rewrite and send the packets that forwarders pass to thread in pipeline
+// mode.  This is a pthread_create() start function like forwardStart().
+// It drains its rings before stopping, so stop it after the forwarders.
+//
+extern void *forwardTransmit(void *thread);
+
+// Set up the transmit threads of p in pipeline mode to run
+// forwardTransmit() with a ring from each forwarder, homed on the
+// transmit thread's tile according to p->topology.
+//
+extern void forwardInitializePipeline(struct Process *p);
+
 
 #endif // INCLUDE_FORWARD_H
@@ -0,0 +1,287 @@
+#include <limits.h>
+#include <string.h>
+
+#include "json.h"
+#include "util.h"
+
+
+// Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
+//
+// #define INFO(F, ...) info(F, ## __VA_ARGS__)
+#define INFO(F, ...)
+
+
+void jsonInitialize(Json *j, const char *s, size_t size)
+{
+    const Json result = { .s = s, .size = size };
+    *j = result;
+}
+
+
+// Return true if c is JSON white space or the 0 that ends a C string.
+//
+static int isSpace(int c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == ""[0];
+}
+
+
+// Return true if c can be part of a JSON number.
+//
+static int isNumber(int c)
+{
+    return (c >= '0' && c <= '9') ||
+        c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+
+// Skip white space in j and return the next byte, or -1 at the end of j.
+//
+static int skipSpace(Json *j)
+{
+    while (j->at < j->size && isSpace(j->s[j->at])) ++j->at;
+    return j->at < j->size ? j->s[j->at] : -1;
+}
+
+
+// Scan into t the string whose quote is at j->at.  Return 0, JSONPARTIAL,
+// or JSONERROR.
+//
+static int scanString(Json *j, JsonToken *t)
+{
+    size_t n = j->at + 1;
+    for (; n < j->size && j->s[n] != '"'; ++n) {
+        if (j->s[n] == '\\') {
+            ++n;
+        } else if ((unsigned char)j->s[n] < ' ') {
+            j->at = n;
+            return JSONERROR;
+        }
+    }
+    if (n >= j->size) return JSONPARTIAL;
+    t->type = JSONSTRING;
+    t->s = j->s + j->at + 1;
+    t->size = n - j->at - 1;
+    j->at = n + 1;
+    return 0;
+}
+
+
+// Scan into t the object or array whose bracket is at j->at, skipping
+// everything in it.  Return 0, JSONPARTIAL, or JSONERROR.
+//
+static int scanNested(Json *j, JsonToken *t)
+{
+    const size_t begin = j->at;
+    int depth = 0;
+    do {
+        const int c = skipSpace(j);
+        if (c < 0) return JSONPARTIAL;
+        if (c == '"') {
+            JsonToken ignored;
+            const int fail = scanString(j, &ignored);
+            if (fail) return fail;
+            continue;
+        }
+        if (c == '{' || c == '[') ++depth;
+        if (c == '}' || c == ']') --depth;
+        ++j->at;
+    } while (depth > 0);
+    t->type = j->s[begin] == '{' ? JSONOBJECT : JSONARRAY;
+    t->s = j->s + begin;
+    t->size = j->at - begin;
+    return 0;
+}
+
+
+// Scan into t the literal word of type at j->at.  Return 0, JSONPARTIAL,
+// or JSONERROR.
+//
+static int scanWord(Json *j, JsonToken *t, const char *word, JsonType type)
+{
+    const size_t size = strlen(word);
+    const size_t have = j->size - j->at;
+    const size_t compare = have < size ? have : size;
+    if (memcmp(j->s + j->at, word, compare)) return JSONERROR;
+    if (have < size) return JSONPARTIAL;
+    t->type = type;
+    t->s = j->s + j->at;
+    t->size = size;
+    j->at += size;
+    return 0;
+}
+
+
+// Scan into t the value at j->at.  Return 0, JSONPARTIAL, or JSONERROR.
+//
+static int scanValue(Json *j, JsonToken *t)
+{
+    const int c = skipSpace(j);
+    if (c < 0) return JSONPARTIAL;
+    if (c == '"') return scanString(j, t);
+    if (c == '{' || c == '[') return scanNested(j, t);
+    if (c == 't') return scanWord(j, t, "true", JSONTRUE);
+    if (c == 'f') return scanWord(j, t, "false", JSONFALSE);
+    if (c == 'n') return scanWord(j, t, "null", JSONNULL);
+    if (c != '-' && !(c >= '0' && c <= '9')) return JSONERROR;
+    size_t n = j->at;
+    while (n < j->size && isNumber(j->s[n])) ++n;
+    if (n == j->size) return JSONPARTIAL;
+    t->type = JSONNUMBER;
+    t->s = j->s + j->at;
+    t->size = n - j->at;
+    j->at = n;
+    return 0;
+}
+
+
+// Scan the members of the object whose brace is at j->at into up to
+// count members at m.  Return the number of members, JSONPARTIAL, or
+// JSONERROR with j->at at the bad byte.
+//
+static int scanMembers(Json *j, JsonMember *m, int count)
+{
+    int result = 0;
+    ++j->at;
+    int c = skipSpace(j);
+    if (c == '}') {
+        ++j->at;
+        return result;
+    }
+    while (1) {
+        if (c < 0) return JSONPARTIAL;
+        if (c != '"') return JSONERROR;
+        JsonMember member;
+        int fail = scanString(j, &member.key);
+        if (fail) return fail;
+        c = skipSpace(j);
+        if (c < 0) return JSONPARTIAL;
+        if (c != ':') return JSONERROR;
+        ++j->at;
+        fail = scanValue(j, &member.value);
+        if (fail) return fail;
+        if (result < count) m[result++] = member;
+        c = skipSpace(j);
+        if (c < 0) return JSONPARTIAL;
+        if (c == '}') {
+            ++j->at;
+            return result;
+        }
+        if (c != ',') return JSONERROR;
+        ++j->at;
+        c = skipSpace(j);
+    }
+}
+
+
+int jsonObject(Json *j, JsonMember *m, int count)
+{
+    INFO("__: jsonObject(%p, %p, %d)", j, m, count);
+    int c = skipSpace(j);
+    while (c == '[' || c == ']' || c == ',') {
+        ++j->at;
+        c = skipSpace(j);
+    }
+    if (c < 0) return JSONEND;
+    j->begin = j->at;
+    const int result = c == '{' ? scanMembers(j, m, count) : JSONERROR;
+    if (result == JSONPARTIAL) {
+        j->at = j->begin;
+    } else if (result == JSONERROR) {
+        const char *const next =
+            memchr(j->s + j->at + 1, '{', j->size - j->at - 1);
+        j->at = next ? next - j->s : j->size;
+    }
+    return result;
+}
+
+
+const JsonToken *jsonFind(const JsonMember *m, int count, const char *key)
+{
+    for (int n = 0; n < count; ++n) {
+        if (jsonIs(&m[n].key, key)) return &m[n].value;
+    }
+    return NULL;
+}
+
+
+int jsonIs(const JsonToken *t, const char *s)
+{
+    return t->type == JSONSTRING &&
+        0 == strncmp(t->s, s, t->size) && s[t->size] == ""[0];
+}
+
+
+int jsonInt(const JsonToken *t, int *result)
+{
+    if (!t || t->type != JSONNUMBER || t->size == 0) return 0;
+    const int negative = t->s[0] == '-';
+    size_t n = negative;
+    long long value = 0;
+    for (; n < t->size && t->s[n] >= '0' && t->s[n] <= '9'; ++n) {
+        value = 10 * value + (t->s[n] - '0');
+        if (value > INT_MAX) return 0;
+    }
+    if (n == negative || n != t->size) return 0;
+    *result = negative ? -value : value;
+    return 1;
+}
+
+
+// Parse into noa the count numbers in base separated by separator in the
+// string t where each is less than 256 and has at most digits digits.
+// Return 1 or 0 if t is not such a string.
+//
+static int parseBytes(const JsonToken *t, unsigned char *noa, int count,
+                      int base, int digits, char separator)
+{
+    if (!t || t->type != JSONSTRING) return 0;
+    size_t at = 0;
+    for (int n = 0; n < count; ++n) {
+        if (n > 0) {
+            if (at == t->size || t->s[at] != separator) return 0;
+            ++at;
+        }
+        unsigned int value = 0;
+        int width = 0;
+        for (; at < t->size && width <= digits; ++at, ++width) {
+            const char c = t->s[at];
+            const int digit =
+                c >= '0' && c <= '9' ? c - '0' :
+                c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                c >= 'A' && c <= 'F' ? c - 'A' + 10 : base;
+            if (digit >= base) break;
+            value = base * value + digit;
+        }
+        if (width == 0 || width > digits || value > 255) return 0;
+        noa[n] = value;
+    }
+    return at == t->size;
+}
+
+
+int jsonIp(const JsonToken *t, unsigned char noa[4])
+{
+    unsigned char result[4];
+    const int ok = parseBytes(t, result, 4, 10, 3, '.');
+    if (ok) memcpy(noa, result, sizeof result);
+    return ok;
+}
+
+
+int jsonMac(const JsonToken *t, unsigned char noa[6])
+{
+    unsigned char result[6];
+    const int ok = parseBytes(t, result, 6, 16, 2, ':');
+    if (ok) memcpy(noa, result, sizeof result);
+    return ok;
+}
+
+
+char *jsonString(const JsonToken *t, char *buffer, size_t size)
+{
+    const size_t count = t->size < size ? t->size : size - 1;
+    memcpy(buffer, t->s, count);
+    buffer[count] = ""[0];
+    return buffer;
+}
@@ -0,0 +1,126 @@
+#ifndef INCLUDE_JSON_H
+#define INCLUDE_JSON_H
+
+
+// Tokenize the JSON route and control commands in place without
+// allocating, so programs can parse straight out of a read() buffer.
+//
+// The commands are flat objects with number and string members in any
+// order and any formatting.  A stream of them may be wrapped in arrays
+// and separated by commas.  Values that are objects or arrays are
+// skipped whole.  Strings are returned raw, so escapes are not decoded.
+
+
+#include <stddef.h>
+
+
+// The types of JSON tokens.
+//
+typedef enum JsonType {
+    JSONNONE,
+    JSONSTRING,
+    JSONNUMBER,
+    JSONTRUE,
+    JSONFALSE,
+    JSONNULL,
+    JSONOBJECT,
+    JSONARRAY
+} JsonType;
+
+
+// A token in a JSON buffer.
+//
+// .type is the type of the token.
+// .s points at the token in the buffer, after the quote of a string, or
+//    at the bracket that opens an object or array.
+// .size is the number of bytes in the token at .s, without the quotes of
+//       a string, or through the closing bracket of an object or array.
+//
+typedef struct JsonToken {
+    JsonType type;
+    const char *s;
+    size_t size;
+} JsonToken;
+
+
+// A member of a JSON object with its .key string and .value.
+//
+typedef struct JsonMember {
+    JsonToken key;
+    JsonToken value;
+} JsonMember;
+
+
+// The most members a command object can have.  jsonObject() skips any
+// more.
+//
+#define JSONMEMBERS (16)
+
+
+// jsonObject() returns one of these or the count of members it found.
+//
+// JSONEND means the buffer has no more objects.
+// JSONPARTIAL means the buffer ends inside an object.
+// JSONERROR means the buffer is not a stream of JSON objects.
+//
+#define JSONEND (-1)
+#define JSONPARTIAL (-2)
+#define JSONERROR (-3)
+
+
+// A position in a buffer of JSON text.
+//
+// .s points at the buffer.
+// .size is the number of bytes at .s.
+// .at is the offset in .s of the next byte to tokenize.
+// .begin is the offset in .s of the last object jsonObject() found.
+//
+typedef struct Json {
+    const char *s;
+    size_t size;
+    size_t at;
+    size_t begin;
+} Json;
+
+
+// Set j to tokenize the size bytes of JSON text at s.
+//
+extern void jsonInitialize(Json *j, const char *s, size_t size);
+
+// Parse the next object in j into up to count members at m, skipping the
+// brackets and commas of any arrays around it.  Return the number of
+// members or JSONEND, JSONPARTIAL, or JSONERROR.  After JSONPARTIAL, j->at
+// is where the partial object began, so read more text after the rest of
+// the buffer and try again.  After JSONERROR, j->at is at the next '{'
+// after the bad byte, so parsing can resume there.
+//
+extern int jsonObject(Json *j, JsonMember *m, int count);
+
+// Return the value of the member named key in the count members at m, or
+// 0 if there is no such member.
+//
+extern const JsonToken *jsonFind(const JsonMember *m, int count,
+                                 const char *key);
+
+// Return 1 if t is a string equal to s.  Otherwise return 0.
+//
+extern int jsonIs(const JsonToken *t, const char *s);
+
+// Write into result the integer number t.  Return 1 or 0 if t is not an
+// integer number that fits in an int.
+//
+extern int jsonInt(const JsonToken *t, int *result);
+
+// Write into noa the 4 bytes of the IPv4 address in the string t, or the
+// 6 bytes of the MAC address.  Return 1 or 0 if t is not such an address.
+//
+extern int jsonIp(const JsonToken *t, unsigned char noa[4]);
+extern int jsonMac(const JsonToken *t, unsigned char noa[6]);
+
+// Copy the string t into the size bytes at buffer with a terminating 0.
+// Return buffer.
+//
+extern char *jsonString(const JsonToken *t, char *buffer, size_t size);
+
+
+#endif // INCLUDE_JSON_H
@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# Compare switch throughput across thread layouts on CPU tiles.
+#
+# Usage: ./layouts.sh <layouts> <fip> <fif> <seconds> <tester command>
+#
+# Each line of the file <layouts> names a layout and gives its switch
+# topology.  For each layout, start ./switch <fip> <fif> <topology>, then
+# run <tester command> against it.  The tester should run for <seconds>
+# and stop the switch when done, as ./tester does.  Report the packets
+# the tester got back per second, the busy share of the forwarders, the
+# p99 cycles the control loop took to notice and handle a command, and
+# the p50 and p99 cycles from polling a packet to sending it.
+#
+# Set SIZES to a list of frame sizes to run each layout once per size
+# with the size appended to <tester command>.  Then <tester command>
+# must give every tester argument up to <load>.
+#
+# Example: ./layouts.sh layouts.txt 172.18.11.200 xgbe/0 10 \
+#              ssh tester ./tester 172.17.3.126 xgbe/0 172.18.11.200 \
+#              2e:97:ef:aa:43:c2 100 100000 10
+#
+# Example: SIZES='60 512 1514' ./layouts.sh pipeline.txt \
+#              172.18.11.200 xgbe/0 10 \
+#              ssh tester ./tester 172.17.3.126 xgbe/0 172.18.11.200 \
+#              2e:97:ef:aa:43:c2 100 100000 10 100
+
+if test $# -lt 5
+then
+    sed -n '3,/^$/s/^# \{0,1\}//p' $0 >&2
+    exit 1
+fi
+layouts=$1 fip=$2 fif=$3 seconds=$4
+shift 4
+
+printf '%-12s %5s %12s %12s %12s %6s %10s %10s %10s %10s\n' \
+    layout size recv drop pps busy gap-p99 cmd-p99 pkt-p50 pkt-p99
+grep -v '^#' $layouts | while read name topology
+do
+    test -n "$name" || continue
+    for size in ${SIZES:--}
+    do
+        tag=$name
+        test "$size" = - || tag=$name-$size
+        log=./layout-$tag.log
+        ./switch $fip $fif ${topology:+"$topology"} > $log 2>&1 &
+        switch=$!
+        while ! grep -q 'Listening for commands' $log
+        do
+            kill -0 $switch 2> /dev/null || break
+            sleep 1
+        done
+        if test "$size" = -
+        then
+            "$@" > ./layout-$tag.tester.log 2>&1 < /dev/null
+        else
+            "$@" $size > ./layout-$tag.tester.log 2>&1 < /dev/null
+        fi
+        wait $switch
+        awk -v name=$name -v size=$size -v seconds=$seconds '
+            /had packet counts:/ { drop += $(NF - 5); recv += $(NF - 3) }
+            END {
+                printf "%-12s %5s %12d %12d %12d",
+                    name, size, recv, drop, recv / seconds
+            }
+        ' ./layout-$tag.tester.log
+        sed -n 's/.*Forwarders polled.*(busy \([0-9]*%\).*/\1/p' $log |
+        awk '{ busy = $1 } END { printf " %6s", busy }'
+        for stat in gap command
+        do
+            sed -n "s/.*Control $stat:.* p99 < \([0-9]*\) .*/\1/p" $log |
+            awk '{ p99 = $1 } END { printf " %10s", p99 }'
+        done
+        for percent in 50 99
+        do
+            sed -n "s/.*Transit latency:.* p$percent < \([0-9]*\) .*/\1/p" \
+                $log | awk '{ p = $1 } END { printf " %10s", p }'
+        done
+        echo
+    done
+done
@@ -1,11 +1,15 @@
+#include <assert.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <arch/cycle.h>
 #include <tmc/cpus.h>
 
+#include "churn.h"
 #include "packets.h"
 #include "process.h"
+#include "replay.h"
 #include "route.h"
 #include "tilera.h"
 #include "util.h"
@@ -17,18 +21,14 @@
 #define INFO(F, ...)
 
 
-#define ETHERNETHEADERSIZE (14)
-#define MINIPHEADERSIZE (20)
-#define UDPHEADERSIZE (8)
-#define UDPPAYLOADOFFSET (UDPHEADERSIZE + MINIPHEADERSIZE + ETHERNETHEADERSIZE)
-#define UDPPAYLOADSIZE (1316)
-#define PACKETSIZE (UDPPAYLOADOFFSET + UDPPAYLOADSIZE)
-
-
-// A count of packets sent per route to verify packet sequence.
+// A count of packets received per route to verify packet sequence.
 //
 static unsigned long long packetCount[R30TOTALCHANNELS];
 
+// A count of packets sent per route to number the packets.
+//
+static unsigned long long sendCount[R30TOTALCHANNELS];
+
 
 // Return the port of arrival for the packet described at pi.  The port of
 // arrival is the just 16-bit integer destination port in the UDP header.
@@ -44,6 +44,16 @@ static int getUdpPortOfArrival(const PacketInfo *pi)
 }
 
 
+// Return the UDP source port of the packet described at pi, which the
+// switch leaves as the tester sent it.
+//
+static int getUdpSourcePort(const PacketInfo *pi)
+{
+    unsigned char *const portByte = pi->l3Data + pi->ipHeaderSize;
+    return (portByte[0] << 8) | (portByte[1] << 0);
+}
+
+
 // Compute the IP (or UDP) checksum on the size bytes in buffer.  Ensure
 // any pseudo header or zero checksum is in place before calling this.
 //
@@ -75,13 +85,14 @@ static void fillBuffer(char *buffer, size_t size, unsigned long long n)
 // over the IPv4 pseudo-header such that the final checksum is valid for
 // the actual header.  The seed is the uncomplemented 16-bit 1's complement
 // checksum of the IPv4 addresses, a zero, the UDP protocol number (0x11)
-// and the UDP packet size (including both the payload and UDP header).
+// and the UDP packet size udpSize (including both the payload and UDP
+// header).
 //
 static unsigned int udpCsumIpPseudoHeaderSeed(const Endpoint *dst,
-                                              const Endpoint *src)
+                                              const Endpoint *src,
+                                              unsigned int udpSize)
 {
     static const unsigned int zeroProtocol = (0x00 << 8) | (0x11 << 0);
-    static const unsigned int udpSize = UDPHEADERSIZE + UDPPAYLOADSIZE;
     unsigned long seed = zeroProtocol + udpSize +
         (0xffff & (src->ip[0] << 8) | (src->ip[1] << 0)) +
         (0xffff & (src->ip[2] << 8) | (src->ip[3] << 0)) +
@@ -103,15 +114,20 @@ static unsigned int udpCsumIpPseudoHeaderSeed(const Endpoint *dst,
 //         NETIO_PKT_DO_EGRESS_CSUM(pkt, dBegin, dSize, cBegin, cSeed);    \
 //     } while (0);
 
-// Write an Ethernet packet from src to dst in pkt.  Fill out PACKETSIZE
-// bytes with repetitions of the value n.  Tell NETIO to calculate both the
-// IPv4 header checksum and the UDP packet checksum.  (Assume the EPP will
-// manage the Ethernet frame check sequence CRC?)
+// Write an Ethernet packet from src to dst in pkt.  Fill out its L2 length
+// with the size bytes of payload and zeros after them, or with
+// repetitions of the value n if payload is 0.  Then write n and the cycle
+// count stamp over the start of the payload.  Tell NETIO to calculate
+// both the IPv4 header checksum and the UDP packet checksum.  (Assume the
+// EPP will manage the Ethernet frame check sequence CRC?)
 //
 static void buildPacket(netio_pkt_t *pkt, unsigned long long n,
-                        const Endpoint *dst, const Endpoint *src)
+                        unsigned long long stamp,
+                        const Endpoint *dst, const Endpoint *src,
+                        const unsigned char *payload, size_t size)
 {
-    INFO("__: buildPacket(%p, %llu, %p, %p)", pkt, n, dst, src);
+    INFO("__: buildPacket(%p, %llu, %llu, %p, %p, %p, %zu)",
+         pkt, n, stamp, dst, src, payload, size);
     static const unsigned char etherType[2]  = { 0x08, 0x00 };
     static const unsigned char ipVersion     = 0x4; // IPv4
     static const unsigned char ipIhl         = 0x5; // 4-byte words in header
@@ -159,8 +175,15 @@ static void buildPacket(netio_pkt_t *pkt, unsigned long long n,
     unsigned int udpCsumSeed = 0;
     *p++ = 0xff & (udpCsumSeed >> 8);
     *p++ = 0xff & (udpCsumSeed >> 0);
-    fillBuffer(p, pEnd - p, n);
-    udpCsumSeed = udpCsumIpPseudoHeaderSeed(dst, src);
+    if (payload) {
+        memcpy(p, payload, size);
+        memset(p + size, 0, pEnd - p - size);
+    } else {
+        fillBuffer(p, pEnd - p, n);
+    }
+    fillBuffer(p, sizeof n, n);
+    fillBuffer(p + sizeof n, sizeof stamp, stamp);
+    udpCsumSeed = udpCsumIpPseudoHeaderSeed(dst, src, udpSize);
     DEBUG_NETIO_PKT_DO_EGRESS_CSUM(pkt, // Checksum IPv4 header on send.
                                    ipHeaderOffset, ipHeaderSize,
                                    ipHeaderCsumOffset, ipHeaderCsumSeed);
@@ -170,26 +193,30 @@ static void buildPacket(netio_pkt_t *pkt, unsigned long long n,
 }
 
 
-// Write a packet for route rt to t->queue.
+// Write a frame of frameSize bytes for route rt to t's queue on the
+// route's egress interface, carrying the size bytes of payload, or
+// packet numbers if payload is 0.
 //
-static void packetSendOne(Thread *t, const Route *rt)
+static void sendFrame(Thread *t, const Route *rt, int frameSize,
+                      const unsigned char *payload, size_t size)
 {
-    INFO("%02d: packetSendOne(%p, %p)", t->index, t, rt);
     Process *const p = t->process;
-    netio_queue_t *const q = &t->queue;
+    netio_queue_t *const q = processEgress(t, rt->egress);
     netio_pkt_t pkt;
-    netio_error_t err = netio_get_buffer(q, &pkt, PACKETSIZE, 1);
+    netio_error_t err = netio_get_buffer(q, &pkt, frameSize, 1);
     if (err != NETIO_NO_ERROR) {
         error("%02d: netio_get_buffer(%p, %p, %d, 1) returned %d: %s",
-              t->index, q, &pkt, PACKETSIZE, err, netio_strerror(err));
+              t->index, q, &pkt, frameSize, err, netio_strerror(err));
+        return;
     }
     netio_populate_buffer(&pkt);
-    NETIO_PKT_SET_L2_LENGTH(&pkt, PACKETSIZE);
+    NETIO_PKT_SET_L2_LENGTH(&pkt, frameSize);
     NETIO_PKT_SET_L2_HEADER_LENGTH(&pkt, ETHERNETHEADERSIZE);
     Endpoint dst = p->control;
     Endpoint src = p->forward;
     dst.port = src.port = rt->poa;
-    buildPacket(&pkt, packetCount[rt->index], &dst, &src);
+    buildPacket(&pkt, sendCount[rt->index]++, get_cycle_count(), &dst, &src,
+                payload, size);
     // dumpPacket(&pkt, "./dump-tester.dat");
     err = NETIO_QUEUE_FULL;
     while (err == NETIO_QUEUE_FULL) err = netio_send_packet(q, &pkt);
@@ -199,10 +226,29 @@ static void packetSendOne(Thread *t, const Route *rt)
         error("%02d: netio_send_packet(%p, %p) returned %d: %s",
               t->index, q, &pkt, err, netio_strerror(err));
     }
+}
+
+
+// Write a packet for route rt out its egress interface.
+//
+static void packetSendOne(Thread *t, const Route *rt)
+{
+    INFO("%02d: packetSendOne(%p, %p)", t->index, t, rt);
+    sendFrame(t, rt, t->process->packetSize, NULL, 0);
     SLEEP(1);
 }
 
 
+int packetsSendPayload(Thread *t, const Route *rt,
+                       const unsigned char *payload, size_t size)
+{
+    const int frameSize = UDPPAYLOADOFFSET + size < PACKETMINSIZE
+        ? PACKETMINSIZE : UDPPAYLOADOFFSET + size;
+    sendFrame(t, rt, frameSize, payload, size);
+    return frameSize;
+}
+
+
 // Free the packet buffer at pkt from q for thread t.
 //
 static void freePacketBuffer(const Thread *t,
@@ -216,13 +262,18 @@ static void freePacketBuffer(const Thread *t,
 }
 
 
-// Read a packet containing n from t->queue, and write a new packet to
-// t->queue containing n + 1.  Invalidate twice the size of the header
-// to make sure some of the packet numbering is cached.
+// Read a packet containing n from t->queue, and send p->load percent of
+// a new packet numbered after the last one sent on the route.
+// Count gaps in the numbering as dropped packets.  Invalidate twice the
+// size of the header to make sure some of the packet numbering is cached.
+//
+// A load over 100 grows the packets in flight until something in the
+// switch or on the wire saturates.
 //
 static void packetReceiveAndSend(Thread *t)
 {
     // INFO("%02d: packetReceiveAndSend(%p)", t->index, t); // too much spew
+    static const int ipDestinationOffset = 16;
     const Process *const p = t->process;
     netio_queue_t *const q = &t->queue;
     int packetSent = 0;
@@ -234,26 +285,41 @@ static void packetReceiveAndSend(Thread *t)
         INFO("%02d: packetReceiveAndSend(%p) got packet on %d",
              t->index, t, pi.poa);
         if (pi.isUdpForMe) {
-            const Route rt = routeFromPortOfArrival(pi.poa);
+            netio_pkt_inv(pi.l2Data, 2 * pi.allHeadersSize);
+            const unsigned char *const pN = pi.l2Data + pi.allHeadersSize;
+            INFO("%02d: pN == %p, pi.l2Data == %p, pi.allHeadersSize == %d",
+                 t->index, pN, pi.l2Data, pi.allHeadersSize);
+            unsigned long long n = 0, stamp = 0;
+            for (int i = sizeof n; i-- > 0;) n = (n << 8) | pN[i];
+            for (int i = sizeof n; i-- > 0;) {
+                stamp = (stamp << 8) | pN[sizeof n + i];
+            }
+            const unsigned long long now = get_cycle_count();
+            if (stamp && stamp <= now) stageCount(&t->roundTrip, now - stamp);
+            const int poa = churnArrival(pi.poa, pi.l2Data,
+                                         pi.l3Data + ipDestinationOffset,
+                                         getUdpSourcePort(&pi), n);
+            const Route rt = routeFromPortOfArrival(poa);
             if (rt.index < 0) {
                 error("%02d: packetReceiveAndSend(%p) with poa %d index %d",
                       t->index, t, pi.poa, rt.index);
                 assert(rt.index >= 0);
             }
             ++t->recv[rt.index];
-            netio_pkt_inv(pi.l2Data, 2 * pi.allHeadersSize);
-            const unsigned char *const pN = pi.l2Data + pi.allHeadersSize;
-            INFO("%02d: pN == %p, pi.l2Data == %p, pi.allHeadersSize == %d",
-                 t->index, pN, pi.l2Data, pi.allHeadersSize);
-            unsigned long long n = 0;
-            for (int i = sizeof n; i-- > 0;) n = (n << 8) | pN[i];
             INFO("%02d: packetReceiveAndSend(%p) finds n %llu count %llu",
                  t->index, t, n, packetCount[rt.index]);
-            if (n != packetCount[rt.index]) ++t->drop[rt.index];
-            packetCount[rt.index] = n;
-            ++packetCount[rt.index];
+            if (n > packetCount[rt.index]) {
+                t->drop[rt.index] += n - packetCount[rt.index];
+            }
+            if (n >= packetCount[rt.index]) packetCount[rt.index] = n + 1;
             freePacketBuffer(t, q, &pkt);
-            if (n < p->packetCount) packetSendOne(t, &rt);
+            if (n < p->packetCount && !p->paced) {
+                t->credit += p->load;
+                while (t->credit >= 100) {
+                    t->credit -= 100;
+                    packetSendOne(t, &rt);
+                }
+            }
         } else {
             // info("%02d: packetReceiveAndSend(%p) forwards to TAP %d: %s",
             //      t->index, t, pi.status, netio_strerror(pi.status));
@@ -277,6 +343,44 @@ static void packetReceiveAndSend(Thread *t)
 }
 
 
+unsigned long long packetsSent(int n)
+{
+    return sendCount[n];
+}
+
+
+// Send a packet on the next of t's routes if it is time to keep up with
+// p->rate.  Thread k of the NETIO threads sends on routes k, k + count,
+// and so on, where count is the number of NETIO threads, so each route
+// has one sender to number its packets.  A thread that falls behind by
+// more than PACKETPACEBURST packets skips them rather than burst.  Send
+// p->flood packets at a time on route 0.
+//
+static void packetPace(Thread *t)
+{
+    Process *const p = t->process;
+    const unsigned int rate = p->rate;
+    const int count = p->netioThreadCount;
+    const int k = t->index - p->netioThreadIndex;
+    if (rate == 0 || k >= p->routeCount) {
+        t->paceNext = 0;
+        return;
+    }
+    const unsigned long long now = get_cycle_count();
+    const unsigned long long gap = 1000000ULL * p->cyclesPerUs * count / rate;
+    if (t->paceNext == 0 || now > t->paceNext + PACKETPACEBURST * gap) {
+        t->paceNext = now;
+    }
+    if (now < t->paceNext) return;
+    t->paceNext += gap;
+    if (t->paceRoute < k || t->paceRoute >= p->routeCount) t->paceRoute = k;
+    const Route rt = routeFromPortOfArrival(PORTOFFSET + t->paceRoute);
+    t->paceRoute += count;
+    const int sends = rt.index == 0 && p->flood > 1 ? p->flood : 1;
+    for (int n = 0; rt.open && n < sends; ++n) packetSendOne(t, &rt);
+}
+
+
 void packetsPrimePipeline(struct Thread *t)
 {
     INFO("%02d: packetsPrimePipeline(%p)", t->index, t);
@@ -303,7 +407,13 @@ void *packetsStart(void *v)
     }
     registerQueueReadWrite(t);
     processLock(p); t->alert = 0; processNotify(p); processUnlock(p);
-    while (!t->alert) packetReceiveAndSend(t);
+    while (!t->alert) {
+        packetReceiveAndSend(t);
+        if (p->paced) {
+            packetPace(t);
+            replaySend(t);
+        }
+    }
     INFO("%02d: packetsStart(%p) alerted", t->index, t);
     unregisterQueue(t);
     processLock(p); t->alert = 0; processNotify(p); processUnlock(p);
@@ -4,12 +4,56 @@
 
 // Send and receive packets for the tester program.
 
+
+#include <stddef.h>
+
+
+struct Route;                           // defined in route.h
 struct Thread;                          // defined in process.h
 
+// The tester sends Ethernet frames of PACKETMINSIZE to PACKETMAXSIZE
+// bytes, not counting the frame check sequence, and PACKETDEFAULTSIZE
+// bytes unless told otherwise.  The smallest frame still has room in
+// its UDP payload for the packet number.
+//
+#define PACKETMINSIZE (60)
+#define PACKETMAXSIZE (1514)
+#define PACKETDEFAULTSIZE (1358)
+
+// The Ethernet, IPv4, and UDP headers before the payload of each frame,
+// with no VLAN tag or IP options.
+//
+#define ETHERNETHEADERSIZE (14)
+#define MINIPHEADERSIZE (20)
+#define UDPHEADERSIZE (8)
+#define UDPPAYLOADOFFSET (UDPHEADERSIZE + MINIPHEADERSIZE + ETHERNETHEADERSIZE)
+
+// The size of a jumbo frame, not counting the frame check sequence.
+// Sending one needs jumbo buffers in the hypervisor configuration.
+//
+#define PACKETJUMBOSIZE (9014)
+
+// A paced thread that falls behind by more than PACKETPACEBURST packets
+// skips the rest instead of sending them all at once.
+//
+#define PACKETPACEBURST (64)
+
 // Prime the packets pipeline by sending a zeroth packet on all open routes.
+// Paced testers need no priming.
 //
 void packetsPrimePipeline(struct Thread *t);
 
+// Send on route rt from t the size bytes at payload in a UDP packet,
+// with the packet number and cycle stamp written over its first 16 bytes.
+// Pad the frame to PACKETMINSIZE.  Return the size of the frame.
+//
+extern int packetsSendPayload(struct Thread *t, const struct Route *rt,
+                              const unsigned char *payload, size_t size);
+
+// Return the number of the next packet to send on route n.
+//
+extern unsigned long long packetsSent(int n);
+
 // Start receiving and sending packets.  This is a pthread_create() start
 // function where thread is a (Thread *) cast to (void *).
 //
@@ -0,0 +1,166 @@
+#!/bin/sh
+#
+# Benchmark the switch against the tester over a matrix of route counts,
+# frame sizes, and forwarder layouts, and compare the results with a
+# baseline to catch regressions.
+#
+# Usage: ./perf.sh <matrix> <fip> <fif> <seconds> <tester command>
+#    or: ./perf.sh -compare <baseline> <results> [<percent>]
+#
+# Each line of the file <matrix> names a case and gives its route count,
+# frame size, and switch topology.  For each case, start ./switch <fip>
+# <fif> <topology>, then run <tester command> <routes> <packets>
+# <seconds> 100 <size> against it, so <tester command> must give every
+# tester argument up to <mac>.  Set PACKETS to change <packets> from a
+# count the tester will not reach in <seconds>.  A <fif> list such as
+# xgbe/0,xgbe/1 forwards on two interfaces, as perf2.txt expects, and
+# the tester should then list its own two.
+#
+# Write a line of JSON per case on stdout with the packets per second
+# and gigabits per second the tester got back, the percentage it lost,
+# the p50 and p99 microseconds of its packets' round trips and of their
+# transit through the switch, and the cycles a forwarder spent on each
+# packet.
+#
+# With -compare, read those lines for the same cases from the files
+# <baseline> and <results>.  Show each measurement of each case, and
+# mark it worse when throughput fell or a cost rose by more than
+# <percent>, which defaults to 5.  Loss is worse when it rose by more
+# than 0.01 percentage points.  Exit 1 if anything got worse.
+#
+# Example: ./perf.sh perf.txt 172.18.11.200 xgbe/0 10 \
+#              ssh tester ./tester 172.17.3.126 xgbe/0 172.18.11.200 \
+#              2e:97:ef:aa:43:c2 > perf.json
+#
+# Example: ./perf.sh -compare perf-baseline.json perf.json 5
+
+if test "$1" = -compare && test $# -ge 3
+then
+    awk -v percent=${4:-5} '
+        function value(key,   s) {
+            if (!match($0, "\"" key "\" : \"?[^\",]*")) return ""
+            s = substr($0, RSTART, RLENGTH)
+            sub(/^[^:]*: "?/, "", s)
+            return s
+        }
+        BEGIN {
+            split("pps gbps", better, " ")
+            split("lossPercent roundTripP50Us roundTripP99Us " \
+                  "transitP50Us transitP99Us cyclesPerPacket", worse, " ")
+            printf "%-16s %-16s %12s %12s %8s\n",
+                "case", "measure", "baseline", "result", "change"
+        }
+        NR == FNR {
+            name = value("case")
+            for (n in better) base[name, better[n]] = value(better[n])
+            for (n in worse) base[name, worse[n]] = value(worse[n])
+            known[name] = 1
+            next
+        }
+        {
+            name = value("case")
+            if (!known[name]) {
+                printf "%-16s not in the baseline\n", name
+                next
+            }
+            for (n = 1; n in better; ++n) compare(name, better[n], -1)
+            for (n = 1; n in worse; ++n) compare(name, worse[n], 1)
+        }
+        function compare(name, key, sign,   b, r, change, bad) {
+            b = base[name, key] + 0
+            r = value(key) + 0
+            change = b ? 100 * (r - b) / b : 0
+            if (key == "lossPercent") {
+                bad = r - b > 0.01
+            } else {
+                bad = sign * change > percent
+            }
+            printf "%-16s %-16s %12.2f %12.2f %7.1f%%%s\n",
+                name, key, b, r, change, bad ? " worse" : ""
+            regressions += bad
+        }
+        END {
+            printf "%d measurements got worse by more than %s%%\n",
+                regressions, percent
+            exit regressions > 0
+        }
+    ' "$2" "$3"
+    exit
+fi
+if test $# -lt 5
+then
+    sed -n '3,/^$/s/^# \{0,1\}//p' $0 >&2
+    exit 1
+fi
+matrix=$1 fip=$2 fif=$3 seconds=$4
+shift 4
+
+grep -v '^#' $matrix | while read name routes size topology
+do
+    test -n "$name" || continue
+    log=./perf-$name.log
+    ./switch $fip $fif ${topology:+"$topology"} > $log 2>&1 &
+    switch=$!
+    while ! grep -q 'Listening for commands' $log
+    do
+        kill -0 $switch 2> /dev/null || break
+        sleep 1
+    done
+    "$@" $routes ${PACKETS:-999999999} $seconds 100 $size \
+        > ./perf-$name.tester.log 2>&1 < /dev/null
+    wait $switch
+    awk -v name=$name -v routes=$routes -v size=$size \
+        -v seconds=$seconds -v topology="$topology" \
+        -v tester=./perf-$name.tester.log '
+        function after(word,   n) {
+            for (n = 1; n < NF; ++n) {
+                if ($n == word) return $(n + 1) == "<" ? $(n + 2) : $(n + 1)
+            }
+            return 0
+        }
+        function before(word,   n) {
+            for (n = 2; n <= NF; ++n) if ($n == word) return $(n - 1)
+            return 0
+        }
+        FILENAME == tester && /had packet counts:/ {
+            drop += $(NF - 5)
+            recv += $(NF - 3)
+        }
+        FILENAME == tester && /cycles per microsecond/ {
+            testerUs = after("measured")
+        }
+        FILENAME == tester && /Round trip:/ {
+            roundTrip50 = after("p50")
+            roundTrip99 = after("p99")
+        }
+        FILENAME != tester && /cycles per microsecond/ {
+            switchUs = after("measured")
+        }
+        FILENAME != tester && /Transit latency:/ {
+            transit50 = after("p50")
+            transit99 = after("p99")
+        }
+        FILENAME != tester && /packets at .* cycles each/ {
+            packets += before("packets")
+            cycles += before("packets") * after("at")
+        }
+        END {
+            testerUs = testerUs ? testerUs : 1
+            switchUs = switchUs ? switchUs : 1
+            printf "{ \"case\" : \"%s\" , \"routes\" : %d , \"size\" : %d ," \
+                " \"topology\" : \"%s\" , \"seconds\" : %d ,", \
+                name, routes, size, topology, seconds
+            printf " \"recv\" : %d , \"drop\" : %d , \"pps\" : %.0f ," \
+                " \"gbps\" : %.3f , \"lossPercent\" : %.4f ,", \
+                recv, drop, recv / seconds, \
+                8 * size * recv / seconds / 1e9, \
+                recv + drop ? 100 * drop / (recv + drop) : 0
+            printf " \"roundTripP50Us\" : %.1f , \"roundTripP99Us\" : %.1f ," \
+                " \"transitP50Us\" : %.2f , \"transitP99Us\" : %.2f ," \
+                " \"cyclesPerPacket\" : %.0f }\n", \
+                roundTrip50 / testerUs, roundTrip99 / testerUs, \
+                transit50 / switchUs, transit99 / switchUs, \
+                packets ? cycles / packets : 0
+        }
+    ' ./perf-$name.tester.log $log
+done
@@ -0,0 +1,90 @@
+#ifndef INCLUDE_PIPE_H
+#define INCLUDE_PIPE_H
+
+
+// Pass classified packets from a receive thread to a transmit thread in
+// pipeline mode.
+//
+// Each Pipe is a lock-free ring with a single producer and a single
+// consumer.  The producer writes only .tail and the consumer writes only
+// .head, each on its own cache line, so neither stalls on the other's
+// stores until the ring fills or empties.
+
+
+#include <netio/netio.h>
+
+#include "route.h"
+#include "tilera.h"
+
+
+// The number of entries in a Pipe, which must be a power of 2.  A full
+// ring drops packets rather than stall the receive thread.
+//
+#define PIPESLOTS (128)
+#define PIPEMASK (PIPESLOTS - 1)
+
+// The size of a cache line to keep the ring indexes apart.
+//
+#define PIPECACHELINE (64)
+
+
+// A packet classified by a receive thread for a transmit thread.
+//
+// .pkt is the NETIO packet, whose buffer still belongs to .interface.
+// .pi is what parsePacket() found in .pkt, whose .pkt and .md the
+//     transmit thread points back at its copy of .pkt.
+// .rt is the route the receive thread looked up for .pi.
+// .interface is the interface the packet arrived on.
+// .begin is the cycle count when the receive thread polled the packet.
+//
+typedef struct PipeEntry {
+    netio_pkt_t pkt;
+    PacketInfo pi;
+    Route rt;
+    int interface;
+    unsigned long long begin;
+} PipeEntry;
+
+
+// A single-producer single-consumer ring of PipeEntry.
+//
+// .head counts the entries the consumer has taken.
+// .tail counts the entries the producer has added.
+// .entry holds the entries in [.head, .tail) modulo PIPESLOTS.
+//
+typedef struct Pipe {
+    volatile unsigned int head __attribute__((aligned(PIPECACHELINE)));
+    volatile unsigned int tail __attribute__((aligned(PIPECACHELINE)));
+    PipeEntry entry[PIPESLOTS] __attribute__((aligned(PIPECACHELINE)));
+} Pipe;
+
+
+// Add e to the tail of pipe.  Return 1 or 0 if pipe is full.
+//
+static inline int pipePush(Pipe *pipe, const PipeEntry *e)
+{
+    const unsigned int tail = pipe->tail;
+    if (tail - pipe->head == PIPESLOTS) return 0;
+    pipe->entry[tail & PIPEMASK] = *e;
+    __sync_synchronize();
+    pipe->tail = tail + 1;
+    return 1;
+}
+
+
+// Take the entry at the head of pipe into e.  Return 1 or 0 if pipe is
+// empty.
+//
+static inline int pipePop(Pipe *pipe, PipeEntry *e)
+{
+    const unsigned int head = pipe->head;
+    if (head == pipe->tail) return 0;
+    __sync_synchronize();
+    *e = pipe->entry[head & PIPEMASK];
+    __sync_synchronize();
+    pipe->head = head + 1;
+    return 1;
+}
+
+
+#endif // INCLUDE_PIPE_H
@@ -1,9 +1,16 @@
 #include <assert.h>
 #include <pthread.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <sys/mman.h>
+
+#include <tmc/alloc.h>
 #include <tmc/cpus.h>
 
+#include "pipe.h"
 #include "process.h"
 #include "tap.h"
 #include "tilera.h"
@@ -46,6 +53,15 @@ void processWait(Process *p)
 }
 
 
+// Return true if t is set up to run start(), or any start function if
+// start is null.
+//
+static int processRuns(const Thread *t, void *(*start)(void *))
+{
+    return t->start && (!start || start == t->start);
+}
+
+
 // Wait for all threads in p to clear their alert flags.
 //
 static void processWaitForThreads(Process *p, void *(*start)(void *),
@@ -56,8 +72,8 @@ static void processWaitForThreads(Process *p, void *(*start)(void *),
     while (wait) {
         wait = 0;
         for (int n = 0; n < p->threadCount; ++n) {
-            Thread *const t = p->thread + n;
-            wait = (start == t->start) && t->alert;
+            Thread *const t = p->thread[n];
+            wait = processRuns(t, start) && t->alert;
             if (wait) {
                 INFO("__: processWaitForThreads(%p, %p, %s) waiting on %02d",
                      p, start, name, t->index);
@@ -77,7 +93,7 @@ int processStopThreads(Process *p, void *(*start)(void *), const char *name)
     INFO("__: stopThreads(%p, %p, %s)", p, start, name);
     processLock(p);
     for (int n = 0; n < p->threadCount; ++n) {
-        Thread *const t = p->thread + n;
+        Thread *const t = p->thread[n];
         if (t->start == start) {
             t->alert = 1;
             INFO("__: processStopThreads(%p, %p, %s) alerted thread %02d (%p)",
@@ -89,7 +105,7 @@ int processStopThreads(Process *p, void *(*start)(void *), const char *name)
     processUnlock(p);
     int result = 0;
     for (int n = 0; n < p->threadCount; ++n) {
-        Thread *const t = p->thread + n;
+        Thread *const t = p->thread[n];
         if (t->start == start) {
             void *status;
             INFO("__: processStopThreads(%p, %p, %s) joining thread %02d (%p)",
@@ -108,9 +124,46 @@ int processStopThreads(Process *p, void *(*start)(void *), const char *name)
 }
 
 
-// Start all threads in p that are set up to run start().  Set pthread
-// stack to the smallest permitted size.  Return the number of threads
-// started after they've all started running.
+int processStopThread(Process *p, Thread *t)
+{
+    INFO("__: processStopThread(%p, %p)", p, t);
+    processLock(p);
+    t->alert = 1;
+    processNotify(p);
+    while (t->alert) processWait(p);
+    processUnlock(p);
+    void *status;
+    const int fail = pthread_join(t->self, &status);
+    if (fail) {
+        error("__: pthread_join(%p, %p) returned %d", t->self, &status, fail);
+        return 0;
+    }
+    assert(status == (void *)t);
+    return 1;
+}
+
+
+int processStartThread(Process *p, Thread *t)
+{
+    INFO("__: processStartThread(%p, %p)", p, t);
+    processLock(p);
+    t->alert = 1;
+    const int fail = pthread_create(&t->self, p->attr, t->start, t);
+    if (fail) {
+        error("__: pthread_create(%p, %p, %p, %p) returned %d",
+              &t->self, p->attr, t->start, t, fail);
+        t->alert = 0;
+    }
+    while (t->alert) processWait(p);
+    processUnlock(p);
+    return !fail;
+}
+
+
+// Start all threads in p that are set up to run start(), or every thread
+// with a start function if start is null.  Set pthread stack to the
+// smallest permitted size.  Return the number of threads started after
+// they've all started running.
 //
 int processStartThreads(Process *p, void *(*start)(void *), const char *name)
 {
@@ -118,8 +171,8 @@ int processStartThreads(Process *p, void *(*start)(void *), const char *name)
     int result = 0;
     processLock(p);
     for (int n = 0; n < p->threadCount; ++n) {
-        Thread *const t = p->thread + n;
-        if (start == t->start) {
+        Thread *const t = p->thread[n];
+        if (processRuns(t, start)) {
             t->alert = 1;
             const int fail = pthread_create(&t->self, p->attr, t->start, t);
             if (fail) {
@@ -163,38 +216,111 @@ static void initializeSomePthreadStuff(Process *p)
 }
 
 
-Process *processInitialize(const char *av0, void *(*start)(void *),
-                           const char *name)
+// Return size new zeroed bytes for a thread on cpu homed according to
+// home.
+//
+static void *allocateHomed(TopologyHome home, int cpu, size_t size)
+{
+    INFO("__: allocateHomed(%d, %d, %zu)", home, cpu, size);
+    tmc_alloc_t alloc = TMC_ALLOC_INIT;
+    if (home == TOPOLOGYHOMEHASH) {
+        tmc_alloc_set_home(&alloc, TMC_ALLOC_HOME_HASH);
+    } else if (home == TOPOLOGYHOMETILE) {
+        tmc_alloc_set_home(&alloc, cpu);
+    }
+    void *const result = tmc_alloc_map(&alloc, size);
+    if (!result) {
+        error("__: tmc_alloc_map(%p, %zu) failed for CPU %d",
+              &alloc, size, cpu);
+        assert(result);
+    }
+    memset(result, 0, size);            // Fault in the pages now.
+    return result;
+}
+
+
+void *processAllocate(const Process *p, int cpu, size_t size)
 {
-    INFO("__: processInitialize(%s, %p, %s)", av0, start, name);
+    return allocateHomed(p->topology.home, cpu, size);
+}
+
+
+void processFree(void *v, size_t size)
+{
+    const int fail = tmc_alloc_unmap(v, size);
+    if (fail) error("__: tmc_alloc_unmap(%p, %zu) returned %d", v, size, fail);
+}
+
+
+// Lock all current and future pages of this process into memory, so
+// no page faults stall forwarding after startup.  Pages mapped later,
+// such as thread stacks, are faulted in when they are mapped.
+//
+static void lockMemory(void)
+{
+    const int fail = mlockall(MCL_CURRENT | MCL_FUTURE);
+    if (fail) {
+        error("__: mlockall(MCL_CURRENT | MCL_FUTURE) returned %d "
+              "with errno %d: %s", fail, errno, strerror(errno));
+    }
+}
+
+
+Process *processInitialize(const char *av0, const Topology *topology,
+                           void *(*start)(void *), const char *name)
+{
+    INFO("__: processInitialize(%s, %p, %p, %s)", av0, topology, start, name);
     static Process theProcess;
-    static cpu_set_t cpuset;
+    lockMemory();
     theProcess.av0 = av0;
+    theProcess.interfaceCount = 1;
     getControlIp(theProcess.control.ip);
     theProcess.control.port = CONTROLPORT;
     initializeSomePthreadStuff(&theProcess);
-    tmc_cpus_get_online_cpus(&cpuset);
-    theProcess.threadCount = tmc_cpus_count(&cpuset);
-    assert(theProcess.threadCount <
-           sizeof theProcess.thread / sizeof theProcess.thread[0]);
+    if (topology) {
+        theProcess.topology = *topology;
+    } else {
+        const int fail = topologyFromString(&theProcess.topology, NULL);
+        assert(!fail);
+    }
+    const Topology *const top = &theProcess.topology;
+    topologyShow(top);
+    const int first = 2 + top->controlForwards;
+    theProcess.threadCount = first + tmc_cpus_count(&top->forward);
+    theProcess.thread =
+        calloc(theProcess.threadCount, sizeof *theProcess.thread);
+    assert(theProcess.thread);
     for (int n = 0; n < theProcess.threadCount; ++n) {
-        Thread *const t = theProcess.thread + n;
+        const int onControl = n == 0 ||
+            (n == 1 && top->tap == TOPOLOGYCONTROL) ||
+            (n == 2 && top->controlForwards);
+        const int cpu = onControl ? top->control
+            : n == 1 ? top->tap
+            : tmc_cpus_find_nth_cpu(&top->forward, n - first);
+        Thread *const t = allocateHomed(top->home, cpu, sizeof *t);
+        theProcess.thread[n] = t;
         t->index = n;
-        t->cpu = tmc_cpus_find_nth_cpu(&cpuset, t->index);
-        t->start = start;               // Overwrite 2 of these below.
+        t->cpu = cpu;
+        const int spare = n >= first + top->forwarders;
+        t->start = spare ? NULL : start; // Overwrite 2 of these below.
         t->process = &theProcess;
     }
-    Thread *const tMain = theProcess.thread + 0;
-    Thread *const tTap = theProcess.thread + 1;
+    Thread *const tMain = theProcess.thread[0];
+    Thread *const tTap = theProcess.thread[1];
     tMain->start = NULL;                // For main().
     tMain->self = pthread_self();
     const int fail = tmc_cpus_set_my_cpu(tMain->cpu);
     if (fail) {
         error("__: tmc_cpus_set_my_cpu(%d) returned %d", tMain->cpu, fail);
     }
-    tTap->start = tapStart;
+    tTap->start = top->tap == TOPOLOGYCONTROL ? NULL : tapStart;
     theProcess.netioThreadIndex = 2;
-    theProcess.netioThreadCount = theProcess.threadCount - 2;
+    theProcess.netioThreadCount = top->controlForwards + top->forwarders;
+    theProcess.transmitThreadIndex = theProcess.threadCount - top->pipeline;
+    theProcess.idleSpinUs = IDLESPINUS;
+    theProcess.idleSleepUs = IDLESLEEPUS;
+    theProcess.cyclesPerUs = measureCyclesPerMicrosecond();
+    theProcess.load = 100;
     return &theProcess;
 }
 
@@ -208,4 +334,12 @@ void processUninitialize(Process *p)
     } else {
         p->attr = NULL;
     }
+    for (int n = 0; n < p->threadCount; ++n) {
+        Thread *const t = p->thread[n];
+        if (t->pipe) processFree(t->pipe, t->pipeCount * sizeof *t->pipe);
+        processFree(t, sizeof *t);
+    }
+    free(p->thread);
+    p->thread = NULL;
+    p->threadCount = 0;
 }
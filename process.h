@@ -9,12 +9,42 @@
 #include <netio/netio.h>
 
 #include "route.h"
+#include "stage.h"
+#include "topology.h"
+#include "trace.h"
 #include "util.h"
 
+// Hash forwarded packets into BUCKETCOUNT NETIO buckets numbered from 0
+// and map each bucket to the queue of one forwarding thread.  See
+// initializeNetio() in tilera.c.
+//
+#define BUCKETLOG2 (NETIO_LOG2_NUM_BUCKETS - 1)
+#define BUCKETCOUNT (1 << BUCKETLOG2)
+#define BUCKETMASK (BUCKETCOUNT - 1)
+
+// A switch forwards on up to MAXINTERFACES network interfaces.  Each
+// interface hashes its packets into its own BUCKETCOUNT buckets, so the
+// process maps ALLBUCKETCOUNT buckets where bucket b is NETIO bucket
+// b % BUCKETCOUNT on interface b / BUCKETCOUNT.
+//
+#define MAXINTERFACES (2)
+#define ALLBUCKETCOUNT (MAXINTERFACES * BUCKETCOUNT)
+
+// By default a forwarder spins on an empty queue for IDLESPINUS
+// microseconds, then sleeps for IDLEMINSLEEPNS nanoseconds doubling up
+// to IDLESLEEPUS microseconds until a packet arrives.  IDLESLEEPUS bounds
+// the latency sleeping adds to a packet.  Set the sleep to 0 to spin.
+//
+#define IDLESPINUS (1000)
+#define IDLESLEEPUS (100)
+#define IDLEMINSLEEPNS (1000)
 
-// The number of CPU tiles on our Tilera chips.
+// A send that finds the egress queue full retries for at most EGRESSRETRYUS
+// microseconds on a priority 0 route.  Each lower priority class gets a
+// quarter of the budget of the class above it, and the lowest class never
+// retries.  So congestion sheds the lowest priority routes first.
 //
-#define MAXCPUCOUNT (64)
+#define EGRESSRETRYUS (50)
 
 
 // State for this thread in the process.
@@ -22,41 +52,99 @@
 // .index is this thread's index into the Process.thread array.
 // .cpu is the Tilera CPU ID of the tile this thread runs on.
 // .alert is set by main() and cleared by this thread to synchronize.
-// .queue is the thread's NETIO queue.
+// .interface is the index in Process.interface of the interface whose
+//            packets this thread receives.
+// .queue is the thread's NETIO queue on .interface.
+// .egress[i] is a write-only queue on interface i for sending packets
+//            that leave on another interface than .interface.
+// .egressing is true while the .egress queues are registered.
 // .start is the function this thread started with or 0 for main().
 // .self is this thread's pthread ID.
 // .process is a pointer back to the Process state shared with others.
 // .drop[n] is a count of dropped packets from port (PORTOFFSET + n).
 // .recv[n] is a count of packets received from port (PORTOFFSET + n).
 // .send[n] is a count of packets sent from port (PORTOFFSET + n).
+// .policed[n] is a count of packets from port (PORTOFFSET + n) dropped
+//             for exceeding the route's rate and burst.
 // .status is a count of packets indexed by netio_pkt_status_t.
 // .tap is a count of packets forwarded to the TAP interface.
+// .crossed is a count of packets sent on another interface than
+//          .interface.
+// .trace is this thread's flight recorder ring.
+// .stages accounts for the cycles this thread spends forwarding.
+// .queueFull counts sends that found the egress queue full.
+// .retryCycles is the sum of cycles spent retrying those sends.
+// .priorityDrop[n] counts packets dropped after exhausting the retry
+//                  budget of priority class n.
+// .bucketPackets[n] counts packets this thread took from bucket n.
+// .bucketBytes[n] counts the bytes in those packets.
+// .credit is the percent of a packet the tester owes to its offered load.
+// .paceNext is the cycle at which the tester's pacing sends next.
+// .paceRoute is the route the tester's pacing sends on next.
+// .roundTrip counts the cycles from the tester sending each packet to
+//            receiving it back.
+// .pipe is 0 or, for a transmit thread in pipeline mode, an array of
+//       .pipeCount rings, where .pipe[n] carries packets from the
+//       forwarder at Process.netioThreadIndex + n.
+// .pipeFull counts packets this forwarder dropped on a full .pipe ring.
+// .shaper holds the packets of shaped routes this thread sends, homed on
+//         its tile, or is 0 until the thread shapes its first packet.
+// .shapeHeld counts the packets .shaper held until they were due.
+// .shapeFull counts packets dropped because .shaper was full or they
+//            were due too far ahead.
 //
 typedef struct Thread {
     int index;
     int cpu;
     int alert;                          // shared via .process
+    int interface;
     netio_queue_t queue;
+    netio_queue_t egress[MAXINTERFACES];
+    int egressing;
     void *(*start)(void *);
     pthread_t self;
     struct Process *process;
     unsigned long long drop[R30TOTALCHANNELS];
     unsigned long long recv[R30TOTALCHANNELS];
     unsigned long long send[R30TOTALCHANNELS];
+    unsigned long long policed[R30TOTALCHANNELS];
     unsigned long long status[NETIO_PKT_STATUS_BAD + 1];
     unsigned long long tap;
+    unsigned long long crossed;
+    Trace trace;
+    Stages stages;
+    unsigned long long queueFull;
+    unsigned long long retryCycles;
+    unsigned long long priorityDrop[ROUTEPRIORITYCOUNT];
+    unsigned long long bucketPackets[BUCKETCOUNT];
+    unsigned long long bucketBytes[BUCKETCOUNT];
+    unsigned int credit;
+    unsigned long long paceNext;
+    int paceRoute;
+    StageStat roundTrip;
+    struct Pipe *pipe;
+    int pipeCount;
+    unsigned long long pipeFull;
+    struct Shaper *shaper;
+    unsigned long long shapeHeld;
+    unsigned long long shapeFull;
 } Thread;
 
 
 // State shared by threads in the process.
 //
 // .av0 is the name of the program running in this process.
-// .interface is the name of the network interface this process uses.
+// .interface[i] is the name of network interface i of the
+//               .interfaceCount interfaces this process uses.
+// .mac[i] is the MAC address of .interface[i].
+// .aliased is true if this process also takes UDP packets sent to
+//          .alias, a MAC address that no interface has.
 //
 // .forward describes this process's network endpoint for UDP forwarding.
 // .forward.port is not used.
 // .forward.ip is this process's IPv4 forwarding address.
-// .forward.mac is the MAC address on .interface with the .forward.ip address.
+// .forward.mac is the MAC address on .interface[0] with the .forward.ip
+//              address.
 //
 // .control describes the switch's control endpoint to both switch and tester.
 // .control.port is the port on which this listens for control messages.
@@ -65,11 +153,36 @@ typedef struct Thread {
 //
 // .tap is the file descriptor of the interface's TAP device.
 // .packetCount is the number of packets to send from the tester.
+// .packetSize is the size of the Ethernet frames the tester sends.
 // .routeCount is the number of route commands handled.
-// .threadCount is the number of active threads in .thread.
-// .thread is an array of per-thread state for .threadCount threads.
-// .netioThreadCount is the number of NETIO threads.
+// .controlDone is true when the control connection has closed.
+// .threadCount is the number of threads in .thread, including spare
+//              forwarders that are not running.
+// .thread is an array of .threadCount pointers to per-thread state, each
+//         homed according to .topology.
+// .topology is the layout of the threads on CPU tiles.
+// .netioThreadCount is the number of running NETIO threads, which are
+//                   the threads after .netioThreadIndex.  The rest of
+//                   the forward CPUs of .topology hold spare threads
+//                   with a null .start.  The first NETIO thread runs on
+//                   the control CPU when .topology.controlForwards.
 // .netioThreadOffset is the index of the first NETIO thread.
+// .transmitThreadIndex is the index of the first of the
+//                      .topology.pipeline transmit threads, which follow
+//                      the spares and end .thread.
+// .idleSpinUs is how long a forwarder spins on an empty queue.
+// .idleSleepUs is the longest a forwarder sleeps on an empty queue.
+// .cyclesPerUs is the measured number of CPU cycles per microsecond.
+// .load is the tester's offered load as a percentage of what returns.
+// .paced is true when the tester sends at .rate instead of as packets
+//        return.
+// .rate is the packets per second the tester sends across its threads
+//       when .paced, which the main thread changes as it runs.
+// .flood is 0 or how many packets a paced tester sends on route 0 for
+//        each it sends on the others.
+// .bucket[b] is the thread index (and queue ID) bucket b maps to.
+// .reserveCount is the number of forwarders, counting down from the last
+//               thread, that take only the buckets of pinned routes.
 // .attr points to the attribute structure used to create threads.
 // .using is a mutex to hold when using the shared process state.
 // .changed is a condition for changing shared process state.
@@ -79,22 +192,47 @@ typedef struct Thread {
 //
 typedef struct Process {
     const char *av0;
-    const char *interface;
+    const char *interface[MAXINTERFACES];
+    int interfaceCount;
+    unsigned char mac[MAXINTERFACES][6];
+    int aliased;
+    unsigned char alias[6];
     Endpoint forward;
     Endpoint control;
     int tap;
     int packetCount;
+    int packetSize;
     int routeCount;
+    int controlDone;                    // shared via .using
     int threadCount;
-    Thread thread[MAXCPUCOUNT];
-    int netioThreadCount;
+    Thread **thread;
+    Topology topology;
+    int netioThreadCount;               // shared via .using
     int netioThreadIndex;
+    int transmitThreadIndex;
+    unsigned int idleSpinUs;            // shared via .using
+    unsigned int idleSleepUs;           // shared via .using
+    unsigned long long cyclesPerUs;
+    int load;
+    int paced;
+    volatile unsigned int rate;
+    volatile int flood;
+    netio_bucket_t bucket[ALLBUCKETCOUNT]; // shared via .using
+    int reserveCount;                   // shared via .using
     pthread_attr_t *attr;
     pthread_mutex_t using;
     pthread_cond_t changed;
 } Process;
 
 
+// Return the queue on which t sends packets out interface i.
+//
+static inline netio_queue_t *processEgress(Thread *t, int i)
+{
+    return i == t->interface ? &t->queue : t->egress + i;
+}
+
+
 // Manage the shared process state monitor.
 //
 extern void processLock(Process *p);
@@ -108,19 +246,40 @@ extern void processWait(Process *p);
 extern int processStopThreads(Process *p, void *(*start)(void *),
                               const char *name);
 
-// Start all threads in p that are set up to run start().  Set pthread
-// stack to the smallest permitted size.  Return the number of threads
-// started after they've all started running.
+// Stop thread t in p, and return 1 after it stops or 0 on failure.
+//
+extern int processStopThread(Process *p, Thread *t);
+
+// Start thread t in p running t->start(), and return 1 after it starts
+// running or 0 on failure.
+//
+extern int processStartThread(Process *p, Thread *t);
+
+// Start all threads in p that are set up to run start(), or every thread
+// with a start function if start is null, so they all register their
+// queues at once.  Set pthread stack to the smallest permitted size.
+// Return the number of threads started after they've all started running.
 //
 extern int processStartThreads(Process *p, void *(*start)(void *),
                                const char *name);
 
 // Return a pointer to this process initialized with name av0 and threads
-// ready to start.  Bind the caller to the 0th CPU.  Set up other threads
-// to run tapStart() on the "first CPU", and (*start)() on the rest.
+// ready to start on topology, or on the default topology if topology is
+// 0.  Bind the caller to the control CPU.  Set up a thread to run
+// tapStart() on the TAP CPU, and (*start)() on each forwarder CPU.  Lock
+// the process's memory and fault in the thread state up front.
+//
+extern Process *processInitialize(const char *av0, const Topology *topology,
+                                  void *(*start)(void *), const char *name);
+
+// Return size bytes of zeroed memory for a thread on cpu in p, homed
+// according to p->topology.  Free it with processFree().
+//
+extern void *processAllocate(const Process *p, int cpu, size_t size);
+
+// Free the size bytes at v from processAllocate().
 //
-extern Process *processInitialize(const char *av0, void *(*start)(void *),
-                                  const char *name);
+extern void processFree(void *v, size_t size);
 
 // Cleanup any remaining process state after all non-main() threads are
 // stopped.
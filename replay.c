@@ -0,0 +1,411 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arch/cycle.h>
+
+#include "packets.h"
+#include "process.h"
+#include "replay.h"
+#include "route.h"
+#include "util.h"
+
+
+// Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
+//
+// #define INFO(F, ...) info(F, ## __VA_ARGS__)
+#define INFO(F, ...)
+
+
+// The pcap file header and record header sizes, the magic numbers that
+// start a file with microsecond or nanosecond timestamps, and the link
+// type of Ethernet captures.
+//
+#define PCAPHEADERSIZE (24)
+#define PCAPRECORDSIZE (16)
+#define PCAPMAGICUS (0xa1b2c3d4)
+#define PCAPMAGICNS (0xa1b23c4d)
+#define PCAPETHERNET (1)
+
+// The largest payload that fits in a frame the tester sends.  Jumbo
+// frames need jumbo buffers the tester cannot count on, so a capture's
+// jumbo frames are skipped.
+//
+#define MAXPAYLOADSIZE (PACKETMAXSIZE - UDPPAYLOADOFFSET)
+
+
+// A packet to replay.
+//
+// .ns is when the packet is due in nanoseconds after the capture began.
+// .route is the index of the route the packet goes out on.
+// .size is the number of bytes at .payload.
+// .payload is the UDP payload from the capture.
+//
+typedef struct ReplayPacket {
+    unsigned long long ns;
+    int route;
+    int size;
+    const unsigned char *payload;
+} ReplayPacket;
+
+
+// The packets one packet thread replays, and what it did with them.  Only
+// that thread writes these once replay starts.
+//
+// .count is the number of packets at .packet.
+// .bytes is the size of the allocation holding this slice.
+// .next is the index in .packet of the next packet to send.
+// .pass counts the times the thread finished its packets.
+// .sent counts the packets sent.
+// .frameBytes counts the bytes in the frames sent.
+// .late counts the packets sent more than REPLAYLATEUS after they were
+//       due.
+// .lateMax is the most cycles a packet was sent after it was due.
+// .packet is the thread's packets in the order it sends them, followed
+//         by their payloads.
+//
+typedef struct ReplaySlice {
+    int count;
+    size_t bytes;
+    int next;
+    unsigned long long pass;
+    unsigned long long sent;
+    unsigned long long frameBytes;
+    unsigned long long late;
+    unsigned long long lateMax;
+    ReplayPacket packet[];
+} ReplaySlice;
+
+
+// A UDP flow in the capture.
+//
+// .used is true when this entry holds a flow.
+// .route is the index of the route the flow goes out on.
+// .key is the source and destination IP addresses and UDP ports.
+//
+typedef struct ReplayFlow {
+    int used;
+    int route;
+    unsigned char key[12];
+} ReplayFlow;
+
+
+// The loaded capture.
+//
+// .slice[k] has the packets of NETIO thread k of .sliceCount.
+// .flows counts the flows kept apart in .flow.
+// .packets counts the UDP packets loaded.
+// .skipped counts the capture records that were not whole UDP packets
+//          or were too big to send.
+// .bytes counts the bytes in the frames that carry .packets.
+// .period is the nanoseconds from the start of the capture to the start
+//         of its next replay.
+// .speed is how many times faster than the capture to replay it, or 0
+//        to replay as fast as possible.
+// .start is the cycle count when replay started, or 0 when it is not
+//        running.
+//
+static struct {
+    ReplaySlice **slice;
+    int sliceCount;
+    ReplayFlow flow[REPLAYFLOWS];
+    int flows;
+    unsigned long long packets;
+    unsigned long long skipped;
+    unsigned long long bytes;
+    unsigned long long period;
+    double speed;
+    volatile unsigned long long start;
+} replay;
+
+
+// Return the 2 bytes at b as a big-endian (network order) number.
+//
+static unsigned int get16(const unsigned char *b)
+{
+    return (b[0] << 8) | (b[1] << 0);
+}
+
+
+// Return the 4 bytes at b as a little-endian number, or as a big-endian
+// one if swap is true.
+//
+static unsigned long get32(const unsigned char *b, int swap)
+{
+    unsigned long result = 0;
+    for (int n = 0; n < 4; ++n) result = (result << 8) | b[swap ? n : 3 - n];
+    return result;
+}
+
+
+// Return the route of the flow with the 12 bytes of key for a tester with
+// routes routes.  Flows get routes in the order they first appear until
+// replay.flow fills, then by hash.
+//
+static int flowRoute(const unsigned char *key, int routes)
+{
+    unsigned int hash = 0;
+    for (int n = 0; n < sizeof replay.flow[0].key; ++n) {
+        hash = hash * 31 + key[n];
+    }
+    for (int n = 0; n < REPLAYFLOWS; ++n) {
+        ReplayFlow *const f = replay.flow + (hash + n) % REPLAYFLOWS;
+        if (!f->used) {
+            f->used = 1;
+            f->route = replay.flows++ % routes;
+            memcpy(f->key, key, sizeof f->key);
+            return f->route;
+        }
+        if (0 == memcmp(f->key, key, sizeof f->key)) return f->route;
+    }
+    return hash % routes;
+}
+
+
+// Find the UDP payload in the Ethernet frame of size bytes at frame, and
+// set *x to replay it on one of routes routes.  Return 0 or -1 if frame
+// is not a whole unfragmented UDP packet in IPv4.
+//
+static int parseFrame(const unsigned char *frame, size_t size, int routes,
+                      ReplayPacket *x)
+{
+    static const unsigned int etherTypeVlan = 0x8100;
+    static const unsigned int etherTypeIp = 0x0800;
+    static const unsigned int ipProtocolUdp = 0x11;
+    static const unsigned int ipFragment = 0x3fff; // MF and offset
+    size_t offset = 12;
+    if (size < offset + 2) return -1;
+    unsigned int etherType = get16(frame + offset);
+    offset += 2;
+    if (etherType == etherTypeVlan) {
+        if (size < offset + 4) return -1;
+        etherType = get16(frame + offset + 2);
+        offset += 4;
+    }
+    if (etherType != etherTypeIp || size < offset + 20) return -1;
+    const unsigned char *const ip = frame + offset;
+    const size_t ipHeaderSize = 4 * (ip[0] & 0xf);
+    const int ok = (ip[0] >> 4) == 4 && ipHeaderSize >= 20 &&
+        ip[9] == ipProtocolUdp && (get16(ip + 6) & ipFragment) == 0;
+    if (!ok || size < offset + ipHeaderSize + 8) return -1;
+    const unsigned char *const udp = ip + ipHeaderSize;
+    const size_t udpSize = get16(udp + 4);
+    const size_t end = offset + ipHeaderSize + udpSize;
+    if (udpSize < 8 || end > size || udpSize - 8 > MAXPAYLOADSIZE) return -1;
+    unsigned char key[sizeof replay.flow[0].key];
+    memcpy(key, ip + 12, 8);
+    memcpy(key + 8, udp, 4);
+    x->route = flowRoute(key, routes);
+    x->size = udpSize - 8;
+    x->payload = udp + 8;
+    return 0;
+}
+
+
+// Read the file named file into a new buffer and set *size to its size.
+// Return the buffer or 0.
+//
+static unsigned char *readFile(const char *file, size_t *size)
+{
+    FILE *const f = fopen(file, "r");
+    if (!f) {
+        error("__: fopen(%s) failed with errno %d: %s",
+              file, errno, strerror(errno));
+        return NULL;
+    }
+    unsigned char *result = NULL;
+    long end = -1;
+    if (0 == fseek(f, 0, SEEK_END)) end = ftell(f);
+    if (end >= 0 && 0 == fseek(f, 0, SEEK_SET)) result = malloc(end + 1);
+    if (result && fread(result, 1, end, f) != (size_t)end) {
+        free(result);
+        result = NULL;
+    }
+    if (!result) error("__: Cannot read %s", file);
+    fclose(f);
+    *size = end;
+    return result;
+}
+
+
+// Parse the pcap capture of size bytes at buffer into count packets at
+// packet on routes routes.  Return the number of packets parsed or -1.
+//
+static int parseCapture(const unsigned char *buffer, size_t size,
+                        int routes, ReplayPacket *packet, int count)
+{
+    if (size < PCAPHEADERSIZE) return -1;
+    const int swap = get32(buffer, 0) != PCAPMAGICUS &&
+        get32(buffer, 0) != PCAPMAGICNS;
+    const unsigned long magic = get32(buffer, swap);
+    if (magic != PCAPMAGICUS && magic != PCAPMAGICNS) return -1;
+    if (get32(buffer + 20, swap) != PCAPETHERNET) return -1;
+    const unsigned long long fraction = magic == PCAPMAGICNS ? 1 : 1000;
+    unsigned long long first = 0;
+    int result = 0;
+    size_t offset = PCAPHEADERSIZE;
+    replay.skipped = 0;
+    while (offset + PCAPRECORDSIZE <= size && result < count) {
+        const unsigned char *const record = buffer + offset;
+        const size_t captured = get32(record + 8, swap);
+        offset += PCAPRECORDSIZE;
+        if (captured > size - offset) break;
+        const unsigned long long ns = 1000000000ULL * get32(record, swap) +
+            fraction * get32(record + 4, swap);
+        if (result == 0) first = ns;
+        ReplayPacket *const x = packet + result;
+        if (ns >= first &&
+            0 == parseFrame(buffer + offset, captured, routes, x)) {
+            x->ns = ns - first;
+            ++result;
+        } else {
+            ++replay.skipped;
+        }
+        offset += captured;
+    }
+    return result;
+}
+
+
+// Deal the count packets at packet out to p's NETIO threads, copying the
+// packets of each thread into a slice homed on its tile.
+//
+static void dealSlices(const Process *p, const ReplayPacket *packet,
+                       int count)
+{
+    replay.sliceCount = p->netioThreadCount;
+    replay.slice = calloc(replay.sliceCount, sizeof *replay.slice);
+    for (int k = 0; k < replay.sliceCount; ++k) {
+        int n = 0;
+        size_t payloads = 0;
+        for (int m = 0; m < count; ++m) {
+            if (packet[m].route % replay.sliceCount == k) {
+                ++n;
+                payloads += packet[m].size;
+            }
+        }
+        const size_t bytes =
+            sizeof (ReplaySlice) + n * sizeof (ReplayPacket) + payloads;
+        const Thread *const t = p->thread[p->netioThreadIndex + k];
+        ReplaySlice *const s = processAllocate(p, t->cpu, bytes);
+        s->bytes = bytes;
+        unsigned char *b = (unsigned char *)(s->packet + n);
+        for (int m = 0; m < count; ++m) {
+            if (packet[m].route % replay.sliceCount == k) {
+                ReplayPacket *const x = s->packet + s->count++;
+                *x = packet[m];
+                memcpy(b, x->payload, x->size);
+                x->payload = b;
+                b += x->size;
+            }
+        }
+        replay.slice[k] = s;
+    }
+}
+
+
+int replayLoad(const Process *p, const char *file)
+{
+    INFO("__: replayLoad(%p, %s)", p, file);
+    size_t size = 0;
+    unsigned char *const buffer = readFile(file, &size);
+    if (!buffer) return -1;
+    const int most = size / (PCAPRECORDSIZE + UDPPAYLOADOFFSET);
+    ReplayPacket *const packet = calloc(most + 1, sizeof *packet);
+    const int count =
+        packet ? parseCapture(buffer, size, p->routeCount, packet, most) : -1;
+    if (count <= 0) {
+        error("__: %s has no UDP packets in an Ethernet pcap capture", file);
+        free(packet);
+        free(buffer);
+        return -1;
+    }
+    replay.packets = count;
+    replay.bytes = 0;
+    for (int n = 0; n < count; ++n) {
+        const int frame = UDPPAYLOADOFFSET + packet[n].size;
+        replay.bytes += frame < PACKETMINSIZE ? PACKETMINSIZE : frame;
+    }
+    const unsigned long long last = packet[count - 1].ns;
+    replay.period = count > 1 ? last + last / (count - 1) : 1000000;
+    if (replay.period == 0) replay.period = 1;
+    dealSlices(p, packet, count);
+    free(packet);
+    free(buffer);
+    show("__: Loaded %llu UDP packets in %d flows lasting %.3f s from %s, "
+         "skipping %llu records", replay.packets, replay.flows,
+         replay.period / 1e9, file, replay.skipped);
+    return count;
+}
+
+
+void replaySend(Thread *t)
+{
+    const unsigned long long start = replay.start;
+    if (start == 0) return;
+    const Process *const p = t->process;
+    const int k = t->index - p->netioThreadIndex;
+    if (k < 0 || k >= replay.sliceCount) return;
+    ReplaySlice *const s = replay.slice[k];
+    if (s->count == 0) return;
+    const ReplayPacket *const x = s->packet + s->next;
+    const unsigned long long now = get_cycle_count();
+    if (replay.speed > 0) {
+        const double ns = 1.0 * s->pass * replay.period + x->ns;
+        const unsigned long long due =
+            start + ns / replay.speed * p->cyclesPerUs / 1000;
+        if (now < due) return;
+        const unsigned long long late = now - due;
+        if (late > REPLAYLATEUS * p->cyclesPerUs) ++s->late;
+        if (late > s->lateMax) s->lateMax = late;
+    }
+    const Route rt = routeFromPortOfArrival(PORTOFFSET + x->route);
+    if (rt.open) {
+        s->frameBytes += packetsSendPayload(t, &rt, x->payload, x->size);
+        ++s->sent;
+    }
+    if (++s->next == s->count) {
+        s->next = 0;
+        ++s->pass;
+    }
+}
+
+
+int replayRun(Process *p, double speed, int seconds)
+{
+    INFO("__: replayRun(%p, %f, %d)", p, speed, seconds);
+    replay.speed = speed;
+    const unsigned long long start = get_cycle_count();
+    replay.start = start;
+    sleep(seconds);
+    replay.start = 0;
+    const unsigned long long cycles = get_cycle_count() - start;
+    sleep(REPLAYDRAINSECONDS);
+    unsigned long long sent = 0, bytes = 0, late = 0, lateMax = 0;
+    for (int k = 0; k < replay.sliceCount; ++k) {
+        const ReplaySlice *const s = replay.slice[k];
+        show("__: Thread %d replayed %llu packets of %d in %llu passes, "
+             "%llu late", p->netioThreadIndex + k, s->sent, s->count,
+             s->pass, s->late);
+        sent += s->sent;
+        bytes += s->frameBytes;
+        late += s->late;
+        if (s->lateMax > lateMax) lateMax = s->lateMax;
+    }
+    const double us = 1.0 * cycles / p->cyclesPerUs;
+    const double captureMbps = 8000.0 * replay.bytes / replay.period;
+    show("__: Replayed %llu packets at %.1f Mb/s and speed %.2f of a "
+         "capture at %.1f Mb/s", sent, 8 * bytes / us, speed, captureMbps);
+    show("__: Sent %llu packets over %d us late, and the latest %.1f us late",
+         late, REPLAYLATEUS, 1.0 * lateMax / p->cyclesPerUs);
+    for (int k = 0; k < replay.sliceCount; ++k) {
+        processFree(replay.slice[k], replay.slice[k]->bytes);
+    }
+    free(replay.slice);
+    replay.slice = NULL;
+    replay.sliceCount = 0;
+    if (sent == 0) error("__: Replayed no packets");
+    return sent ? 0 : 1;
+}
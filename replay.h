@@ -0,0 +1,57 @@
+#ifndef INCLUDE_REPLAY_H
+#define INCLUDE_REPLAY_H
+
+
+// Replay the UDP packets of a pcap capture, such as real MPEG-TS
+// traffic, from the tester through the switch.
+//
+// Replay maps each UDP flow in the capture, by its addresses and ports,
+// onto one of the tester's routes in the order the flows first appear.
+// It sends the flow's payloads with the addresses and ports of that
+// route, keeping their sizes and the gaps between them.  The first 16
+// bytes of each payload carry the tester's packet number and cycle stamp,
+// so the counters still show loss and round-trip time.
+//
+// Each packet thread replays the flows of the routes it paces, so the
+// packets of a flow stay in order.  Each thread gets its own copy of its
+// packets, homed on its tile and laid out in the order it sends them.
+
+
+struct Process;                         // defined in process.h
+struct Thread;                          // defined in process.h
+
+// The most flows replay keeps apart.  Flows past these share routes by
+// a hash of their addresses and ports.
+//
+#define REPLAYFLOWS (4096)
+
+// A packet sent more than REPLAYLATEUS after the capture says it is due
+// counts as late.
+//
+#define REPLAYLATEUS (100)
+
+// Wait REPLAYDRAINSECONDS after replay for the last packets to come back
+// before counting them.
+//
+#define REPLAYDRAINSECONDS (2)
+
+
+// Load the UDP packets of the pcap file named file onto the routes and
+// packet threads of p.  Return the number of packets loaded or -1.
+//
+extern int replayLoad(const struct Process *p, const char *file);
+
+// Replay the packets loaded onto p for seconds, starting again from the
+// beginning of the capture each time it ends.  Send them speed times as
+// fast as the capture did, or as fast as the threads can if speed is 0.
+// Then show what the threads sent.  Return 0 or 1 if nothing was sent.
+//
+extern int replayRun(struct Process *p, double speed, int seconds);
+
+// Send t's next packet if it is due.  Packet threads call this as they
+// poll for packets.
+//
+extern void replaySend(struct Thread *t);
+
+
+#endif // INCLUDE_REPLAY_H
@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "process.h"
+#include "rfc2544.h"
+#include "stage.h"
+#include "util.h"
+
+
+// Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
+//
+// #define INFO(F, ...) info(F, ## __VA_ARGS__)
+#define INFO(F, ...)
+
+
+// Ethernet sends a 4-byte frame check sequence after each frame, then
+// 20 bytes of preamble and inter-frame gap.
+//
+#define FCSSIZE (4)
+#define GAPSIZE (20)
+
+// The most loss trials at one frame size.
+//
+#define LOSSTRIALS (100 / RFC2544LOSSSTEP)
+
+
+// One trial of sending at a fixed rate.
+//
+// .rate is the packets per second the trial asked the threads to send.
+// .offered is the packets per second they did send, which falls short of
+//          .rate when the tester cannot keep up.
+// .sent counts the packets sent.
+// .received counts the packets that came back.
+// .roundTrip has the cycles from sending each packet to receiving it.
+//
+typedef struct Rfc2544Trial {
+    unsigned int rate;
+    unsigned int offered;
+    unsigned long long sent;
+    unsigned long long received;
+    StageStat roundTrip;
+} Rfc2544Trial;
+
+
+// The results at one frame size.
+//
+// .size is the frame size counting the frame check sequence.
+// .line is the most packets per second the interface can carry.
+// .trials counts the trials run.
+// .resolution is the packets per second the search stops within, and
+//             the most a trial's .offered may fall short of its .rate.
+// .slow counts the trials whose .offered fell short, which bound the
+//       search by what the tester can send instead of by the switch.
+// .throughput is the last passing trial, or has .rate 0.
+// .latency is the trial at the .throughput rate to measure latency.
+// .loss is the .lossCount trials from line rate down.
+//
+typedef struct Rfc2544Result {
+    int size;
+    unsigned int line;
+    unsigned int resolution;
+    int trials;
+    int slow;
+    Rfc2544Trial throughput;
+    Rfc2544Trial latency;
+    Rfc2544Trial loss[LOSSTRIALS];
+    int lossCount;
+} Rfc2544Result;
+
+
+// Return the bits per second of interface, which is 10 gigabits on
+// XAUI and 1 gigabit otherwise.
+//
+static unsigned long long lineBits(const char *interface)
+{
+    const int xaui = 0 == strncmp(interface, "xgbe/", strlen("xgbe/"));
+    return xaui ? 10000000000ULL : 1000000000ULL;
+}
+
+
+// Return the packets the trial at t lost, not counting any late packets
+// from an earlier trial that came back during this one.
+//
+static unsigned long long lost(const Rfc2544Trial *t)
+{
+    return t->sent > t->received ? t->sent - t->received : 0;
+}
+
+
+// Return true if the trial at t for r offered its rate without loss.
+// Count it in r if the tester could not offer its rate.
+//
+static int passed(Rfc2544Result *r, const Rfc2544Trial *t)
+{
+    const int slow = t->offered + r->resolution < t->rate;
+    if (slow) {
+        ++r->slow;
+        show("__: Trial at %u packets/s offered only %u, so it fails",
+             t->rate, t->offered);
+    }
+    return !slow && lost(t) == 0;
+}
+
+
+// Add into t what the NETIO threads of p have sent and received, and
+// their round-trip cycles.
+//
+static void countThreads(const Process *p, Rfc2544Trial *t)
+{
+    const int end = p->netioThreadIndex + p->netioThreadCount;
+    for (int m = p->netioThreadIndex; m < end; ++m) {
+        const Thread *const thread = p->thread[m];
+        for (int n = 0; n < p->routeCount; ++n) {
+            t->sent += thread->send[n];
+            t->received += thread->recv[n];
+        }
+        stageMerge(&t->roundTrip, &thread->roundTrip);
+    }
+}
+
+
+// Send at rate for seconds on p, then wait for the stragglers.  Return
+// what happened.  The threads are idle between trials, so this clears
+// their round-trip cycles first.
+//
+static Rfc2544Trial runTrial(Process *p, unsigned int rate, int seconds)
+{
+    static const StageStat zeroStat;
+    const int end = p->netioThreadIndex + p->netioThreadCount;
+    for (int m = p->netioThreadIndex; m < end; ++m) {
+        p->thread[m]->roundTrip = zeroStat;
+    }
+    Rfc2544Trial before = {};
+    countThreads(p, &before);
+    p->rate = rate;
+    sleep(seconds);
+    p->rate = 0;
+    sleep(RFC2544DRAINSECONDS);
+    Rfc2544Trial result = { .rate = rate };
+    countThreads(p, &result);
+    result.sent -= before.sent;
+    result.received -= before.received;
+    result.offered = result.sent / seconds;
+    show("__: Trial of %d-byte frames at %u packets/s offered %u, sent %llu "
+         "and lost %llu", p->packetSize + FCSSIZE, rate, result.offered,
+         result.sent, lost(&result));
+    return result;
+}
+
+
+// Search for the throughput of p at size into r, then measure latency and
+// loss above it, with trials of seconds each.
+//
+static void searchSize(Process *p, int size, int seconds, Rfc2544Result *r)
+{
+    INFO("__: searchSize(%p, %d, %d, %p)", p, size, seconds, r);
+    const unsigned long long bits = lineBits(p->interface[0]);
+    p->packetSize = size - FCSSIZE;
+    r->size = size;
+    r->line = bits / (8 * (size + GAPSIZE));
+    const unsigned int resolution = r->line / 1000 * RFC2544RESOLUTION;
+    r->resolution = resolution;
+    unsigned int low = 0, high = r->line;
+    Rfc2544Trial t = runTrial(p, high, seconds);
+    ++r->trials;
+    if (t.sent == 0) {
+        error("__: Sent no %d-byte frames", size);
+        return;
+    }
+    if (passed(r, &t)) {
+        r->throughput = t;
+        low = high;
+    }
+    while (high - low > resolution) {
+        const unsigned int rate = low + (high - low) / 2;
+        t = runTrial(p, rate, seconds);
+        ++r->trials;
+        if (passed(r, &t)) {
+            r->throughput = t;
+            low = rate;
+        } else {
+            high = rate;
+        }
+    }
+    if (low) {
+        r->latency = runTrial(p, low, seconds);
+        ++r->trials;
+    }
+    for (int percent = 100; r->lossCount < LOSSTRIALS;) {
+        const unsigned int rate = r->line / 100 * percent;
+        if (rate <= low) break;
+        r->loss[r->lossCount++] = runTrial(p, rate, seconds);
+        ++r->trials;
+        percent -= RFC2544LOSSSTEP;
+    }
+}
+
+
+// Write into file the latency of trial t on p in microseconds.
+//
+static void writeLatency(FILE *file, const Process *p, const Rfc2544Trial *t)
+{
+    const StageStat *const s = &t->roundTrip;
+    const unsigned long long us = p->cyclesPerUs;
+    fprintf(file, "{ \"count\" : %llu , \"min\" : %.1f , \"mean\" : %.1f ,"
+            " \"p50\" : %.1f , \"p99\" : %.1f , \"max\" : %.1f }",
+            s->count, s->count ? 1.0 * s->min / us : 0.0,
+            s->count ? 1.0 * s->cycles / s->count / us : 0.0,
+            1.0 * stagePercentile(s, 50) / us,
+            1.0 * stagePercentile(s, 99) / us, 1.0 * s->max / us);
+}
+
+
+// Write the results at count frame sizes r on p into file, noting
+// whether jumbo frames were tested.
+//
+static void writeReport(FILE *file, const Process *p, int seconds,
+                        int jumbo, const Rfc2544Result *r, int count)
+{
+    fprintf(file, "{\n  \"interface\" : \"%s\" ,\n"
+            "  \"lineBitsPerSecond\" : %llu ,\n  \"routes\" : %d ,\n"
+            "  \"trialSeconds\" : %d ,\n  \"drainSeconds\" : %d ,\n"
+            "  \"jumbo\" : %s ,\n  \"sizes\" : [",
+            p->interface[0], lineBits(p->interface[0]), p->routeCount,
+            seconds, RFC2544DRAINSECONDS, jumbo ? "true" : "false");
+    for (int n = 0; n < count; ++n) {
+        const Rfc2544Trial *const t = &r[n].throughput;
+        fprintf(file, "%s\n    { \"frame\" : %d , \"linePacketsPerSecond\" :"
+                " %u , \"trials\" : %d , \"slowTrials\" : %d ,\n"
+                "      \"throughput\" : %u , \"offered\" : %u ,"
+                " \"throughputPercent\" : %.1f ,"
+                " \"throughputBitsPerSecond\" : %llu ,\n"
+                "      \"latencyUs\" : ",
+                n ? "," : "", r[n].size, r[n].line, r[n].trials, r[n].slow,
+                t->rate, t->offered,
+                r[n].line ? 100.0 * t->rate / r[n].line : 0.0,
+                8ULL * r[n].size * t->rate);
+        writeLatency(file, p, &r[n].latency);
+        fprintf(file, " ,\n      \"loss\" : [");
+        for (int m = 0; m < r[n].lossCount; ++m) {
+            const Rfc2544Trial *const l = &r[n].loss[m];
+            fprintf(file, "%s\n        { \"rate\" : %u , \"offered\" : %u ,"
+                    " \"sent\" : %llu , \"lost\" : %llu ,"
+                    " \"percent\" : %.3f }",
+                    m ? "," : "", l->rate, l->offered, l->sent, lost(l),
+                    l->sent ? 100.0 * lost(l) / l->sent : 0.0);
+        }
+        fprintf(file, " ] }");
+    }
+    fprintf(file, " ]\n}\n");
+}
+
+
+int rfc2544Run(Process *p, const char *file, int seconds, int jumbo)
+{
+    INFO("__: rfc2544Run(%p, %s, %d, %d)", p, file, seconds, jumbo);
+    static const int all[] = RFC2544SIZES;
+    static Rfc2544Result result[sizeof all / sizeof all[0]];
+    int sizes[sizeof all / sizeof all[0]];
+    int count = 0;
+    for (int n = 0; n < sizeof all / sizeof all[0]; ++n) {
+        const int fits = all[n] - FCSSIZE <= PACKETMAXSIZE;
+        if (jumbo || fits) sizes[count++] = all[n];
+    }
+    if (!jumbo) show("__: Skipping jumbo frames, which were not asked for");
+    const int packetSize = p->packetSize;
+    for (int n = 0; n < count; ++n) {
+        searchSize(p, sizes[n], seconds, &result[n]);
+        show("__: %d-byte frames forward %u of %u packets/s without loss",
+             sizes[n], result[n].throughput.rate, result[n].line);
+        if (result[n].slow) {
+            show("__: %d-byte frames: %d trials offered too few packets, "
+                 "so the tester may bound that throughput",
+                 sizes[n], result[n].slow);
+        }
+    }
+    p->packetSize = packetSize;
+    FILE *const report = fopen(file, "w");
+    if (!report) {
+        error("__: fopen(%s) failed with errno %d: %s",
+              file, errno, strerror(errno));
+        return -1;
+    }
+    writeReport(report, p, seconds, jumbo, result, count);
+    const int fail = ferror(report) | fclose(report);
+    if (fail) error("__: Cannot write report %s", file);
+    return fail ? -1 : 0;
+}
@@ -0,0 +1,50 @@
+#ifndef INCLUDE_RFC2544_H
+#define INCLUDE_RFC2544_H
+
+
+// Benchmark the switch from the tester the way RFC 2544 does.  For each
+// frame size, search for the highest rate the switch forwards without
+// loss, then measure latency at that rate and the loss at rates above it.
+
+
+#include "packets.h"
+
+
+struct Process;                         // defined in process.h
+
+// The frame sizes to test, counting the 4-byte frame check sequence as
+// RFC 2544 does.  The last is a jumbo frame, which is tested only when
+// asked for, since sending it needs jumbo buffers in the hypervisor
+// configuration.
+//
+#define RFC2544SIZES { 64, 128, 256, 512, 1024, 1280, 1518, \
+                       PACKETJUMBOSIZE + 4 }
+
+// The search for the zero-loss rate stops when the rates around it are
+// within RFC2544RESOLUTION tenths of a percent of line rate.  A trial
+// whose tester offered less than its rate by more than that fails too,
+// since it measured the tester and not the switch.
+//
+#define RFC2544RESOLUTION (5)
+
+// Wait RFC2544DRAINSECONDS after each trial for the last packets to
+// come back before counting them.
+//
+#define RFC2544DRAINSECONDS (2)
+
+// Measure loss at rates RFC2544LOSSSTEP percent of line rate apart, from
+// line rate down to the zero-loss rate.
+//
+#define RFC2544LOSSSTEP (10)
+
+
+// Run the benchmark with p's threads sending on its open routes in
+// trials of seconds each, testing the jumbo frame too if jumbo is true,
+// and write the report as JSON into the file named file.  Return 0 or -1
+// if the report could not be written.
+//
+extern int rfc2544Run(struct Process *p, const char *file, int seconds,
+                      int jumbo);
+
+
+#endif // INCLUDE_RFC2544_H
@@ -4,27 +4,146 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "json.h"
 #include "route.h"
 #include "util.h"
 
 
 // Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
 //
-#define INFO(F, ...) info(F, ## __VA_ARGS__)
-// #define INFO(F, ...)
+// #define INFO(F, ...) info(F, ## __VA_ARGS__)
+#define INFO(F, ...)
 
 
 static Route route[R30TOTALCHANNELS];
 static int routeLimit = sizeof route / sizeof route[0];
+static unsigned int generation;
+
+
+// The version of route[n] is odd while the control thread rewrites it, so
+// forwarders never copy out half of an old route and half of a new one.
+//
+static volatile unsigned int version[R30TOTALCHANNELS];
+
+
+// The number of chains in each destination index, a power of 2.
+//
+#define ROUTEHASHCOUNT (4096)
+
+
+// An index of the open routes by one RouteKey of their destinations.
+//
+// .head[h] is the first route whose key hashes to h, or -1.
+// .next[n] and .prev[n] link route[n] into its chain, or are -1.
+//
+typedef struct RouteIndex {
+    int head[ROUTEHASHCOUNT];
+    int next[R30TOTALCHANNELS];
+    int prev[R30TOTALCHANNELS];
+} RouteIndex;
+
+static RouteIndex byDestination[ROUTEKEYCOUNT];
+
+
+// Return the chain for the key of dst in index key.
+//
+static unsigned int hashKey(RouteKey key, const Endpoint *dst)
+{
+    unsigned int result = 2166136261U;
+    const unsigned char *const b = key == ROUTEKEYMAC ? dst->mac : dst->ip;
+    const size_t size = key == ROUTEKEYMAC ? sizeof dst->mac : sizeof dst->ip;
+    for (size_t n = 0; n < size; ++n) result = (result ^ b[n]) * 16777619U;
+    if (key == ROUTEKEYIPPORT) result = (result ^ dst->port) * 16777619U;
+    return (result ^ result >> 16) & (ROUTEHASHCOUNT - 1);
+}
+
+
+// Return true if the destinations a and b are the same on key.
+//
+static int sameKey(RouteKey key, const Endpoint *a, const Endpoint *b)
+{
+    if (key == ROUTEKEYMAC) return 0 == memcmp(a->mac, b->mac, sizeof a->mac);
+    return 0 == memcmp(a->ip, b->ip, sizeof a->ip) &&
+        (key == ROUTEKEYIP || a->port == b->port);
+}
+
+
+// Link the open route[n] into each destination index.
+//
+static void indexRoute(int n)
+{
+    for (int key = 0; key < ROUTEKEYCOUNT; ++key) {
+        RouteIndex *const x = &byDestination[key];
+        const unsigned int h = hashKey(key, &route[n].dst);
+        x->prev[n] = -1;
+        x->next[n] = x->head[h];
+        if (x->head[h] >= 0) x->prev[x->head[h]] = n;
+        x->head[h] = n;
+    }
+}
+
+
+// Unlink the open route[n] from each destination index.
+//
+static void unindexRoute(int n)
+{
+    for (int key = 0; key < ROUTEKEYCOUNT; ++key) {
+        RouteIndex *const x = &byDestination[key];
+        if (x->prev[n] >= 0) {
+            x->next[x->prev[n]] = x->next[n];
+        } else {
+            x->head[hashKey(key, &route[n].dst)] = x->next[n];
+        }
+        if (x->next[n] >= 0) x->prev[x->next[n]] = x->prev[n];
+        x->next[n] = x->prev[n] = -1;
+    }
+}
+
+
+// Write into result the indexes of up to size open routes whose
+// destinations match dst on key.  Return the number of routes written.
+//
+static int findRoutes(RouteKey key, const Endpoint *dst,
+                      int *result, int size)
+{
+    const RouteIndex *const x = &byDestination[key];
+    int count = 0;
+    for (int n = x->head[hashKey(key, dst)]; n >= 0; n = x->next[n]) {
+        if (count < size && sameKey(key, &route[n].dst, dst)) {
+            result[count++] = n;
+        }
+    }
+    return count;
+}
+
+
+// Begin and end rewriting route[n].
+//
+static void beginWrite(int n)
+{
+    ++version[n];
+    __sync_synchronize();
+}
+
+static void endWrite(int n)
+{
+    __sync_synchronize();
+    ++version[n];
+}
 
 
 void routeInitialize(void)
 {
     INFO("__: routeInitialize()");
     for (int n = 0; n < routeLimit; ++n) {
-        const Route rtN = { .index = n, .poa = PORTOFFSET + n };
+        const Route rtN = {
+            .index = n, .poa = PORTOFFSET + n,
+            .priority = ROUTEPRIORITYDEFAULT, .bucket = -1,
+            .burst = ROUTEBURSTDEFAULT
+        };
         route[n] = rtN;
     }
+    memset(byDestination, -1, sizeof byDestination);
 }
 
 
@@ -33,8 +152,59 @@ void routeOpen(const Route *r)
     INFO("__: routeOpen(%p)", r);
     const int index = r->poa - PORTOFFSET;
     assert(index >= 0 && index < routeLimit);
+    const Endpoint *const dst = &route[index].dst;
+    const int same = route[index].open && dst->port == r->dst.port &&
+        0 == memcmp(dst->ip, r->dst.ip, sizeof dst->ip) &&
+        0 == memcmp(dst->mac, r->dst.mac, sizeof dst->mac) &&
+        route[index].priority == r->priority &&
+        route[index].egress == r->egress &&
+        route[index].rate == r->rate && route[index].burst == r->burst &&
+        route[index].byteCycles == r->byteCycles &&
+        route[index].shape == r->shape &&
+        route[index].shapeBurst == r->shapeBurst &&
+        route[index].shapeByteCycles == r->shapeByteCycles;
+    if (same) return;
+    ++generation;
+    beginWrite(index);
+    if (route[index].open) unindexRoute(index);
     route[index].dst = r->dst;
+    route[index].priority = r->priority;
+    route[index].egress = r->egress;
+    route[index].rate = r->rate;
+    route[index].burst = r->burst;
+    route[index].byteCycles = r->byteCycles;
+    route[index].burstCycles = r->burstCycles;
+    route[index].shape = r->shape;
+    route[index].shapeBurst = r->shapeBurst;
+    route[index].shapeByteCycles = r->shapeByteCycles;
+    route[index].shapeBurstCycles = r->shapeBurstCycles;
     route[index].open = 1;
+    indexRoute(index);
+    endWrite(index);
+}
+
+
+// Set *byteCycles to the cycles each byte takes at rate bits per second,
+// scaled by 2^ROUTEPOLICESHIFT, and *burstCycles to the cycles burst
+// bytes take, on a clock of cyclesPerUs.  Set them to 0 if rate is 0.
+//
+static void setCycles(int rate, int burst, unsigned long long cyclesPerUs,
+                      unsigned long long *byteCycles,
+                      unsigned long long *burstCycles)
+{
+    static const unsigned long long bits = 8ULL * 1000000 << ROUTEPOLICESHIFT;
+    *byteCycles = rate > 0 ? bits * cyclesPerUs / rate : 0;
+    *burstCycles = *byteCycles * burst >> ROUTEPOLICESHIFT;
+}
+
+
+void routeSetCycles(Route *r, unsigned long long cyclesPerUs)
+{
+    INFO("__: routeSetCycles(%p, %llu)", r, cyclesPerUs);
+    setCycles(r->rate, r->burst, cyclesPerUs,
+              &r->byteCycles, &r->burstCycles);
+    setCycles(r->shape, r->shapeBurst, cyclesPerUs,
+              &r->shapeByteCycles, &r->shapeBurstCycles);
 }
 
 
@@ -48,12 +218,21 @@ void routeClose(const Route *r)
         assert(ok);
     }
     if (r->poa == route[index].poa) {
-        const unsigned char *const i = route[index].dst.ip;
-        const unsigned char *const m = route[index].dst.mac;
         INFO("__: Close route %d to " IPFMT ":%d (" MACFMT ")",
-             route[index].poa, i[0], i[1], i[2], i[3], route[index].dst.port,
-             m[0], m[1], m[2], m[3], m[4], m[5]);
-        route[index].open = 0;
+             route[index].poa,
+             route[index].dst.ip[0], route[index].dst.ip[1],
+             route[index].dst.ip[2], route[index].dst.ip[3],
+             route[index].dst.port,
+             route[index].dst.mac[0], route[index].dst.mac[1],
+             route[index].dst.mac[2], route[index].dst.mac[3],
+             route[index].dst.mac[4], route[index].dst.mac[5]);
+        if (route[index].open) {
+            ++generation;
+            beginWrite(index);
+            unindexRoute(index);
+            route[index].open = 0;
+            endWrite(index);
+        }
     }
 }
 
@@ -64,7 +243,15 @@ const Route routeFromPortOfArrival(int poa)
     const int index = poa - PORTOFFSET;
     const int ok = index >= 0 && index < routeLimit;
     if (ok) {
-        if (poa == route[index].poa) return route[index];
+        Route result;
+        unsigned int v = 0;
+        do {
+            v = version[index];
+            __sync_synchronize();
+            result = route[index];
+            __sync_synchronize();
+        } while ((v & 1) || v != version[index]);
+        if (poa == result.poa) return result;
     } else {
         error("__: routeFromPortOfArrival(%d) index is %d", poa, index);
     }
@@ -73,27 +260,138 @@ const Route routeFromPortOfArrival(int poa)
 }
 
 
-// A route string with only the from port set closes the route.
+unsigned int routeGeneration(void)
+{
+    return generation;
+}
+
+
+void routeNoteBucket(int poa, int bucket)
+{
+    // INFO("__: routeNoteBucket(%d, %d)", poa, bucket); // too much spew
+    const int index = poa - PORTOFFSET;
+    if (index >= 0 && index < routeLimit) route[index].bucket = bucket;
+}
+
+
+int routePin(int poa, const unsigned char *ip, int pinned)
+{
+    INFO("__: routePin(%d, %p, %d)", poa, ip, pinned);
+    int result = 0;
+    if (poa) {
+        const int index = poa - PORTOFFSET;
+        if (index >= 0 && index < routeLimit) {
+            route[index].pinned = pinned;
+            result = 1;
+        } else {
+            error("__: routePin(%d, %p, %d) index is %d",
+                  poa, ip, pinned, index);
+        }
+    } else {
+        static int found[R30TOTALCHANNELS];
+        Endpoint dst = {};
+        memcpy(dst.ip, ip, sizeof dst.ip);
+        result = findRoutes(ROUTEKEYIP, &dst, found, routeLimit);
+        for (int n = 0; n < result; ++n) route[found[n]].pinned = pinned;
+    }
+    return result;
+}
+
+
+int routeCloseMatching(RouteKey key, const Endpoint *dst)
+{
+    INFO("__: routeCloseMatching(%d, %p)", key, dst);
+    static int found[R30TOTALCHANNELS];
+    const int result = findRoutes(key, dst, found, routeLimit);
+    for (int n = 0; n < result; ++n) routeClose(&route[found[n]]);
+    return result;
+}
+
+
+int routeRedirect(RouteKey key, const Endpoint *dst, const Endpoint *to)
+{
+    INFO("__: routeRedirect(%d, %p, %p)", key, dst, to);
+    static int found[R30TOTALCHANNELS];
+    const int result = findRoutes(key, dst, found, routeLimit);
+    for (int n = 0; n < result; ++n) {
+        Route rt = route[found[n]];
+        memcpy(rt.dst.ip, to->ip, sizeof rt.dst.ip);
+        memcpy(rt.dst.mac, to->mac, sizeof rt.dst.mac);
+        if (to->port > 0) rt.dst.port = to->port;
+        routeOpen(&rt);
+    }
+    return result;
+}
+
+
+// A route object with only the from port set, or a port that is not
+// positive, closes the route.  Return a route with .poa -1 on error.
 //
-const Route routeFromString(const char *s)
+const Route routeFromJson(const JsonMember *m, int count)
 {
     static const Endpoint dst = { .port = -1 };
-    Route result = { .index = -1, .poa = -1, .dst = dst };
-    int ip[4];
-    unsigned int mac[6];
-    const int count =
-        sscanf(s, JSONROUTEFMT, &result.poa, &result.dst.port,
-               ip  + 0, ip  + 1, ip  + 2, ip  + 3,
-               mac + 0, mac + 1, mac + 2, mac + 3, mac + 4, mac + 5);
-    if (count == 12) {
-        for (int n = 0; n < 4; ++n) result.dst.ip[n]  = (unsigned char)ip[n];
-        for (int n = 0; n < 6; ++n) result.dst.mac[n] = (unsigned char)mac[n];
-    } else if (count == 1) {
-        assert(result.poa >= PORTOFFSET && result.poa < routeLimit);
-        result.dst.port = -1;
+    Route result = {
+        .index = -1, .poa = -1, .dst = dst,
+        .priority = ROUTEPRIORITYDEFAULT, .bucket = -1,
+        .burst = ROUTEBURSTDEFAULT
+    };
+    int poa = -1;
+    const JsonToken *const port = jsonFind(m, count, "port");
+    const JsonToken *const priority = jsonFind(m, count, "priority");
+    const JsonToken *const egress = jsonFind(m, count, "egress");
+    const JsonToken *const rate = jsonFind(m, count, "rate");
+    const JsonToken *const burst = jsonFind(m, count, "burst");
+    const JsonToken *const shape = jsonFind(m, count, "shape");
+    const JsonToken *const shapeBurst = jsonFind(m, count, "shapeBurst");
+    int ok = jsonInt(jsonFind(m, count, "from"), &poa) &&
+        poa >= PORTOFFSET && poa < PORTOFFSET + routeLimit &&
+        (!port || jsonInt(port, &result.dst.port)) &&
+        (!priority || jsonInt(priority, &result.priority)) &&
+        (!egress || jsonInt(egress, &result.egress)) &&
+        (!rate || jsonInt(rate, &result.rate)) &&
+        (!burst || jsonInt(burst, &result.burst)) &&
+        (!shape || jsonInt(shape, &result.shape)) &&
+        (!shapeBurst || jsonInt(shapeBurst, &result.shapeBurst)) &&
+        result.priority >= 0 && result.priority < ROUTEPRIORITYCOUNT &&
+        result.egress >= 0 && result.burst >= 0 && result.shapeBurst >= 0 &&
+        (result.rate == 0 ||
+         (result.rate >= ROUTERATEMIN &&
+          result.burst >= ROUTEBURSTMIN)) &&
+        (result.shape == 0 || result.shape >= ROUTERATEMIN);
+    if (ok && result.dst.port > 0) {
+        ok = jsonIp(jsonFind(m, count, "ip"), result.dst.ip) &&
+            jsonMac(jsonFind(m, count, "mac"), result.dst.mac);
     } else {
-        error("__: Cannot parse: %s with " JSONROUTEFMT, s);
+        result.dst.port = -1;
     }
+    if (ok) result.poa = poa;
+    return result;
+}
+
+
+int routeKeyFromJson(const JsonMember *m, int count, Endpoint *dst)
+{
+    const JsonToken *const port = jsonFind(m, count, "port");
+    if (jsonIp(jsonFind(m, count, "ip"), dst->ip)) {
+        if (!port) return ROUTEKEYIP;
+        if (jsonInt(port, &dst->port) && dst->port > 0) return ROUTEKEYIPPORT;
+        return -1;
+    }
+    if (jsonMac(jsonFind(m, count, "mac"), dst->mac)) return ROUTEKEYMAC;
+    return -1;
+}
+
+
+// A route string with only the from port set closes the route.
+//
+const Route routeFromString(const char *s)
+{
+    Json j;
+    JsonMember m[JSONMEMBERS];
+    jsonInitialize(&j, s, strlen(s));
+    const int count = jsonObject(&j, m, JSONMEMBERS);
+    const Route result = routeFromJson(m, count < 0 ? 0 : count);
+    if (result.poa < 0) error("__: Cannot parse route: %s", s);
     return result;
 }
 
@@ -107,7 +405,9 @@ int routeToString(const Route *r, char *buffer, size_t size)
     const unsigned char *const m = r->dst.mac;
     const int count =
         snprintf(buffer, size, JSONROUTEFMT, r->poa, r->dst.port,
-                 i[0], i[1], i[2], i[3], m[0], m[1], m[2], m[3], m[4], m[5]);
+                 i[0], i[1], i[2], i[3], m[0], m[1], m[2], m[3], m[4], m[5],
+                 r->priority, r->egress, r->rate, r->burst,
+                 r->shape, r->shapeBurst);
     buffer[size - 1] = ""[0];
     const int ok = count > 0 && count < size;
     if (ok) return count + 1;
@@ -124,16 +424,6 @@ void routeSendControl(int fd, const Route *r)
     const int size = routeToString(r, buffer, sizeof buffer);
     if (size > 0) {
         INFO("__: routeSendControl(%d, %p) sending:\n%s", fd, r, buffer);
-        const int sSize = write(fd, &size, sizeof size);
-        if (sSize == sizeof size) {
-            const int rtSize = write(fd, buffer, size);
-            if (size != rtSize) {
-                error("__: write(%d, %p, %d) returned %d with errno %d: %s",
-                      fd, buffer, size, rtSize, errno, strerror(errno));
-            }
-        } else {
-            error("__: write(%d, %p, %d) returned %d with errno %d: %s",
-                  fd, &size, sizeof size, sSize, errno, strerror(errno));
-        }
+        sendControl(fd, buffer, size);
     }
 }
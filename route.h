@@ -5,6 +5,11 @@
 // Manage routes in a switch or tester process.
 
 
+// Defined in json.h.
+//
+struct JsonMember;
+
+
 // A network endpoint.
 //
 // .port is the UDP port number.
@@ -18,6 +23,28 @@ typedef struct Endpoint {
 } Endpoint;
 
 
+// Routes have priority classes in [0, ROUTEPRIORITYCOUNT) where 0 is the
+// highest priority.  A route command without a priority gets
+// ROUTEPRIORITYDEFAULT.  When egress is congested, forwarders shed
+// packets on the lowest priority routes first.
+//
+#define ROUTEPRIORITYCOUNT (4)
+#define ROUTEPRIORITYDEFAULT (1)
+
+
+// A policed or shaped route commits to at least ROUTERATEMIN bits per
+// second.  A route command without a "burst" gets ROUTEBURSTDEFAULT bytes,
+// and one without a "shapeBurst" gets none.  A policed route's burst must
+// hold at least a ROUTEBURSTMIN-byte frame, or it drops every packet.
+// The switch scales the cycles it charges a policed or shaped route per
+// byte by 2^ROUTEPOLICESHIFT.
+//
+#define ROUTERATEMIN (1000)
+#define ROUTEBURSTDEFAULT (65536)
+#define ROUTEBURSTMIN (1514)
+#define ROUTEPOLICESHIFT (8)
+
+
 // A route forwarded by the switch that maps an input port .poa to an
 // output port .dst.port with the corresponding ip and mac addresses.
 //
@@ -25,14 +52,56 @@ typedef struct Endpoint {
 // .poa is the UDP port of arrival (route[n].poa == n + PORTOFFSET).
 // .dst is the destination endpoint for the packets.
 // .open is true if the route is active and false if closed.
+// .priority is the route's priority class.
+// .pinned is true if the route's bucket goes to the reserved forwarders.
+// .bucket is the bucket of the route's last packet or -1, which numbers
+//         the buckets of all interfaces as Process.bucket does.
+// .egress is the index of the interface the route sends packets out.
+// .rate is the committed bits per second of the route, or 0 if the
+//       switch does not police it.
+// .burst is the bytes the route may send at once above .rate.
+// .byteCycles is the cycles each byte takes at .rate, scaled by
+//             2^ROUTEPOLICESHIFT, as routeSetCycles() sets it.
+// .burstCycles is the cycles .burst takes at .rate.
+// .shape is the bits per second the switch paces the route's packets out
+//        at, or 0 if it sends them as they come.
+// .shapeBurst is the bytes the route may send at once above .shape.
+// .shapeByteCycles and .shapeBurstCycles are .byteCycles and
+//                  .burstCycles for .shape and .shapeBurst.
 //
 typedef struct Route {
     int index;
     int poa;
     Endpoint dst;
     int open;
+    int priority;
+    int pinned;
+    int bucket;
+    int egress;
+    int rate;
+    int burst;
+    unsigned long long byteCycles;
+    unsigned long long burstCycles;
+    int shape;
+    int shapeBurst;
+    unsigned long long shapeByteCycles;
+    unsigned long long shapeBurstCycles;
 } Route;
 
+
+// The keys of the switch's indexes of open routes by destination.
+//
+// ROUTEKEYIP finds the routes to an IP address.
+// ROUTEKEYIPPORT finds the routes to an IP address and port.
+// ROUTEKEYMAC finds the routes to a MAC address.
+//
+typedef enum RouteKey {
+    ROUTEKEYIP,
+    ROUTEKEYIPPORT,
+    ROUTEKEYMAC,
+    ROUTEKEYCOUNT
+} RouteKey;
+
 // Initialize the routing table.
 //
 extern void routeInitialize(void);
@@ -42,6 +111,11 @@ extern void routeInitialize(void);
 //
 extern void routeOpen(const Route *r);
 
+// Set the cycles r's policer and shaper charge for its rates and bursts
+// on a clock of cyclesPerUs.
+//
+extern void routeSetCycles(Route *r, unsigned long long cyclesPerUs);
+
 // Close out route r to start discarding packets arriving on r->poa.
 //
 extern void routeClose(const Route *r);
@@ -50,6 +124,47 @@ extern void routeClose(const Route *r);
 //
 extern const Route routeFromPortOfArrival(int poa);
 
+// Return the generation of the routing table, which counts the opens
+// and closes that changed it.
+//
+extern unsigned int routeGeneration(void);
+
+// Note that a packet for the route on poa arrived in NETIO bucket.
+// Forwarders call this, so the control thread may read a stale bucket.
+//
+extern void routeNoteBucket(int poa, int bucket);
+
+// Pin the route on poa to the reserved forwarders if pinned is true, and
+// unpin it otherwise.  If poa is 0 then (un)pin every route to ip instead.
+// Return the number of routes pinned or unpinned.
+//
+extern int routePin(int poa, const unsigned char *ip, int pinned);
+
+// Close every open route whose destination matches dst on key.  Return
+// the number of routes closed.
+//
+extern int routeCloseMatching(RouteKey key, const Endpoint *dst);
+
+// Redirect every open route whose destination matches dst on key to the
+// ip and mac of to, and to its port if that is positive.  Return the
+// number of routes redirected.  Forwarders see each route change at
+// once, but may see some routes redirected before others.
+//
+extern int routeRedirect(RouteKey key, const Endpoint *dst,
+                         const Endpoint *to);
+
+// Write into dst the destination selected by the count members at m of a
+// JSON object: an "ip" with or without a "port", or a "mac".  Return the
+// RouteKey to match dst on, or -1 if m selects no destination.
+//
+extern int routeKeyFromJson(const struct JsonMember *m, int count,
+                            Endpoint *dst);
+
+// Return a route described by the count members at m of a JSON object.
+// The route's .poa is -1 if m does not describe a route.
+//
+extern const Route routeFromJson(const struct JsonMember *m, int count);
+
 // Return a route described by the JSON string s.
 //
 extern const Route routeFromString(const char *s);
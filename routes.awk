@@ -0,0 +1,38 @@
+# Write count JSON route commands to stdout in an array, formatted three
+# different ways in turn, to time how fast the driver parses them.  The
+# first churn percent of the routes go to a different port, to time how
+# fast the driver syncs a switch that has the other routes.  Setting ip
+# sends every route to that one host instead.
+#
+#   awk -v count=100000 -f routes.awk | ./driver -parse
+#   awk -v count=3840 -v churn=1 -f routes.awk | ./driver -sync <ip>
+#   awk -v count=3840 -v ip=10.1.0.1 -f routes.awk | ./driver -sync <ip>
+#
+function mac(n) {
+    return sprintf("00:1b:21:3a:%02x:%02x", n % 256, n % 199)
+}
+
+BEGIN {
+    print "["
+    for (n = 0; n < count; ++n) {
+        from = 50000 + n % 3840
+        port = 1024 + n % 1000 + (n < count * churn / 100)
+        host = ip ? ip : "10.0." int(n / 256) % 256 "." n % 256
+        hw = ip ? mac(0) : mac(n)
+        if (n % 3 == 0) {
+            printf "{ \"from\" : %d, \"port\" : %d, ", from, port
+            printf "\"ip\" : \"%s\", \"mac\" : \"%s\" },\n", host, hw
+        } else if (n % 3 == 1) {
+            printf "{\"mac\":\"%s\",\"ip\":\"%s\",", hw, host
+            printf "\"port\":%d,\"from\":%d,\"priority\":%d},", \
+                port, from, n % 4
+        } else {
+            printf "\n  {\n    \"from\" : %d,\n    \"port\" : %d,\n", \
+                from, port
+            printf "    \"ip\" : \"%s\",\n    \"mac\" : \"%s\",\n", \
+                host, hw
+            printf "    \"egress\" : 0\n  },\n"
+        }
+    }
+    print "]"
+}
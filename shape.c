@@ -0,0 +1,225 @@
+#include "shape.h"
+#include "util.h"
+
+
+// Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
+//
+// #define INFO(F, ...) info(F, ## __VA_ARGS__)
+#define INFO(F, ...)
+
+
+// Append route n of s to list.
+//
+static void append(Shaper *s, ShapeList *list, int n)
+{
+    s->route[n].next = -1;
+    if (list->tail < 0) {
+        list->head = n;
+    } else {
+        s->route[list->tail].next = n;
+    }
+    list->tail = n;
+}
+
+
+// Put route n of s on the list for the tick its next packet is due.  A
+// route due before the next tick to expire is ready now.  Otherwise it
+// goes into the lowest level of the wheel whose slots reach that far.
+//
+static void schedule(Shaper *s, int n)
+{
+    const ShapeRoute *const r = s->route + n;
+    const unsigned long long tick = s->entry[r->head].due >> SHAPETICKSHIFT;
+    if (tick < s->tick) {
+        append(s, &s->ready, n);
+        return;
+    }
+    const unsigned long long ahead = tick - s->tick;
+    int level = 0;
+    while (level < SHAPELEVELS - 1 &&
+           ahead >= 1ULL << (SHAPESLOTBITS * (level + 1))) {
+        ++level;
+    }
+    const int slot = (tick >> (SHAPESLOTBITS * level)) & SHAPESLOTMASK;
+    append(s, &s->wheel[level][slot], n);
+}
+
+
+// Reschedule the routes in slot of level of s into the lower levels.
+//
+static void cascade(Shaper *s, int level, int slot)
+{
+    ShapeList *const list = &s->wheel[level][slot];
+    int n = list->head;
+    list->head = list->tail = -1;
+    while (n >= 0) {
+        const int next = s->route[n].next;
+        schedule(s, n);
+        n = next;
+    }
+}
+
+
+// Expire the next tick of s: cascade the higher levels when a lower level
+// wraps around, then make the routes in the tick's slot ready.
+//
+static void expire(Shaper *s)
+{
+    const int slot = s->tick & SHAPESLOTMASK;
+    for (int level = 1; level < SHAPELEVELS; ++level) {
+        const int bits = SHAPESLOTBITS * level;
+        if ((s->tick & ((1ULL << bits) - 1)) != 0) break;
+        cascade(s, level, (s->tick >> bits) & SHAPESLOTMASK);
+    }
+    ShapeList *const list = &s->wheel[0][slot];
+    if (list->head >= 0) {
+        if (s->ready.tail < 0) {
+            s->ready.head = list->head;
+        } else {
+            s->route[s->ready.tail].next = list->head;
+        }
+        s->ready.tail = list->tail;
+        list->head = list->tail = -1;
+    }
+    ++s->tick;
+}
+
+
+// Count into jitter how far the cycles between a packet at now and the
+// last one at *last strayed from the *cycles the last one takes at the
+// shape rate.  Then remember that the packet at now takes cycles.
+//
+static void countJitter(StageStat *jitter, unsigned long long now,
+                        unsigned long long *last, unsigned long long *cycles,
+                        unsigned long long packetCycles)
+{
+    if (*last) {
+        const unsigned long long gap = now - *last;
+        stageCount(jitter, gap > *cycles ? gap - *cycles : *cycles - gap);
+    }
+    *last = now;
+    *cycles = packetCycles;
+}
+
+
+// Take the packet at the head of route n of s into e.  Reschedule the
+// route if it holds more packets.
+//
+static void take(Shaper *s, int n, PipeEntry *e)
+{
+    ShapeRoute *const r = s->route + n;
+    ShapeEntry *const entry = s->entry + r->head;
+    *e = entry->e;
+    const int next = entry->next;
+    entry->next = s->free;
+    s->free = r->head;
+    --s->count;
+    r->head = next;
+    if (next < 0) {
+        r->tail = -1;
+    } else {
+        schedule(s, n);
+    }
+}
+
+
+void shapeInitialize(Shaper *s)
+{
+    INFO("__: shapeInitialize(%p)", s);
+    static const ShapeList empty = { .head = -1, .tail = -1 };
+    static const ShapeRoute idle = { .head = -1, .tail = -1, .next = -1 };
+    s->tick = 0;
+    s->count = 0;
+    s->drain = 0;
+    s->ready = empty;
+    for (int level = 0; level < SHAPELEVELS; ++level) {
+        for (int slot = 0; slot < SHAPESLOTS; ++slot) {
+            s->wheel[level][slot] = empty;
+        }
+    }
+    for (int n = 0; n < R30TOTALCHANNELS; ++n) s->route[n] = idle;
+    for (int n = 0; n < SHAPEPACKETS; ++n) s->entry[n].next = n + 1;
+    s->entry[SHAPEPACKETS - 1].next = -1;
+    s->free = 0;
+}
+
+
+int shapeHold(Shaper *s, const PipeEntry *e, unsigned long long now,
+              StageStat *jitter)
+{
+    // INFO("__: shapeHold(%p, %p, %llu, %p)", s, e, now, jitter);
+    const Route *const rt = &e->rt;
+    ShapeRoute *const r = s->route + rt->index;
+    const unsigned long long cycles =
+        rt->shapeByteCycles * e->pi.l2Length >> ROUTEPOLICESHIFT;
+    countJitter(jitter, now, &r->arrived, &r->arrivedCycles, cycles);
+    const unsigned long long burst = rt->shapeBurstCycles;
+    const unsigned long long early = r->due > burst ? r->due - burst : 0;
+    const unsigned long long due = early > now ? early : now;
+    if (r->head < 0 && due == now) {
+        r->due = (r->due > now ? r->due : now) + cycles;
+        return 0;
+    }
+    if (s->count == 0) s->tick = now >> SHAPETICKSHIFT;
+    const unsigned long long tick = due >> SHAPETICKSHIFT;
+    const int far = tick > s->tick &&
+        tick - s->tick >= 1ULL << (SHAPESLOTBITS * SHAPELEVELS);
+    if (s->free < 0 || far) return -1;
+    r->due = (r->due > due ? r->due : due) + cycles;
+    const int n = s->free;
+    ShapeEntry *const entry = s->entry + n;
+    s->free = entry->next;
+    ++s->count;
+    entry->e = *e;
+    entry->due = due;
+    entry->next = -1;
+    if (r->tail < 0) {
+        r->head = r->tail = n;
+        schedule(s, rt->index);
+    } else {
+        s->entry[r->tail].next = n;
+        r->tail = n;
+    }
+    return 1;
+}
+
+
+int shapeRelease(Shaper *s, unsigned long long now, PipeEntry *e)
+{
+    // INFO("__: shapeRelease(%p, %llu, %p)", s, now, e); // too much spew
+    const unsigned long long tick = now >> SHAPETICKSHIFT;
+    while (s->ready.head < 0 && s->count && s->tick <= tick) expire(s);
+    const int n = s->ready.head;
+    if (n < 0) return 0;
+    s->ready.head = s->route[n].next;
+    if (s->ready.head < 0) s->ready.tail = -1;
+    take(s, n, e);
+    return 1;
+}
+
+
+int shapeDrain(Shaper *s, PipeEntry *e)
+{
+    INFO("__: shapeDrain(%p, %p)", s, e);
+    for (; s->drain < R30TOTALCHANNELS; ++s->drain) {
+        ShapeRoute *const r = s->route + s->drain;
+        if (r->head >= 0) {
+            ShapeEntry *const entry = s->entry + r->head;
+            *e = entry->e;
+            r->head = entry->next;
+            return 1;
+        }
+    }
+    shapeInitialize(s);
+    return 0;
+}
+
+
+void shapeDeparted(Shaper *s, const Route *rt, unsigned int length,
+                   unsigned long long now, StageStat *jitter)
+{
+    ShapeRoute *const r = s->route + rt->index;
+    const unsigned long long cycles =
+        rt->shapeByteCycles * length >> ROUTEPOLICESHIFT;
+    countJitter(jitter, now, &r->departed, &r->departedCycles, cycles);
+}
@@ -0,0 +1,142 @@
+#ifndef INCLUDE_SHAPE_H
+#define INCLUDE_SHAPE_H
+
+
+// Shape the packets of routes with a "shape" rate as they leave the
+// switch, so bursts from upstream encoders do not reach receivers.
+//
+// Each tile that sends packets has its own Shaper, so it needs no locks.
+// A tile allocates its Shaper when it first shapes a packet, so a switch
+// that shapes nothing spends no memory on them.
+// A route's packets normally all leave from one tile, but while its bucket
+// moves each tile shapes the packets it gets.
+//
+// A Shaper holds rewritten packets in a pool of entries, queued in order
+// on their route.  Each route with packets waiting is on a hierarchical
+// timer wheel at the tick its next packet is due.  The forwarder polls
+// the wheel between packets and sends what is due.  Nothing is allocated
+// per packet, and a route costs the wheel the same however many packets
+// it holds.
+
+
+#include "pipe.h"
+#include "stage.h"
+#include "util.h"
+
+
+// The packets a tile can hold.  It drops packets past these, and holds
+// NETIO buffers its interfaces could otherwise fill.
+//
+#define SHAPEPACKETS (2048)
+
+// A tick of the wheel is 2^SHAPETICKSHIFT cycles, about a microsecond.
+//
+#define SHAPETICKSHIFT (10)
+
+// The wheel has SHAPELEVELS levels of 2^SHAPESLOTBITS slots.  A slot of
+// level n spans 2^(n * SHAPESLOTBITS) ticks, so the wheel holds packets
+// due up to 2^(SHAPELEVELS * SHAPESLOTBITS) ticks, about 16 s, ahead.
+//
+#define SHAPESLOTBITS (8)
+#define SHAPESLOTS (1 << SHAPESLOTBITS)
+#define SHAPESLOTMASK (SHAPESLOTS - 1)
+#define SHAPELEVELS (3)
+
+
+// A packet held by a Shaper.
+//
+// .e is the packet and its route as a pipeline ring would carry it.
+// .due is the cycle count at which to send it.
+// .next is the next entry on the route or free list, or -1.
+//
+typedef struct ShapeEntry {
+    PipeEntry e;
+    unsigned long long due;
+    int next;
+} ShapeEntry;
+
+
+// What a Shaper knows about one route.
+//
+// .due is the cycle count at which the route has sent all it has at its
+//      shape rate.
+// .head and .tail are the first and last entries the route holds, or -1.
+// .next is the next route in the same wheel slot or ready list, or -1.
+// .arrived and .departed are the cycle counts of the last packet to
+//          arrive on and leave on the route, or 0.
+// .arrivedCycles and .departedCycles are the cycles that packet takes at
+//                the route's shape rate.
+//
+typedef struct ShapeRoute {
+    unsigned long long due;
+    int head;
+    int tail;
+    int next;
+    unsigned long long arrived;
+    unsigned long long arrivedCycles;
+    unsigned long long departed;
+    unsigned long long departedCycles;
+} ShapeRoute;
+
+
+// A list of routes linked through ShapeRoute.next.
+//
+typedef struct ShapeList {
+    int head;
+    int tail;
+} ShapeList;
+
+
+// A tile's shaper.
+//
+// .tick is the next tick of the wheel to expire.
+// .count is the number of packets held.
+// .free is the first free entry or -1.
+// .drain is the next route shapeDrain() takes packets from.
+// .ready lists the routes whose next packet is due.
+// .wheel[n][s] lists the routes due in slot s of level n.
+// .route[n] is the shaping state of route n.
+// .entry is the pool of entries.
+//
+typedef struct Shaper {
+    unsigned long long tick;
+    int count;
+    int free;
+    int drain;
+    ShapeList ready;
+    ShapeList wheel[SHAPELEVELS][SHAPESLOTS];
+    ShapeRoute route[R30TOTALCHANNELS];
+    ShapeEntry entry[SHAPEPACKETS];
+} Shaper;
+
+
+// Empty s and forget the state of its routes.
+//
+extern void shapeInitialize(Shaper *s);
+
+// Decide when to send the packet at e that is ready to leave on its
+// shaped route at cycle now, and count the jitter of its arrival.  Return
+// 0 to send it now, 1 if s holds it until it is due, or -1 to drop it
+// because s is full or it is due too far ahead.
+//
+extern int shapeHold(Shaper *s, const PipeEntry *e, unsigned long long now,
+                     StageStat *jitter);
+
+// Take into e the next packet s holds that is due by cycle now.  Return
+// 1 or 0 if none is due.
+//
+extern int shapeRelease(Shaper *s, unsigned long long now, PipeEntry *e);
+
+// Take into e the next packet s holds whether it is due or not.  Return
+// 1 or 0 and empty s if it holds none.
+//
+extern int shapeDrain(Shaper *s, PipeEntry *e);
+
+// Note that a packet of length bytes left on the shaped route rt at cycle
+// now, and count the jitter of its departure.
+//
+extern void shapeDeparted(Shaper *s, const Route *rt, unsigned int length,
+                          unsigned long long now, StageStat *jitter);
+
+
+#endif // INCLUDE_SHAPE_H
@@ -0,0 +1,172 @@
+#include "process.h"
+#include "stage.h"
+#include "util.h"
+
+
+// Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
+//
+// #define INFO(F, ...) info(F, ## __VA_ARGS__)
+#define INFO(F, ...)
+
+
+// The names of the stages indexed by StageId.
+//
+static const char *const stageName[STAGECOUNT] = {
+    [STAGEPOLL]   = "poll",
+    [STAGEPARSE]  = "parse",
+    [STAGEROUTE]  = "route",
+    [STAGEPOLICE] = "police",
+    [STAGEUPDATE] = "update",
+    [STAGEFLUSH]  = "flush",
+    [STAGESEND]   = "send",
+    [STAGESHAPE]  = "shape",
+    [STAGERING]   = "ring"
+};
+
+
+void stageMerge(StageStat *to, const StageStat *from)
+{
+    if (from->count == 0) return;
+    if (to->count == 0 || from->min < to->min) to->min = from->min;
+    if (from->max > to->max) to->max = from->max;
+    to->count += from->count;
+    to->cycles += from->cycles;
+    for (int n = 0; n < STAGEHISTOGRAMCOUNT; ++n) {
+        to->histogram[n] += from->histogram[n];
+    }
+}
+
+
+unsigned long long stagePercentile(const StageStat *s, int percent)
+{
+    const unsigned long long want = (s->count * percent + 99) / 100;
+    unsigned long long sofar = 0;
+    for (int n = 0; n < STAGEHISTOGRAMCOUNT; ++n) {
+        sofar += s->histogram[n];
+        if (sofar < want) continue;
+        const unsigned long long edge = 1ULL << (n + 1);
+        return n < STAGEHISTOGRAMCOUNT - 1 && edge < s->max ? edge : s->max;
+    }
+    return s->max;
+}
+
+
+// Return the percentage part is of whole or 0 if whole is 0.
+//
+static unsigned long long percentOf(unsigned long long part,
+                                    unsigned long long whole)
+{
+    return whole ? (100 * part) / whole : 0;
+}
+
+
+void stageShow(const struct Process *p)
+{
+    INFO("__: stageShow(%p)", p);
+    Stages all = {};
+    StageStat roundTrip = {};
+    for (int m = p->netioThreadIndex; m < p->threadCount; ++m) {
+        const Thread *const t = p->thread[m];
+        const Stages *const s = &t->stages;
+        stageMerge(&roundTrip, &t->roundTrip);
+        for (int n = 0; n < STAGECOUNT; ++n) {
+            stageMerge(all.stage + n, s->stage + n);
+        }
+        all.idlePolls  += s->idlePolls;
+        all.idleCycles += s->idleCycles;
+        all.busyPolls  += s->busyPolls;
+        all.busyCycles += s->busyCycles;
+        stageMerge(&all.packet, &s->packet);
+        stageMerge(&all.oversleep, &s->oversleep);
+        stageMerge(&all.transit, &s->transit);
+        stageMerge(&all.arrivalJitter, &s->arrivalJitter);
+        stageMerge(&all.departureJitter, &s->departureJitter);
+        all.sleeps      += s->sleeps;
+        all.sleepCycles += s->sleepCycles;
+        all.cpuNs       += s->cpuNs;
+        all.wallNs      += s->wallNs;
+        if (s->busyPolls) {
+            const unsigned long long polling = s->busyCycles + s->idleCycles;
+            show("Thread %2d on CPU %2d: %llu packets at %llu cycles each, "
+                 "busy %llu%% of %llu cycles polling",
+                 t->index, t->cpu, s->busyPolls,
+                 s->busyCycles / s->busyPolls,
+                 percentOf(s->busyCycles, polling), polling);
+        }
+        if (s->wallNs) {
+            show("Thread %2d on CPU %2d: slept %llu times, "
+                 "used %llu%% CPU over %llu ms",
+                 t->index, t->cpu, s->sleeps,
+                 percentOf(s->cpuNs, s->wallNs), s->wallNs / 1000000);
+        }
+    }
+    for (int n = 0; n < STAGECOUNT; ++n) {
+        const StageStat *const s = all.stage + n;
+        if (s->count) {
+            show("Stage %-6s: %10llu samples: min %llu mean %llu "
+                 "p50 < %llu p99 < %llu max %llu cycles",
+                 stageName[n], s->count, s->min, s->cycles / s->count,
+                 stagePercentile(s, 50), stagePercentile(s, 99), s->max);
+        }
+    }
+    const unsigned long long polls = all.idlePolls + all.busyPolls;
+    if (polls) {
+        const unsigned long long polling = all.busyCycles + all.idleCycles;
+        show("Forwarders polled %llu times: %llu busy and %llu idle "
+             "(busy %llu%% of %llu cycles polling)",
+             polls, all.busyPolls, all.idlePolls,
+             percentOf(all.busyCycles, polling), polling);
+    }
+    if (all.wallNs) {
+        show("Forwarders slept %llu times for %llu cycles "
+             "and used %llu%% CPU", all.sleeps, all.sleepCycles,
+             percentOf(all.cpuNs, all.wallNs));
+    }
+    stageShowStat("Packet latency", &all.packet);
+    stageShowStat("Oversleep", &all.oversleep);
+    stageShowStat("Transit latency", &all.transit);
+    stageShowStat("Arrival jitter", &all.arrivalJitter);
+    stageShowStat("Departure jitter", &all.departureJitter);
+    stageShowStat("Round trip", &roundTrip);
+}
+
+
+void stageShowStat(const char *name, const StageStat *s)
+{
+    if (s->count) {
+        show("%s: %10llu samples: min %llu mean %llu "
+             "p50 < %llu p99 < %llu max %llu cycles",
+             name, s->count, s->min, s->cycles / s->count,
+             stagePercentile(s, 50), stagePercentile(s, 99), s->max);
+    }
+}
+
+
+void stageShowGroup(const struct Process *p, const char *name,
+                    const char *member)
+{
+    INFO("__: stageShowGroup(%p, %s, %p)", p, name, member);
+    StageStat packet = {};
+    unsigned long long busyCycles = 0, idleCycles = 0;
+    int count = 0;
+    for (int m = p->netioThreadIndex; m < p->threadCount; ++m) {
+        if (member[m]) {
+            const Stages *const s = &p->thread[m]->stages;
+            stageMerge(&packet, &s->packet);
+            busyCycles += s->busyCycles;
+            idleCycles += s->idleCycles;
+            ++count;
+        }
+    }
+    if (count == 0) return;
+    show("Group %-8s: %2d forwarders busy %llu%% of %llu cycles polling",
+         name, count, percentOf(busyCycles, busyCycles + idleCycles),
+         busyCycles + idleCycles);
+    if (packet.count) {
+        show("Group %-8s: %10llu packets: min %llu mean %llu "
+             "p50 < %llu p99 < %llu max %llu cycles",
+             name, packet.count, packet.min, packet.cycles / packet.count,
+             stagePercentile(&packet, 50), stagePercentile(&packet, 99),
+             packet.max);
+    }
+}
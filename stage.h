@@ -0,0 +1,161 @@
+#ifndef INCLUDE_STAGE_H
+#define INCLUDE_STAGE_H
+
+
+// Account for the cycles each forwarding thread spends in each stage of
+// its packet pipeline.
+//
+// Each thread counts into its own Stages with plain stores, so the
+// accounting is always on.  Readers of another thread's Stages may see
+// slightly stale counts.
+
+
+// The stages of forwarding a packet.
+//
+// STAGEPOLL is netio_get_packet() returning a packet.
+// STAGEPARSE is parsePacket().
+// STAGEROUTE is the route lookup.
+// STAGEPOLICE is checking a policed route's rate and burst.
+// STAGEUPDATE is rewriting the headers in updateUdpPacket().
+// STAGEFLUSH is flushing the headers from cache and the memory fence.
+// STAGESEND is netio_send_packet() including NETIO_QUEUE_FULL retries.
+// STAGESHAPE is deciding when to send a shaped route's packet.
+// STAGERING is the wait in a pipeline ring from the receive thread's poll
+//           to the transmit thread taking the packet.
+//
+typedef enum StageId {
+    STAGEPOLL,
+    STAGEPARSE,
+    STAGEROUTE,
+    STAGEPOLICE,
+    STAGEUPDATE,
+    STAGEFLUSH,
+    STAGESEND,
+    STAGESHAPE,
+    STAGERING,
+    STAGECOUNT
+} StageId;
+
+
+// The number of log2 buckets in a StageStat histogram.  Bucket n counts
+// samples of [1 << n, 1 << (n + 1)) cycles, and the last bucket also
+// counts anything longer.
+//
+#define STAGEHISTOGRAMCOUNT (24)
+
+
+// Cycle statistics for one stage.
+//
+// .count is the number of samples.
+// .cycles is the sum of the samples.
+// .min and .max are the extreme samples, valid only when .count > 0.
+// .histogram counts samples in log2 buckets.
+//
+typedef struct StageStat {
+    unsigned long long count;
+    unsigned long long cycles;
+    unsigned long long min;
+    unsigned long long max;
+    unsigned long long histogram[STAGEHISTOGRAMCOUNT];
+} StageStat;
+
+
+// Cycle statistics for all the stages in one thread.
+//
+// .stage has statistics for each StageId.
+// .idlePolls counts netio_get_packet() calls that returned NETIO_NOPKT.
+// .idleCycles is the sum of cycles spent in those idle polls.
+// .busyPolls counts polls that returned a packet.
+// .busyCycles is the sum of cycles from those polls until the packet
+//             was sent, dropped, or written to the TAP device.
+// .packet has the cycles of each busy poll, which is the latency the
+//         thread adds to each packet.
+// .sleeps counts the times the thread slept on an idle queue.
+// .sleepCycles is the sum of cycles spent in those sleeps.
+// .oversleep has the cycles each sleep ran past the time it asked for.
+//            A packet that arrives during a sleep waits up to the sleep
+//            plus its oversleep before the thread polls again.
+// .transit has the cycles from the poll that found each packet to its
+//          send, counted by the thread that sent it.  In pipeline mode
+//          that spans two tiles, so it assumes their cycle counters run
+//          in step.
+// .arrivalJitter has how far the cycles between packets arriving on a
+//                shaped route strayed from the cycles the first packet
+//                takes at the route's shape rate.
+// .departureJitter has the same for the packets leaving the switch, so
+//                  it shows what shaping removed.
+// .cpuNs is the CPU time the thread has used in nanoseconds.
+// .wallNs is the wall time in nanoseconds the thread has run when .cpuNs
+//         was last updated.
+//
+typedef struct Stages {
+    StageStat stage[STAGECOUNT];
+    unsigned long long idlePolls;
+    unsigned long long idleCycles;
+    unsigned long long busyPolls;
+    unsigned long long busyCycles;
+    StageStat packet;
+    unsigned long long sleeps;
+    unsigned long long sleepCycles;
+    StageStat oversleep;
+    StageStat transit;
+    StageStat arrivalJitter;
+    StageStat departureJitter;
+    unsigned long long cpuNs;
+    unsigned long long wallNs;
+} Stages;
+
+
+// Return the StageStat histogram bucket for a sample of cycles.
+//
+static inline int stageBucket(unsigned long long cycles)
+{
+    const int log2 = cycles ? 63 - __builtin_clzll(cycles) : 0;
+    return log2 < STAGEHISTOGRAMCOUNT ? log2 : STAGEHISTOGRAMCOUNT - 1;
+}
+
+// Add a sample of cycles to s.
+//
+static inline void stageCount(StageStat *s, unsigned long long cycles)
+{
+    if (s->count == 0 || cycles < s->min) s->min = cycles;
+    if (cycles > s->max) s->max = cycles;
+    ++s->count;
+    s->cycles += cycles;
+    ++s->histogram[stageBucket(cycles)];
+}
+
+
+// Add the samples in from into to.
+//
+extern void stageMerge(StageStat *to, const StageStat *from);
+
+// Return an upper bound on the percent percentile of the samples in s:
+// the upper edge of its histogram bucket, or the largest sample if that
+// is smaller or the bucket is the last, which has no upper edge.
+//
+extern unsigned long long stagePercentile(const StageStat *s, int percent);
+
+
+// Defined in process.h.
+//
+struct Process;
+
+// Show the stage accounting for the forwarding threads in p, and the
+// round trips of the tester's packets, on the INFO log.  This is safe to
+// call while the threads are running.
+//
+extern void stageShow(const struct Process *p);
+
+// Show the samples in s called name on the INFO log if there are any.
+//
+extern void stageShowStat(const char *name, const StageStat *s);
+
+// Show the utilization and packet latency of the group of forwarding
+// threads m in p where member[m] is true, and call the group name.
+//
+extern void stageShowGroup(const struct Process *p, const char *name,
+                           const char *member);
+
+
+#endif // INCLUDE_STAGE_H
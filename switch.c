@@ -2,12 +2,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bucket.h"
 #include "control.h"
 #include "forward.h"
 #include "process.h"
 #include "route.h"
+#include "shape.h"
 #include "tap.h"
 #include "tilera.h"
+#include "trace.h"
 #include "util.h"
 
 
@@ -16,7 +19,7 @@ static const char usage[] =
     "%s: Forward UDP packets from input ports to remote addresses         \n"
     "    according to route commands sent to the control port %d.         \n"
     "                                                                     \n"
-    "Usage: %s <fip> <fif>                                                \n"
+    "Usage: %s <fip> <fif> [<topology>]                                   \n"
     "                                                                     \n"
     "Where: <fip> is the IP address on which the switch forwards UDP      \n"
     "             packets.  (Send video to <fip> in other words.)         \n"
@@ -24,6 +27,22 @@ static const char usage[] =
     "       <fif> is the name of the network interface to use for UDP     \n"
     "             forwarding.  Usually '%s' or '%s'.  Use '%s' in         \n"
     "             production, but '%s' can avoid optical cabling.         \n"
+    "             Forward on up to %d interfaces with a list such as      \n"
+    "             'xgbe/0,xgbe/1'.  The forwarders are dealt out to the   \n"
+    "             interfaces in turn, and each balances its own buckets.  \n"
+    "                                                                     \n"
+    "       <topology> lays out the threads on CPU tiles.  It is a string \n"
+    "             or the name of a file with keys like this.              \n"
+    "             %s\n"
+    "             The default runs control on the first online CPU, TAP   \n"
+    "             on the next, and forwarders on all the rest.            \n"
+    "             tap=control serves TAP from the control CPU and frees   \n"
+    "             its CPU to forward.  controlforward=1 also forwards on  \n"
+    "             the control CPU, handling commands between packets.     \n"
+    "             pipeline=<n> runs <n> transmit threads on the last      \n"
+    "             forward CPUs.  The forwarders then only classify each   \n"
+    "             packet and pass it over a ring to a transmit thread,    \n"
+    "             which rewrites and sends it.                            \n"
     "                                                                     \n"
     "Each route command is a JSON string preceeded by its length encoded  \n"
     "as 4 bytes of binary.  The route command maps an input 'from' port   \n"
@@ -33,11 +52,64 @@ static const char usage[] =
     "To open a route choose a port number 'from' in [%d,%d) and set the   \n"
     "appropriate destination 'port' number and 'ip' and 'mac' addresses.  \n"
     "UDP packets arriving on <fip> and port 'from' are forwarded to the   \n"
-    "'port' and 'ip' and 'mac' addresses specified in the route.          \n"
+    "'port' and 'ip' and 'mac' addresses specified in the route.  They    \n"
+    "leave on the interface numbered 'egress' from 0 in the <fif> list.   \n"
+    "                                                                     \n"
+    "A 'rate' of at least %d bits per second polices the route.  Its     \n"
+    "packets may arrive 'burst' bytes ahead of that rate, %d unless     \n"
+    "given.  A 'burst' must hold a %d-byte frame.  Forwarders drop the  \n"
+    "rest before rewriting them.  The switch counts the packets it        \n"
+    "polices on each route.                                               \n"
+    "                                                                     \n"
+    "A 'shape' of at least %d bits per second paces the route's packets  \n"
+    "out at that rate, letting 'shapeBurst' bytes go at once, 0 unless    \n"
+    "given.  Each forwarder holds up to %d packets until they are due.  \n"
+    "The stats show how far the gaps between a shaped route's packets     \n"
+    "stray from its rate as they arrive and as they leave.                \n"
     "                                                                     \n"
     "To close a route, specify its 'from' port and set -1 as the route's  \n"
     "destination 'port'.                                                  \n"
     "                                                                     \n"
+    "To dump the recent packets seen by each forwarding thread into       \n"
+    "%s send { \"command\" : \"trace\" } or signal SIGUSR1.       \n"
+    "Decode the dump with tracedump.                                      \n"
+    "Send { \"command\" : \"stats\" } to show the cycles spent in each    \n"
+    "stage of forwarding while the switch runs.                           \n"
+    "                                                                     \n"
+    "Idle forwarders spin %d us, then sleep up to %d us between polls.    \n"
+    "Send { \"command\" : \"idle\", \"spin\" : <us>, \"sleep\" : <us> }    \n"
+    "to trade wakeup latency for power.  A sleep of 0 always spins.       \n"
+    "                                                                     \n"
+    "Every %d ms the switch moves hot NETIO buckets from the busiest      \n"
+    "forwarder to the least busy one.                                     \n"
+    "Send { \"command\" : \"buckets\" } to show the load on each forwarder.\n"
+    "                                                                     \n"
+    "Send { \"command\" : \"reserve\", \"tiles\" : <n> } to reserve the     \n"
+    "last <n> forwarders for pinned routes.  Then send                    \n"
+    "{ \"command\" : \"pin\", \"from\" : <port> } to pin a route, or  \n"
+    "{ \"command\" : \"pin\", \"ip\" : \"<ip>\" } to pin all routes to   \n"
+    "a destination.  Send \"unpin\" the same way to release them.         \n"
+    "                                                                     \n"
+    "Send { \"command\" : \"forwarders\", \"count\" : <n> } to run <n>      \n"
+    "forwarders on the forward CPUs of <topology>.  Buckets drain off a   \n"
+    "removed forwarder before it stops, so the switch nacks this when     \n"
+    "controlforward=1 would stall a forwarder on it.                      \n"
+    "                                                                     \n"
+    "Send { \"command\" : \"close\", \"ip\" : \"<ip>\" } to close every   \n"
+    "route to <ip>, or add \"port\" : <port> to close only those to that  \n"
+    "port, or give \"mac\" : \"<mac>\" instead.  Send                      \n"
+    "{ \"command\" : \"redirect\", \"ip\" : \"<ip>\",                      \n"
+    "  \"to\" : { \"ip\" : \"<ip>\", \"mac\" : \"<mac>\" } }              \n"
+    "to send every route to the first <ip> to the second <ip> and <mac>.  \n"
+    "A \"port\" in \"to\" changes the routes' port too.  The switch finds \n"
+    "the routes in an index by destination, so these take one command.   \n"
+    "                                                                     \n"
+    "Send { \"command\" : \"dump\" } to get back the generation of the    \n"
+    "route table and a route command for each open route, with the NETIO  \n"
+    "\"bucket\" its packets hash to, unless controlforward=1.  The switch \n"
+    "keeps running when the control connection closes, so a controller    \n"
+    "can reconnect and sync.  A command of length 0 stops the switch.     \n"
+    "                                                                     \n"
     "Example: %s %s %s\n"
     "\n";
 
@@ -52,10 +124,13 @@ static const char usage[] =
 //
 typedef struct SwitchCommandLine {
     const char *av0;
-    const char *fif;
+    const char *fif[MAXINTERFACES];
+    int fifCount;
     const char *fip;
+    Topology topology;
 } SwitchCommandLine;
 
+
 // Validate the command line (ac, av) and return the results.
 //
 static const SwitchCommandLine validateSwitchUsage(int ac, const char *av[])
@@ -65,44 +140,61 @@ static const SwitchCommandLine validateSwitchUsage(int ac, const char *av[])
     fprintf(stderr, "%s command line:", av0);
     for (int n = 0; n < ac; ++n) fprintf(stderr, " '%s'", av[n]);
     fprintf(stderr, "\n");
-    const int ok = ac == 3 && validIpString(av[1]) &&
-        ((0 == strcmp(av[2], PRODUCTIONINTERFACE)) ||
-         (0 == strcmp(av[2], CONVENIENCEINTERFACE)));
+    SwitchCommandLine result = { .av0 = av0 };
+    const int ok = (ac == 3 || ac == 4) && validIpString(av[1]) &&
+        (result.fifCount =
+         interfacesFromString(result.fif, MAXINTERFACES, av[2])) > 0 &&
+        0 == topologyFromString(&result.topology, ac == 4 ? av[3] : NULL) &&
+        result.topology.forwarders >= result.fifCount;
     if (!ok) {
         fprintf(stderr, usage, av0, CONTROLPORT, av0,
                 PRODUCTIONINTERFACE, CONVENIENCEINTERFACE,
-                PRODUCTIONINTERFACE, CONVENIENCEINTERFACE,
+                PRODUCTIONINTERFACE, CONVENIENCEINTERFACE, MAXINTERFACES,
+                TOPOLOGYFMT,
                 JSONROUTEFMT, PORTOFFSET, CONTROLPORT,
+                ROUTERATEMIN, ROUTEBURSTDEFAULT, ROUTEBURSTMIN,
+                ROUTERATEMIN, SHAPEPACKETS,
+                TRACEFILE,
+                IDLESPINUS, IDLESLEEPUS, BALANCEMS,
                 av0, EXAMPLEFORWARDINGIP, PRODUCTIONINTERFACE);
         exit(1);
     }
-    const SwitchCommandLine result = {
-        .av0 = av0, .fip = av[1], .fif = av[2]
-    };
+    result.fip = av[1];
     return result;
 }
 
 
 int main(int ac, const char *av[])
 {
+    startupBegin();
     INFO("__: main(%d, %p", ac, av);
     const SwitchCommandLine cl = validateSwitchUsage(ac, av);
     errorInitialize(cl.av0);
+    startupPhase("usage");
     routeInitialize();
-    Process *const p = processInitialize(cl.av0, forwardStart, "forwardStart");
-    p->interface = cl.fif;
+    Process *const p =
+        processInitialize(cl.av0, &cl.topology, forwardStart, "forwardStart");
+    forwardInitializePipeline(p);
+    for (int n = 0; n < cl.fifCount; ++n) p->interface[n] = cl.fif[n];
+    p->interfaceCount = cl.fifCount;
     ipFromString(p->forward.ip, cl.fip);
-    Thread *const t = p->thread + 0;
-    registerQueueReadWrite(p->thread + 0);
+    traceInitialize(p);
+    startupPhase("process");
+    Thread *const t = p->thread[0];
+    registerQueueReadWrite(p->thread[0]);
     initializeNetio(p);
+    startupPhase("netio");
     tapConfigure(p);
-    int starts = processStartThreads(p, tapStart, "tapStart");
-    starts += processStartThreads(p, forwardStart, "forwardStart");
+    startupPhase("tap");
+    const int starts = processStartThreads(p, NULL, "all");
+    startupPhase("threads");
     INFO("__: Started %d threads", starts);
-    controlRoutes(p->thread + 0);
-    const int stops = processStopThreads(p, forwardStart, "forwardStart");
+    controlRoutes(p->thread[0]);
+    int stops = processStopThreads(p, forwardStart, "forwardStart");
+    stops += processStopThreads(p, forwardTransmit, "forwardTransmit");
     INFO("__: Stopped %d of %d threads", stops, starts);
     showCounters(p);
+    traceShow(p);
     unregisterQueue(t);
     const int status = 0;
     INFO("__: Exiting with status %d", status);
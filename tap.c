@@ -6,8 +6,10 @@
 #include <netinet/in.h>                 // Must precede the if.h files.
 
 #include <linux/if.h>
+#include <linux/if_arp.h>
 #include <linux/if_tun.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 
 #include <tmc/cpus.h>
 
@@ -31,7 +33,38 @@
 #define PACKETSIZE (8192)
 
 
-// Configure the TAP device for p.
+// Apply the interface ioctl request named name to ifr on the socket fd.
+//
+static void tapIoctl(int fd, unsigned long request, const char *name,
+                     struct ifreq *ifr)
+{
+    INFO("__: tapIoctl(%d, %lu, %s, %p)", fd, request, name, ifr);
+    const int status = ioctl(fd, request, ifr);
+    if (status < 0) {
+        error("__: ioctl(%d, %s, %p) for %s returned %d with errno %d: %s",
+              fd, name, ifr, ifr->ifr_name, status, errno, strerror(errno));
+    }
+}
+
+
+// Set the IPv4 address of the ifr interface named name to ip with the
+// ioctl request on fd.
+//
+static void tapSetAddress(int fd, unsigned long request, const char *name,
+                          struct ifreq *ifr, const unsigned char ip[4])
+{
+    struct sockaddr_in *const sin = (struct sockaddr_in *)&ifr->ifr_addr;
+    memset(sin, 0, sizeof *sin);
+    sin->sin_family = AF_INET;
+    memcpy(&sin->sin_addr, ip, sizeof sin->sin_addr);
+    tapIoctl(fd, request, name, ifr);
+}
+
+
+// Configure the TAP device for p.  Set its MAC and IP addresses to those
+// of p->forward with ioctl() calls on a socket, then bring it up.  This
+// costs a few system calls where running ifconfig cost a fork and exec
+// for each setting.
 //
 void tapConfigure(Process *p)
 {
@@ -46,26 +79,30 @@ void tapConfigure(Process *p)
     if (status < 0) {
         error("__: ioctl(%d, TUNSETIFF, %p) for %s returned %d "
               "with errno %d: %s",
-              p->tap, &ifr, TAPDEVICE, status, strerror(errno));
+              p->tap, &ifr, TAPDEVICE, status, errno, strerror(errno));
     }
     INFO("__: Opened TAP: %s", ifr.ifr_name);
-    static const char ifconfig[] = "/sbin/ifconfig";
-    const unsigned char *const m = p->forward.mac;
-    systemCommand("%s %s hw ether " MACFMT, ifconfig, ifr.ifr_name,
-                  m[0], m[1], m[2], m[3], m[4], m[5]);
-    const unsigned char *const ip = p->forward.ip;
-    systemCommand("%s %s inet " IPFMT,
-                  ifconfig, ifr.ifr_name, ip[0], ip[1], ip[2], ip[3]);
-    systemCommand("%s %s netmask 255.255.0.0",
-                  ifconfig, ifr.ifr_name);
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        error("__: socket(AF_INET, SOCK_DGRAM, 0) returned %d "
+              "with errno %d: %s", fd, errno, strerror(errno));
+        return;
+    }
+    ifr.ifr_hwaddr.sa_family = ARPHRD_ETHER;
+    memcpy(ifr.ifr_hwaddr.sa_data, p->forward.mac, sizeof p->forward.mac);
+    tapIoctl(fd, SIOCSIFHWADDR, "SIOCSIFHWADDR", &ifr);
+    tapSetAddress(fd, SIOCSIFADDR, "SIOCSIFADDR", &ifr, p->forward.ip);
+    static const unsigned char netmask[4] = { 255, 255, 0, 0 };
+    tapSetAddress(fd, SIOCSIFNETMASK, "SIOCSIFNETMASK", &ifr, netmask);
+    tapIoctl(fd, SIOCGIFFLAGS, "SIOCGIFFLAGS", &ifr);
+    ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+    tapIoctl(fd, SIOCSIFFLAGS, "SIOCSIFFLAGS", &ifr);
+    close(fd);
     INFO("__: TAP configured: %s", ifr.ifr_name);
 }
 
 
-// Forward packets read from tap file descriptor to NETIO q on behalf of
-// the program named av0.
-//
-static void tapToQueue(Thread *t, int tap, netio_queue_t *q)
+int tapToQueue(Thread *t, int tap, netio_queue_t *q)
 {
     INFO("%02d: tapToQueue(%p, %d, %p)", t->index, t, tap, q);
     unsigned char buffer[PACKETSIZE];
@@ -79,6 +116,7 @@ static void tapToQueue(Thread *t, int tap, netio_queue_t *q)
              t->index, t, tap, q);
         t->alert = 1;
         close(tap);
+        return 0;
     } else if (rSize < 0 || rSize > sizeof buffer) {
         error("%02d: TAP read(%d, %p, %zu) returned %d with errno %d: %s",
               t->index, tap, buffer, sizeof buffer, rSize,
@@ -93,16 +131,21 @@ static void tapToQueue(Thread *t, int tap, netio_queue_t *q)
         memcpy(payload, buffer, rSize);
         netio_pkt_flush(&pkt, rSize);
         netio_pkt_fence();
-        netio_error_t err = NETIO_QUEUE_FULL;
-        while (err == NETIO_QUEUE_FULL) err = netio_send_packet(q, &pkt);
+        const netio_error_t err = sendPacketOrShed(t, q, &pkt, 0);
         if (err == NETIO_NO_ERROR) {
             ++t->send[0];
         } else {
             ++t->drop[0];
             error("%02d: TAP netio_send_packet(%p, %p) returned %d: %s",
                   t->index, q, &pkt, err, netio_strerror(err));
+            const netio_error_t fail = netio_free_buffer(q, &pkt);
+            if (fail != NETIO_NO_ERROR) {
+                error("%02d: netio_free_buffer(%p, %p) returned %d: %s",
+                      t->index, q, &pkt, fail, netio_strerror(fail));
+            }
         }
     }
+    return 1;
 }
 
 
@@ -2,7 +2,11 @@
 #define INCLUDE_TAP_H
 
 
+#include <netio/netio.h>
+
+
 struct Process;                         // Defined in process.h.
+struct Thread;                          // Defined in process.h.
 
 
 // Manage a TAP device for forwarding unrouted UDP packets received on
@@ -17,6 +21,12 @@ extern void tapConfigure(struct Process *p);
 //
 extern void *tapStart(void *v);
 
+// Forward a packet read from the tap file descriptor to NETIO q, counting
+// it on t.  Retry sends on a full queue for the budget of the highest
+// priority class, then drop the packet.  Return 0 on EOF or 1 otherwise.
+//
+extern int tapToQueue(struct Thread *t, int tap, netio_queue_t *q);
+
 // Close fd to shut down the TAP forwarder.
 //
 void tapStop(int fd);
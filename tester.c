@@ -1,11 +1,16 @@
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "churn.h"
+#include "flood.h"
 #include "packets.h"
 #include "process.h"
+#include "replay.h"
+#include "rfc2544.h"
 #include "route.h"
 #include "tap.h"
 #include "tilera.h"
@@ -21,14 +26,25 @@ static const char usage[] =
     "    on <cip> that set up the UDP switch to route the sent packets    \n"
     "    back to this program.                                            \n"
     "                                                                     \n"
-    "Usage: %s <cip> <fif> <fip> <mac> <routes> <packets> <seconds>       \n"
+    "Usage: %s <cip> <fif> <fip> <mac> <routes> <packets> <seconds> <load>\n"
+    "           [<size> [<churn> [<subset>]]]                             \n"
+    "   or: %s -rfc2544 <report> [-jumbo] <cip> <fif> <fip> <mac>         \n"
+    "           <routes> <packets> <seconds>                              \n"
+    "   or: %s -replay <pcap> <speed> <cip> <fif> <fip> <mac> <routes>    \n"
+    "           <packets> <seconds>                                       \n"
+    "   or: %s -flood <bps> <times> <cip> <fif> <fip> <mac> <routes>      \n"
+    "           <packets> <seconds>                                       \n"
     "                                                                     \n"
     "Where: <cip> is the IP address of the switch's control port.         \n"
     "             Send route control commands over TCP to <cip>:%d.       \n"
     "       <fif> is the name of the network interface to use for sending \n"
     "             and receiving packets.   Usually '%s' or '%s'.          \n"
     "             Use '%s' in production, but '%s' can avoid setting      \n"
-    "             up an optical connection.                               \n"
+    "             up an optical connection.  With a list such as          \n"
+    "             'xgbe/0,xgbe/1', cabled in order to the interfaces in   \n"
+    "             the switch's <fif> list, route n leaves and returns     \n"
+    "             on interface n %% <count> of the <count> listed, so the \n"
+    "             switch sends it out the interface it came in on.        \n"
     "       <fip> is the dotted-decimal IPv4 address string for the       \n"
     "             network interface on the switch that forwards UDP       \n"
     "             packet traffic.                                         \n"
@@ -40,8 +56,67 @@ static const char usage[] =
     "                 The default is %d.                                  \n"
     "       <seconds> is the total number of seconds to wait for packets  \n"
     "                 returned from the UDP switch.  The default is %d.   \n"
+    "       <load> is the percentage of a packet to send for each packet  \n"
+    "              returned from the UDP switch.  Over 100 overloads the  \n"
+    "              switch, so 120 offers 120%% load.  The default is 100. \n"
+    "       <size> is the size in bytes of each Ethernet frame sent,      \n"
+    "              from %d to %d.  The default is %d.                     \n"
+    "       <churn> is a comma-separated list of up to %d rates of route  \n"
+    "               changes per second, such as 100,1000,0.  The tester   \n"
+    "               splits <seconds> among the rates, and at each rate    \n"
+    "               flips routes between two ports on this program while  \n"
+    "               packets flow.  The second port also has an IP and MAC \n"
+    "               address a bit different from this program's.          \n"
+    "               A rate of 0 changes routes as fast as the switch acks \n"
+    "               them.  Churn uses at most %d routes.                  \n"
+    "       <subset> is how many of the routes churn flips while the rest \n"
+    "                carry steady traffic.  The default is all of them.   \n"
+    "                                                                     \n"
+    "Churn shows a line of JSON for each change, for each route that      \n"
+    "changed, and for each rate.  They count the packets lost and         \n"
+    "reordered, and those that arrived on the old port after the change   \n"
+    "was sent (inflight), after one arrived on the new port (misrouted),  \n"
+    "or that were sent after the switch acked the change (stale).  Wrong  \n"
+    "packets arrived at a port and addresses their route never had        \n"
+    "together, as a half-written route would send them.  The line for     \n"
+    "each rate also shows the changes the switch applied per second, and  \n"
+    "the microseconds from sending a change to its ack and to the first   \n"
+    "packet on the new port.                                              \n"
+    "The tester fails if any packet was stale or wrong.                   \n"
+    "                                                                     \n"
+    "With -rfc2544, the tester sends at a fixed rate instead of as        \n"
+    "packets come back, in trials of <seconds> each.  For each frame size \n"
+    "of RFC 2544, and a jumbo frame with -jumbo, it searches for the      \n"
+    "highest rate with no loss to within %d.%d%% of line rate.  Then it    \n"
+    "measures latency at that rate, and loss from line rate down in steps \n"
+    "of %d%%.  It writes the results into the file <report> as JSON.      \n"
+    "Only pass -jumbo when the hypervisor configuration has jumbo buffers.\n"
+    "                                                                     \n"
+    "With -replay, the tester sends the UDP packets of the pcap capture   \n"
+    "<pcap> for <seconds>, starting over whenever the capture ends.  Each \n"
+    "UDP flow in the capture goes out on one route, with the flow's       \n"
+    "payload sizes and timing.  Frames over %d bytes are skipped.       \n"
+    "A <speed> of 1 keeps the capture's timing, 2 sends twice as fast, and\n"
+    "0 sends as fast as possible.  The tester shows the rate it sent at   \n"
+    "and how many packets were over %d us late.                           \n"
+    "                                                                     \n"
+    "With -flood, the tester sends <bps> bits per second on each route,   \n"
+    "except route 0, on which it sends <times> packets for each one it    \n"
+    "sends on the others.  It runs a trial of <seconds> with the routes   \n"
+    "unpoliced, then one with the switch policing each route to <bps>,    \n"
+    "at least %d.  It shows the packets route 0 and the other routes    \n"
+    "lost in each trial.  The switch shows the packets it policed.        \n"
+    "                                                                     \n"
+    "Route n gets priority n %% %d, and the counters show the packets     \n"
+    "each priority class lost when the switch sheds load.                 \n"
     "                                                                     \n"
     "Example: %s 172.17.3.126 %s %s 2e:97:ef:aa:43:c2\n"
+    "Example: %s -rfc2544 rfc2544.json 172.17.3.126 %s %s \\\n"
+    "             2e:97:ef:aa:43:c2 100 1 60\n"
+    "Example: %s -replay mpegts.pcap 1 172.17.3.126 %s %s \\\n"
+    "             2e:97:ef:aa:43:c2 100 1 60\n"
+    "Example: %s -flood 20000000 10 172.17.3.126 %s %s \\\n"
+    "             2e:97:ef:aa:43:c2 100 1 10\n"
     "\n";
 
 // Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
@@ -55,14 +130,46 @@ static const char usage[] =
 typedef struct TesterCommandLine {
     const char *av0;
     const char *cip;
-    const char *fif;
+    const char *fif[MAXINTERFACES];
+    int fifCount;
     const char *fip;
     const char *mac;
     int routes;
     int packets;
     int seconds;
+    int load;
+    int size;
+    int churn[CHURNRATES];
+    int churnCount;
+    int subset;
+    const char *report;
+    int jumbo;
+    const char *pcap;
+    double speed;
+    int floodBps;
+    int floodTimes;
 } TesterCommandLine;
 
+
+// Parse into cl->churn the comma-separated list of rates s.  Return 0 if
+// s lists 1 to CHURNRATES rates that are not negative.  Otherwise return
+// -1.
+//
+static int churnFromString(TesterCommandLine *cl, const char *s)
+{
+    cl->churnCount = 0;
+    while (cl->churnCount < CHURNRATES) {
+        char *end = NULL;
+        const long rate = strtol(s, &end, 10);
+        if (end == s || rate < 0 || rate > INT_MAX) return -1;
+        cl->churn[cl->churnCount++] = rate;
+        if (*end == ""[0]) return 0;
+        if (*end != ","[0]) return -1;
+        s = end + 1;
+    }
+    return -1;
+}
+
 // Validate the command line (ac, av) and return the results.
 //
 static const TesterCommandLine validateTesterUsage(int ac, const char *av[])
@@ -72,29 +179,63 @@ static const TesterCommandLine validateTesterUsage(int ac, const char *av[])
     static const int defaultSeconds = 99;
     const char *av0 = strrchr(av[0], "/"[0]); av0 = av0? 1 + av0: av[0];
     TesterCommandLine result = { .av0 = av0 };
+    int flood = 1;
     fprintf(stderr, "%s command line:", av0);
     for (int n = 0; n < ac; ++n) fprintf(stderr, " '%s'", av[n]);
     fprintf(stderr, "\n");
+    result.report = ac > 2 && 0 == strcmp(av[1], "-rfc2544") ? av[2] : NULL;
+    if (result.report) {
+        ac -= 2;
+        av += 2;
+        result.jumbo = ac > 1 && 0 == strcmp(av[1], "-jumbo");
+        if (result.jumbo) {
+            --ac;
+            ++av;
+        }
+    } else if (ac > 3 && 0 == strcmp(av[1], "-replay")) {
+        char *end = NULL;
+        result.pcap = av[2];
+        result.speed = strtod(av[3], &end);
+        if (end == av[3] || *end != ""[0]) result.speed = -1;
+        ac -= 3;
+        av += 3;
+    } else if (ac > 3 && 0 == strcmp(av[1], "-flood")) {
+        result.floodBps = atoi(av[2]);
+        result.floodTimes = atoi(av[3]);
+        flood = result.floodBps >= ROUTERATEMIN && result.floodTimes > 0;
+        ac -= 3;
+        av += 3;
+    }
     const int ok =
-        ac > 4 &&
+        ac > 4 && result.speed >= 0 && flood &&
         validIpString( av[1]) &&
         validIpString( av[3]) &&
         validMacString(av[4]) &&
-        ((0 == strcmp(av[2], PRODUCTIONINTERFACE)) ||
-         (0 == strcmp(av[2], CONVENIENCEINTERFACE)));
+        (result.fifCount =
+         interfacesFromString(result.fif, MAXINTERFACES, av[2])) > 0;
     if (ok) {
         result.cip     = av[1];
-        result.fif     = av[2];
         result.fip     = av[3];
         result.mac     = av[4];
         result.routes  = R30TOTALCHANNELS;
         result.packets = defaultPackets;
         result.seconds = defaultSeconds;
+        result.load    = 100;
+        result.size    = PACKETDEFAULTSIZE;
     } else {
         fprintf(stderr, usage, av0, PORTOFFSET, CONTROLPORT, CONTROLPORT,
-                av0, CONTROLPORT, PRODUCTIONINTERFACE, CONVENIENCEINTERFACE,
+                av0, av0, av0, av0, CONTROLPORT,
+                PRODUCTIONINTERFACE, CONVENIENCEINTERFACE,
                 PRODUCTIONINTERFACE, CONVENIENCEINTERFACE,
                 R30TOTALCHANNELS, defaultPackets, defaultSeconds,
+                PACKETMINSIZE, PACKETMAXSIZE, PACKETDEFAULTSIZE,
+                CHURNRATES, CHURNMAXROUTES,
+                RFC2544RESOLUTION / 10, RFC2544RESOLUTION % 10,
+                RFC2544LOSSSTEP, PACKETMAXSIZE, REPLAYLATEUS, ROUTERATEMIN,
+                ROUTEPRIORITYCOUNT,
+                av0, PRODUCTIONINTERFACE, EXAMPLEFORWARDINGIP,
+                av0, PRODUCTIONINTERFACE, EXAMPLEFORWARDINGIP,
+                av0, PRODUCTIONINTERFACE, EXAMPLEFORWARDINGIP,
                 av0, PRODUCTIONINTERFACE, EXAMPLEFORWARDINGIP);
         exit(1);
     }
@@ -110,11 +251,32 @@ static const TesterCommandLine validateTesterUsage(int ac, const char *av[])
         const int number = atoi(av[7]);
         if (number > 0) result.seconds = number;
     }
+    if (ac > 8) {
+        const int number = atoi(av[8]);
+        if (number > 0) result.load = number;
+    }
+    if (ac > 9) {
+        const int number = atoi(av[9]);
+        const int ok = number >= PACKETMINSIZE && number <= PACKETMAXSIZE;
+        if (ok) result.size = number;
+    }
+    if (ac > 10) {
+        if (churnFromString(&result, av[10])) result.churnCount = 0;
+        if (result.churnCount && result.routes > CHURNMAXROUTES) {
+            result.routes = CHURNMAXROUTES;
+        }
+    }
+    if (ac > 11) {
+        const int number = atoi(av[11]);
+        if (number > 0 && number < result.routes) result.subset = number;
+    }
     return result;
 }
 
 
 // Send p->routeCount JSON open route control strings to UDP switch on fd.
+// Spread the routes across the priority classes, and across the
+// interfaces so each route's packets leave and return on the same one.
 //
 static void startRoutes(Process *p, int fd)
 {
@@ -124,7 +286,9 @@ static void startRoutes(Process *p, int fd)
         Route rt = {
             .index = n,
             .poa   = PORTOFFSET + n,
-            .dst = dst
+            .dst = dst,
+            .priority = n % ROUTEPRIORITYCOUNT,
+            .egress = n % p->interfaceCount
         };
         memcpy(rt.dst.ip,  p->forward.ip,  sizeof rt.dst.ip);
         memcpy(rt.dst.mac, p->forward.mac, sizeof rt.dst.mac);
@@ -163,31 +327,57 @@ int main(int ac, const char *av[])
     const TesterCommandLine cl = validateTesterUsage(ac, av);
     errorInitialize(cl.av0);
     routeInitialize();
-    Process *const p = processInitialize(cl.av0, packetsStart, "packetsStart");
-    p->interface = cl.fif;
-    Thread *const t = p->thread + 0;
+    Process *const p =
+        processInitialize(cl.av0, NULL, packetsStart, "packetsStart");
+    for (int n = 0; n < cl.fifCount; ++n) p->interface[n] = cl.fif[n];
+    p->interfaceCount = cl.fifCount;
+    Thread *const t = p->thread[0];
     ipFromString(p->forward.ip, cl.fip);
     macFromString(p->forward.mac, cl.mac);
     p->routeCount = cl.routes;
     p->packetCount = cl.packets;
+    p->load = cl.load;
+    p->packetSize = cl.size;
+    p->paced = cl.report || cl.pcap || cl.floodBps;
+    if (cl.pcap && replayLoad(p, cl.pcap) < 0) exit(1);
     const int fd = connectTcpPort(cl.cip, CONTROLPORT);
-    registerQueueReadWrite(p->thread + 0);
+    registerQueueReadWrite(p->thread[0]);
     initializeNetio(p);
     tapConfigure(p);
+    if (cl.churnCount) {
+        Endpoint away;
+        churnInitialize(cl.routes, cl.subset, &p->forward, &away);
+        memcpy(p->alias, away.mac, sizeof p->alias);
+        p->aliased = 1;
+    }
     startRoutes(p, fd);
     SLEEP(1);
     int starts = processStartThreads(p, tapStart, "tapStart");
     starts += processStartThreads(p, packetsStart, "packetsStart");
     INFO("__: Started %d threads", starts);
-    packetsPrimePipeline(t);
-    INFO("__: main() sleep(%d)", cl.seconds);
-    sleep(cl.seconds);
+    if (!p->paced) packetsPrimePipeline(t);
+    int failures = 0;
+    if (cl.report) {
+        failures += rfc2544Run(p, cl.report, cl.seconds, cl.jumbo) ? 1 : 0;
+    } else if (cl.pcap) {
+        failures += replayRun(p, cl.speed, cl.seconds);
+    } else if (cl.floodBps) {
+        failures += floodRun(p, fd, cl.floodBps, cl.floodTimes, cl.seconds);
+    } else if (cl.churnCount) {
+        const int seconds = cl.seconds / cl.churnCount;
+        for (int n = 0; n < cl.churnCount; ++n) {
+            failures += churnRun(fd, cl.churn[n], seconds > 0 ? seconds : 1);
+        }
+    } else {
+        INFO("__: main() sleep(%d)", cl.seconds);
+        sleep(cl.seconds);
+    }
     const int stops = processStopThreads(p, packetsStart, "packetsStart");
     INFO("__: Stopped %d of %d threads", stops, starts);
     stopRoutes(p, fd);
     showCounters(p);
     unregisterQueue(t);
-    const int status = 0;
+    const int status = failures ? 1 : 0;
     INFO("__: Exiting with status %d", status);
     processUninitialize(p);
     return status;
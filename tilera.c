@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
@@ -14,6 +15,9 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include <arch/cycle.h>
+
+#include "bucket.h"
 #include "process.h"
 #include "route.h"
 #include "tilera.h"
@@ -29,7 +33,9 @@
 // reading.
 //
 // If registration fails because the Ethernet link is not up, then retry
-// every second until the link is up or another error occurs.
+// every REGISTERRETRYMS milliseconds until the link is up or another
+// error occurs.  Forwarders register their queues concurrently, so a
+// short retry brings them all up soon after the link.
 //
 // NETIO_NOREQUIRE_LINK_UP means don't wait for the link to come up and
 // don't return the NETIO_LINK_DOWN error.  The Ethernet interface is down
@@ -37,11 +43,12 @@
 // NETIO_AUTO_LINK_UP is the default, but that returns NETIO_LINK_DOWN when
 // main() registers its queue without IO enabled.
 //
-static void registerQueue(Thread *t, int writing, int reading)
+static void registerOneQueue(Thread *t, netio_queue_t *q, int interface,
+                             int writing, int reading)
 {
-    INFO("%02d: registerQueue(%p, %d, %d)", t->index, t, writing, reading);
+    INFO("%02d: registerOneQueue(%p, %p, %d, %d, %d)",
+         t->index, t, q, interface, writing, reading);
     Process *const p = t->process;
-    netio_queue_t *const q = &t->queue;
     const int w = writing? NETIO_XMIT: NETIO_NO_XMIT;
     const int r = reading? NETIO_RECV: NETIO_NO_RECV;
     const unsigned int flags =
@@ -49,16 +56,20 @@ static void registerQueue(Thread *t, int writing, int reading)
     netio_input_config_t config = {
         .flags =  w | r | flags,
         .num_receive_packets = NETIO_MAX_RECEIVE_PKTS,
-        .interface = p->interface,
+        .interface = p->interface[interface],
         .queue_id = t->index
     };
+    static const struct timespec retry = {
+        .tv_nsec = 1000000 * REGISTERRETRYMS
+    };
     netio_error_t err = NETIO_LINK_DOWN;
     while (err == NETIO_LINK_DOWN) {
-        const netio_error_t err = netio_input_register(&config, q);
+        err = netio_input_register(&config, q);
         if (err == NETIO_LINK_DOWN) {
             info("%02d: netio_input_register(%p, %p) for interface %s "
                  "on CPU %2d returned %d: %s", t->index, &config, q,
                  config.interface, t->cpu, err, netio_strerror(err));
+            nanosleep(&retry, NULL);
         } else if (err == NETIO_NO_ERROR) {
             INFO("%02d: register queue for interface %s on CPU %2d",
                  t->index, config.interface, t->cpu);
@@ -71,17 +82,32 @@ static void registerQueue(Thread *t, int writing, int reading)
         }
     }
 }
+
+
+// Register t->queue on t->interface.  If writing and there are other
+// interfaces, also register the t->egress queues on them for writing.
+//
+static void registerQueue(Thread *t, int writing, int reading)
+{
+    INFO("%02d: registerQueue(%p, %d, %d)", t->index, t, writing, reading);
+    const Process *const p = t->process;
+    registerOneQueue(t, &t->queue, t->interface, writing, reading);
+    t->egressing = writing && p->interfaceCount > 1;
+    for (int i = 0; t->egressing && i < p->interfaceCount; ++i) {
+        if (i != t->interface) registerOneQueue(t, t->egress + i, i, 1, 0);
+    }
+}
 void registerQueueRead(struct Thread *t)      { registerQueue(t, 0, 1); }
 void registerQueueReadWrite(struct Thread *t) { registerQueue(t, 1, 1); }
 void registerQueueWrite(struct Thread *t)     { registerQueue(t, 1, 0); }
 void registerQueueStatsOnly(struct Thread *t) { registerQueue(t, 0, 0); }
 
 
-void unregisterQueue(Thread *t)
+// Unregister q for t with NETIO.
+//
+static void unregisterOneQueue(Thread *t, netio_queue_t *q)
 {
-    INFO("%02d: unregisterQueue(%p)", t->index, t);
-    Process *const p = t->process;
-    netio_queue_t *const q = &t->queue;
+    INFO("%02d: unregisterOneQueue(%p, %p)", t->index, t, q);
     const netio_error_t err = netio_input_unregister(q);
     if (err == NETIO_NO_ERROR) {
         INFO("%02d: unregister queue for CPU %2d", t->index, t->cpu);
@@ -93,6 +119,18 @@ void unregisterQueue(Thread *t)
 }
 
 
+void unregisterQueue(Thread *t)
+{
+    INFO("%02d: unregisterQueue(%p)", t->index, t);
+    const Process *const p = t->process;
+    unregisterOneQueue(t, &t->queue);
+    for (int i = 0; t->egressing && i < p->interfaceCount; ++i) {
+        if (i != t->interface) unregisterOneQueue(t, t->egress + i);
+    }
+    t->egressing = 0;
+}
+
+
 // Configure pause frames on the interface identified by q.  Suspend output
 // on the interface when it receives a pause frame.  If send, also send
 // pause frames back to a packet source when the IO shim packet FIFOs are
@@ -139,41 +177,48 @@ static void configurePauseFrames(netio_queue_t *q, int send)
 // Hash to 512 buckets numbered 0 through 0x1ff.  (Mask the header hash with
 // bucket_mask adding the result to bucket_base.)
 //
-// Map bucket N to queue b2q[N] such that the (threadCount - 2) queue IDs
-// (aka thread indexes) starting at 2 occur with about equal probability.
+// With several interfaces, deal the forwarding threads out to them round
+// robin, and do all of this on each interface, which has its own IPP.
+// Map bucket N on interface I to queue p->bucket[I * BUCKETCOUNT + N] such
+// that the running forwarders on I occur with about equal probability.
+// The bucket rebalancer in bucket.c may remap buckets later.
 //
 // Any queue will do here because they are all on the same interface (IPP),
-// so just use thread[0].queue.  And why not squirrel away the MAC address
-// of the interface (identified by the queue) here?
+// so just use thread[0]'s queue on the interface.  And why not squirrel
+// away the MAC address of the interface (identified by the queue) here?
 //
 // FYI: The netio_input_UNinitialize() call is not yet implemented.
 //
-#define LOG2 (NETIO_LOG2_NUM_BUCKETS - 1)
-#define COUNT (1 << LOG2)
-#define MASK (COUNT - 1)
-void initializeNetio(struct Process *p)
+static void initializeInterface(Process *p, int interface)
 {
-    INFO("__: initializeNetio(%p)", p);
-    Thread *const t = p->thread + 0;
-    netio_queue_t *const q = &t->queue;
+    INFO("__: initializeInterface(%p, %d)", p, interface);
+    Thread *const t = p->thread[0];
+    netio_queue_t *const q = processEgress(t, interface);
     static netio_group_t group = {
         .bits.__balance_on_l4 = 1,      // Hash on port numbers.
         // .bits.__balance_on_l3 = 1,      // Hash on IP addresses.
         // .bits.__balance_on_l2 = 1,      // Hash on MAC addresses
         .bits.__bucket_base   = 0,
-        .bits.__bucket_mask   = MASK
+        .bits.__bucket_mask   = BUCKETMASK
     };
-    INFO("__: %u (0x%x) buckets with mask 0x%x", COUNT, COUNT, MASK);
+    INFO("__: %u (0x%x) buckets with mask 0x%x",
+         BUCKETCOUNT, BUCKETCOUNT, BUCKETMASK);
     netio_error_t err = NETIO_NO_ERROR;
-    static netio_bucket_t b2q[COUNT];
-    for (int n = 0; n < COUNT; ++n) {
-        b2q[n] = p->netioThreadIndex + n % p->netioThreadCount;
+    netio_bucket_t *const b2q = p->bucket + interface * BUCKETCOUNT;
+    const int end = p->netioThreadIndex + p->netioThreadCount;
+    int forwarders[p->threadCount];
+    int count = 0;
+    for (int m = p->netioThreadIndex; m < end; ++m) {
+        if (p->thread[m]->interface == interface) forwarders[count++] = m;
     }
-    err = netio_input_bucket_configure(q, group.bits.__bucket_base, b2q, COUNT);
+    assert(count > 0);
+    for (int n = 0; n < BUCKETCOUNT; ++n) b2q[n] = forwarders[n % count];
+    err = netio_input_bucket_configure(q, group.bits.__bucket_base,
+                                       b2q, BUCKETCOUNT);
     if (err != NETIO_NO_ERROR) {
         error("__: netio_input_bucket_configure(%p, %d, %p, 1 << %d) "
               "returned %d: %s",
-              q, group.bits.__bucket_base, b2q, LOG2,
+              q, group.bits.__bucket_base, b2q, BUCKETLOG2,
               err, netio_strerror(err));
     }
     err = netio_input_group_configure(q, 0, &group, 1);
@@ -187,18 +232,28 @@ void initializeNetio(struct Process *p)
         error("__: netio_input_initialize(%p) returned %d: %s",
               q, err, netio_strerror(err));
     }
+    unsigned char *const mac = p->mac[interface];
     const int size = netio_get(q, NETIO_PARAM, NETIO_PARAM_MAC,
-                               p->forward.mac, sizeof p->forward.mac);
-    if (size != sizeof p->forward.mac) {
+                               mac, sizeof p->mac[interface]);
+    if (size != sizeof p->mac[interface]) {
         error("%02d: netio_get(%p, NETIO_PARAM, NETIO_PARAM_MAC, %p, %d) "
               "returned %d: %s",
-              t->index, q, p->forward.mac, sizeof p->forward.mac,
+              t->index, q, mac, sizeof p->mac[interface],
               size, netio_strerror(size));
     }
 }
-#undef MASK
-#undef COUNT
-#undef LOG2
+
+
+void initializeNetio(struct Process *p)
+{
+    INFO("__: initializeNetio(%p)", p);
+    for (int m = p->netioThreadIndex; m < p->threadCount; ++m) {
+        const int forwarder = m - p->netioThreadIndex;
+        p->thread[m]->interface = forwarder % p->interfaceCount;
+    }
+    for (int i = 0; i < p->interfaceCount; ++i) initializeInterface(p, i);
+    memcpy(p->forward.mac, p->mac[0], sizeof p->forward.mac);
+}
 
 
 static void dumpPacketInfo(const PacketInfo *pi)
@@ -214,11 +269,27 @@ static void dumpPacketInfo(const PacketInfo *pi)
     info("__: ((PacketInfo *)%p)->ipHeaderSize   == %u",  pi, pi->ipHeaderSize);
     info("__: ((PacketInfo *)%p)->allHeadersSize == %u",
          pi, pi->allHeadersSize);
+    info("__: ((PacketInfo *)%p)->bucket         == %u",  pi, pi->bucket);
+}
+
+
+// Return true if mac is the MAC address of an interface of p, or the
+// alias p takes packets for.
+//
+static int isMyMac(const Process *p, const unsigned char *mac)
+{
+    for (int i = 0; i < p->interfaceCount; ++i) {
+        if (memcmp(mac, p->mac[i], sizeof p->mac[i]) == 0) return 1;
+    }
+    return p->aliased && memcmp(mac, p->alias, sizeof p->alias) == 0;
 }
 
 
 // Return a PacketInfo describing the NETIO packet at pkt for p.
 //
+// The IPP chose the packet's bucket by masking its flow hash with the
+// group's bucket mask and adding the bucket base of 0.
+//
 // Invalidate the packet's standard NETIO metadata first.  Then invalidate
 // the minimal range of the combined Ethernet, IP, and UDP headers.  If
 // result.isUdpForMe, calculate the actual size of the IP header and extend
@@ -231,8 +302,8 @@ static void dumpPacketInfo(const PacketInfo *pi)
 // is 0x11, the IP version (first 4 bits of the IP header) is 4, the size
 // of the combined IP and UDP headers is greater than the minimum length 28
 // (20 bytes of IP + 8 bytes of UDP), and the MAC address (first 6 bytes of
-// the Ethernet header) matches the forwarding interface's MAC address
-// (p->forward.mac).
+// the Ethernet header) matches the MAC address of one of the forwarding
+// interfaces (p->mac).
 //
 // The actual IP header length is in the low 4 bits of the first byte of
 // the IP header in units of 4-byte words.
@@ -260,7 +331,8 @@ const PacketInfo parsePacket(const Process *p, netio_pkt_t *pkt)
         .l2Data = NETIO_PKT_L2_DATA_M(md, pkt),
         .l3Data = NETIO_PKT_L3_DATA_M(md, pkt),
         .l2Length = NETIO_PKT_L2_LENGTH_M(md, pkt),
-        .l3Length = NETIO_PKT_L3_LENGTH_M(md, pkt)
+        .l3Length = NETIO_PKT_L3_LENGTH_M(md, pkt),
+        .bucket = BUCKETMASK & NETIO_PKT_FLOW_HASH_M(md, pkt)
     };
     const unsigned int ethernetHeaderLength = result.l3Data - result.l2Data;
     const unsigned int minHeadersLength = ethernetHeaderLength + minUdpLength;
@@ -284,7 +356,7 @@ const PacketInfo parsePacket(const Process *p, netio_pkt_t *pkt)
         (result.l3Data[protocolByte] == protocolUdp) &&
         (((ipVersionMask & result.l3Data[ipVersionByte]) >> ipVersionShift)
          == ipV4Version) &&
-        (memcmp(result.l2Data, p->forward.mac, sizeof p->forward.mac) == 0);
+        isMyMac(p, result.l2Data);
     if (result.isUdpForMe) {
         const unsigned int ipHeaderSizeInWords =
             (ipHeaderSizeMask & result.l3Data[ipVersionByte])
@@ -340,9 +412,9 @@ static void showNonNetioThread(const Thread *t, const char *name)
 static void showNetioPacketStatus(const Process *p)
 {
     static const size_t statusCount =
-        sizeof p->thread->status / sizeof p->thread->status[0];
+        sizeof p->thread[0]->status / sizeof p->thread[0]->status[0];
     for (int m = p->netioThreadIndex; m < p->threadCount; ++m) {
-        const Thread *const t = p->thread + m;
+        const Thread *const t = p->thread[m];
         for (int n = 0; n < statusCount; ++n) {
             if (t->status[n]) {
                 show("Thread %2d: %5llu ok"
@@ -360,18 +432,21 @@ static void showNetioPacketStatus(const Process *p)
 
 static void showNetioThreads(const Process *p)
 {
-    int routesPerThread[MAXCPUCOUNT] = {};
+    int routesPerThread[p->threadCount];
     int threadsPerRoute[R30TOTALCHANNELS] = {};
-    const Thread *threadOnRoute[R30TOTALCHANNELS][MAXCPUCOUNT] = {};
+    const Thread *threadOnRoute[R30TOTALCHANNELS][p->threadCount];
+    memset(routesPerThread, 0, sizeof routesPerThread);
     unsigned long long dropPerRoute[R30TOTALCHANNELS] = {};
     unsigned long long recvPerRoute[R30TOTALCHANNELS] = {};
     unsigned long long sentPerRoute[R30TOTALCHANNELS] = {};
+    unsigned long long policedPerRoute[R30TOTALCHANNELS] = {};
     for (int m = p->netioThreadIndex; m < p->threadCount; ++m) {
-        const Thread *const t = p->thread + m;
+        const Thread *const t = p->thread[m];
         for (int n = 0; n < R30TOTALCHANNELS; ++n) {
             dropPerRoute[n] += t->drop[n];
             recvPerRoute[n] += t->recv[n];
             sentPerRoute[n] += t->send[n];
+            policedPerRoute[n] += t->policed[n];
             if (t->drop[n] || t->recv[n] || t->send[n]) {
                 ++routesPerThread[m];
                 threadOnRoute[n][threadsPerRoute[n]] = t;
@@ -401,10 +476,14 @@ static void showNetioThreads(const Process *p)
             show("Route %d had packet counts: "
                  "%5llu drop %5llu recv %5llu send", poa,
                  dropPerRoute[n], recvPerRoute[n], sentPerRoute[n]);
+            if (policedPerRoute[n]) {
+                show("Route %d policed %5llu packets over %d bits/s",
+                     poa, policedPerRoute[n], rt.rate);
+            }
         }
     }
     for (int m = p->netioThreadIndex; m < p->threadCount; ++m) {
-        const Thread *const t = p->thread + m;
+        const Thread *const t = p->thread[m];
         if (routesPerThread[m]) {
             show("Thread %2d on CPU %2d had %d routes",
                  t->index, t->cpu, routesPerThread[m]);
@@ -425,10 +504,128 @@ static void showNetioThreads(const Process *p)
 }
 
 
-static void showNetioStatistics(Process *p)
+// Show egress congestion counters and per priority class packet counts.
+//
+static void showEgress(const Process *p)
+{
+    unsigned long long queueFull = 0;
+    unsigned long long retryCycles = 0;
+    unsigned long long pipeFull = 0;
+    unsigned long long shapeHeld = 0;
+    unsigned long long shapeFull = 0;
+    unsigned long long priorityDrop[ROUTEPRIORITYCOUNT] = {};
+    unsigned long long drop[ROUTEPRIORITYCOUNT] = {};
+    unsigned long long recv[ROUTEPRIORITYCOUNT] = {};
+    unsigned long long send[ROUTEPRIORITYCOUNT] = {};
+    for (int m = p->netioThreadIndex; m < p->threadCount; ++m) {
+        const Thread *const t = p->thread[m];
+        queueFull += t->queueFull;
+        retryCycles += t->retryCycles;
+        pipeFull += t->pipeFull;
+        shapeHeld += t->shapeHeld;
+        shapeFull += t->shapeFull;
+        for (int n = 0; n < ROUTEPRIORITYCOUNT; ++n) {
+            priorityDrop[n] += t->priorityDrop[n];
+        }
+        for (int n = 0; n < R30TOTALCHANNELS; ++n) {
+            if (t->drop[n] || t->recv[n] || t->send[n]) {
+                const Route rt = routeFromPortOfArrival(PORTOFFSET + n);
+                drop[rt.priority] += t->drop[n];
+                recv[rt.priority] += t->recv[n];
+                send[rt.priority] += t->send[n];
+            }
+        }
+    }
+    if (queueFull) {
+        show("Egress queue was full %llu times costing %llu retry cycles",
+             queueFull, retryCycles);
+    }
+    if (pipeFull) show("Pipeline rings were full for %llu packets", pipeFull);
+    if (shapeHeld || shapeFull) {
+        show("Shapers held %llu packets and were full for %llu",
+             shapeHeld, shapeFull);
+    }
+    for (int n = 0; n < ROUTEPRIORITYCOUNT; ++n) {
+        if (drop[n] || recv[n] || send[n] || priorityDrop[n]) {
+            show("Priority %d routes: %5llu drop %5llu recv %5llu send "
+                 "%5llu shed", n, drop[n], recv[n], send[n], priorityDrop[n]);
+        }
+    }
+}
+
+
+// Show the packets each interface of p received and sent, and the rate at
+// which its forwarders sent them.
+//
+static void showInterfaces(const Process *p)
+{
+    for (int i = 0; i < p->interfaceCount; ++i) {
+        unsigned long long recv = 0, send = 0, crossed = 0, wallNs = 0;
+        int count = 0;
+        for (int m = p->netioThreadIndex; m < p->threadCount; ++m) {
+            const Thread *const t = p->thread[m];
+            if (t->interface == i) {
+                for (int n = 0; n < R30TOTALCHANNELS; ++n) {
+                    recv += t->recv[n];
+                    send += t->send[n];
+                }
+                crossed += t->crossed;
+                if (t->stages.wallNs > wallNs) wallNs = t->stages.wallNs;
+                count += m < p->netioThreadIndex + p->netioThreadCount;
+            }
+        }
+        const unsigned long long us = wallNs / 1000;
+        show("Interface %s: %d forwarders received %llu packets and sent "
+             "%llu (%llu on other interfaces) at %llu packets/s",
+             p->interface[i], count, recv, send, crossed,
+             us ? 1000000 * send / us : 0);
+    }
+}
+
+
+// Return the count of packets the IPP and IO shim have dropped on the
+// interface of q registered by t.
+//
+static unsigned long long countQueueDrops(Thread *t, netio_queue_t *q)
 {
-    Thread *const t = p->thread + 0;
-    netio_queue_t *const q = &t->queue;
+    INFO("%02d: countQueueDrops(%p, %p)", t->index, t, q);
+    unsigned long shimOverflowCounter = 0;
+    int size = netio_get(q, NETIO_PARAM, NETIO_PARAM_OVERFLOW,
+                         &shimOverflowCounter, sizeof shimOverflowCounter);
+    if (size != sizeof shimOverflowCounter) {
+        error("%02d: netio_get(NETIO_PARAM_OVERFLOW) returned %d not %d",
+              t->index, size, sizeof shimOverflowCounter);
+    }
+    netio_stat_t netioStatistics = {};
+    size = netio_get(q, NETIO_PARAM, NETIO_PARAM_STAT,
+                     &netioStatistics, sizeof netioStatistics);
+    if (size != sizeof netioStatistics) {
+        error("%02d: netio_get(NETIO_PARAM_STAT) returned %d not %d",
+              t->index, size, sizeof netioStatistics);
+    }
+    return (0xffff & shimOverflowCounter) + netioStatistics.packets_dropped;
+}
+
+
+unsigned long long countIngressDrops(Thread *t)
+{
+    INFO("%02d: countIngressDrops(%p)", t->index, t);
+    const Process *const p = t->process;
+    unsigned long long result = countQueueDrops(t, &t->queue);
+    for (int i = 0; t->egressing && i < p->interfaceCount; ++i) {
+        if (i != t->interface) result += countQueueDrops(t, t->egress + i);
+    }
+    return result;
+}
+
+
+// Show the IO shim and IPP statistics of interface i of p.
+//
+static void showNetioStatistics(Process *p, int i)
+{
+    Thread *const t = p->thread[0];
+    netio_queue_t *const q = processEgress(t, i);
+    const char *const name = p->interface[i];
     unsigned long shimOverflowCounter = 0;
     int size = netio_get(q, NETIO_PARAM, NETIO_PARAM_OVERFLOW,
                          &shimOverflowCounter, sizeof shimOverflowCounter);
@@ -440,8 +637,8 @@ static void showNetioStatistics(Process *p)
         0xffff & (shimOverflowCounter >> 0);
     const unsigned long shimOverflowTruncated =
         0xffff & (shimOverflowCounter >> 16);
-    show("IO shim dropped %lu packets and truncated %lu packets",
-         shimOverflowDropped, shimOverflowTruncated);
+    show("%s: IO shim dropped %lu packets and truncated %lu packets",
+         name, shimOverflowDropped, shimOverflowTruncated);
     netio_stat_t netioStatistics = {};
     size = netio_get(q, NETIO_PARAM, NETIO_PARAM_STAT,
                      &netioStatistics, sizeof netioStatistics);
@@ -449,41 +646,93 @@ static void showNetioStatistics(Process *p)
         error("__: netio_get(NETIO_PARAM_STAT) returned %d not %d",
               size, sizeof netioStatistics);
     }
-    show("IPP received %lu packets and dropped %lu packets",
+    show("%s: IPP received %lu packets and dropped %lu packets", name,
          netioStatistics.packets_received, netioStatistics.packets_dropped);
     if (netioStatistics.drops_no_worker) {
-        show("IPP dropped %lu packets because no worker was available",
-             netioStatistics.drops_no_worker);
+        show("%s: IPP dropped %lu packets because no worker was available",
+             name, netioStatistics.drops_no_worker);
     }
     if (netioStatistics.drops_no_smallbuf) {
-        show("IPP dropped %lu packets because there was no small buffer",
-             netioStatistics.drops_no_smallbuf);
+        show("%s: IPP dropped %lu packets because there was no small buffer",
+             name, netioStatistics.drops_no_smallbuf);
     }
     if (netioStatistics.drops_no_largebuf) {
-        show("IPP dropped %lu packets because there was no large buffer",
-             netioStatistics.drops_no_largebuf);
+        show("%s: IPP dropped %lu packets because there was no large buffer",
+             name, netioStatistics.drops_no_largebuf);
     }
     if (netioStatistics.drops_no_jumbobuf) {
-        show("IPP dropped %lu packets because there was no jumbo buffer",
-             netioStatistics.drops_no_jumbobuf);
+        show("%s: IPP dropped %lu packets because there was no jumbo buffer",
+             name, netioStatistics.drops_no_jumbobuf);
     }
 }
 
 
+// Send pkt on q for t retrying while q is full for up to the egress
+// budget of priority class priority.
+//
+// Try once without reading the cycle counter so an uncongested send costs
+// no more than before.  The budget for class n is EGRESSRETRYUS >> 2n, so
+// the lowest class drops on the first NETIO_QUEUE_FULL.
+//
+netio_error_t sendPacketOrShed(Thread *t, netio_queue_t *q,
+                               netio_pkt_t *pkt, int priority)
+{
+    netio_error_t err = netio_send_packet(q, pkt);
+    if (err != NETIO_QUEUE_FULL) return err;
+    const Process *const p = t->process;
+    const int last = priority >= ROUTEPRIORITYCOUNT - 1;
+    const unsigned long long budget = last ? 0 :
+        (p->cyclesPerUs * EGRESSRETRYUS) >> (2 * priority);
+    const unsigned long long begin = get_cycle_count();
+    unsigned long long now = begin;
+    ++t->queueFull;
+    while (err == NETIO_QUEUE_FULL && now - begin < budget) {
+        err = netio_send_packet(q, pkt);
+        now = get_cycle_count();
+    }
+    t->retryCycles += now - begin;
+    if (err == NETIO_QUEUE_FULL) {
+        const int n = last ? ROUTEPRIORITYCOUNT - 1 : priority;
+        ++t->priorityDrop[n];
+    }
+    return err;
+}
+
+
+// Count cycles across a 10 millisecond sleep.
+//
+unsigned long long measureCyclesPerMicrosecond(void)
+{
+    static const struct timespec tenMs = { .tv_nsec = 10000000 };
+    const unsigned long long beginNs = clockNs(CLOCK_MONOTONIC);
+    const unsigned long long begin = get_cycle_count();
+    nanosleep(&tenMs, NULL);
+    const unsigned long long end = get_cycle_count();
+    const unsigned long long endNs = clockNs(CLOCK_MONOTONIC);
+    const unsigned long long us = (endNs - beginNs) / 1000;
+    const unsigned long long result = us ? (end - begin) / us : 0;
+    INFO("__: measureCyclesPerMicrosecond() returns %llu", result);
+    return result ? result : 1;
+}
+
+
 void showCounters(Process *p)
 {
     INFO("__: showCounters(%p)", p);
-    int routesPerThread[MAXCPUCOUNT] = {};
-    int threadsPerRoute[R30TOTALCHANNELS] = {};
     show("Process with %2d threads saw %d route commands",
          p->threadCount, p->routeCount);
     show("Process has %2d NETIO threads starting at thread %d",
          p->netioThreadCount, p->netioThreadIndex);
-    showNonNetioThread(p->thread + 0, "main()");
-    showNonNetioThread(p->thread + 1, "TAPdev");
+    show("Process measured %llu cycles per microsecond", p->cyclesPerUs);
+    showNonNetioThread(p->thread[0], "main()");
+    showNonNetioThread(p->thread[1], "TAPdev");
     showNetioThreads(p);
     showNetioPacketStatus(p);
-    showNetioStatistics(p);
+    showEgress(p);
+    showInterfaces(p);
+    for (int i = 0; i < p->interfaceCount; ++i) showNetioStatistics(p, i);
+    stageShow(p);
+    bucketShow(p);
 }
 
 
@@ -8,6 +8,12 @@
 #include "process.h"
 
 
+// Retry a queue registration every REGISTERRETRYMS milliseconds while the
+// Ethernet link is down.
+//
+#define REGISTERRETRYMS (10)
+
+
 // Register a NETIO queue for thread t.  Register t->queue for reading,
 // reading and writing, or just writing.  registerQueueStatsOnly() sets
 // t->queue up for monitoring interface statistics without enabling IO.
@@ -27,6 +33,11 @@ extern void unregisterQueue(Thread *t);
 //
 extern void initializeNetio(Process *p);
 
+// Return the count of packets the IPP and IO shim have dropped on the
+// interface of t->queue.
+//
+extern unsigned long long countIngressDrops(Thread *t);
+
 
 // Return a PacketInfo describing the NETIO packet at pkt for p.
 //
@@ -43,6 +54,7 @@ extern void initializeNetio(Process *p);
 // .allHeadersSize is the calculated size of all the frame headers,
 //                 such that .l2Data + .allHeadersSize points to the
 //                 packet's payload data.
+// .bucket is the NETIO bucket the packet was hashed into.
 //
 typedef struct PacketInfo {
     int isUdpForMe;
@@ -56,10 +68,23 @@ typedef struct PacketInfo {
     unsigned int l3Length;
     unsigned int ipHeaderSize;
     unsigned int allHeadersSize;
+    unsigned int bucket;
 } PacketInfo;
 extern const PacketInfo parsePacket(const Process *p, netio_pkt_t *pkt);
 
-// Show all the counters in p on the INFO log.
+// Send pkt on q for t retrying while q is full for up to the egress
+// budget of priority class priority.  Count queue full events, retry
+// cycles, and priority drops in t.  Return the last netio_error_t.
+//
+extern netio_error_t sendPacketOrShed(Thread *t, netio_queue_t *q,
+                                      netio_pkt_t *pkt, int priority);
+
+// Return the number of cycles counted per microsecond of wall time.
+//
+extern unsigned long long measureCyclesPerMicrosecond(void);
+
+// Show all the counters in p on the INFO log including the stage
+// accounting for the forwarding threads.
 //
 extern void showCounters(Process *p);
 
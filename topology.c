@@ -0,0 +1,239 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tmc/cpus.h>
+
+#include "topology.h"
+#include "util.h"
+
+
+// Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
+//
+// #define INFO(F, ...) info(F, ## __VA_ARGS__)
+#define INFO(F, ...)
+
+
+// The names of the TopologyHome values.
+//
+static const char *const homeName[] = {
+    [TOPOLOGYHOMEDEFAULT] = "default",
+    [TOPOLOGYHOMEHASH]    = "hash",
+    [TOPOLOGYHOMETILE]    = "tile"
+};
+static const int homeCount = sizeof homeName / sizeof homeName[0];
+
+
+// Read the file named file into buffer of size bytes with comments blanked
+// out.  Return 0 or -1 after reporting an error.
+//
+static int readTopologyFile(const char *file, char *buffer, size_t size)
+{
+    INFO("__: readTopologyFile(%s, %p, %zu)", file, buffer, size);
+    FILE *const fp = fopen(file, "r");
+    if (!fp) {
+        error("__: fopen(%s, r) failed with errno %d: %s",
+              file, errno, strerror(errno));
+        return -1;
+    }
+    const size_t count = fread(buffer, 1, size - 1, fp);
+    const int tooBig = count == size - 1 && !feof(fp);
+    fclose(fp);
+    if (tooBig) {
+        error("__: Topology file %s is longer than %zu bytes", file, size);
+        return -1;
+    }
+    buffer[count] = ""[0];
+    return 0;
+}
+
+
+// Blank out the comments in s from # to the end of the line.
+//
+static void blankComments(char *s)
+{
+    int comment = 0;
+    for (; *s; ++s) {
+        if (*s == '#') comment = 1;
+        if (*s == '\n') comment = 0;
+        if (comment) *s = ' ';
+    }
+}
+
+
+// Return the CPU in the string value if it is in online, or -1.
+//
+static int cpuFromString(const cpu_set_t *online, const char *value)
+{
+    char *end = NULL;
+    const long result = strtol(value, &end, 10);
+    const int ok = end != value && *end == ""[0] && result >= 0 &&
+        tmc_cpus_has_cpu(online, result);
+    return ok ? result : -1;
+}
+
+
+// Set the key in t to value given the online CPUs.  Set *forwardSet when
+// the forward CPUs are set, and *countSet when the forwarder count is.
+// Return 0 or -1 after reporting an error.
+//
+static int setTopologyKey(Topology *t, const cpu_set_t *online,
+                          const char *key, const char *value,
+                          int *forwardSet, int *countSet)
+{
+    INFO("__: setTopologyKey(%p, %p, %s, %s, %p, %p)",
+         t, online, key, value, forwardSet, countSet);
+    if (0 == strcmp(key, "control")) {
+        t->control = cpuFromString(online, value);
+        if (t->control >= 0) return 0;
+    } else if (0 == strcmp(key, "tap")) {
+        if (0 == strcmp(value, "control")) {
+            t->tap = TOPOLOGYCONTROL;
+            return 0;
+        }
+        t->tap = cpuFromString(online, value);
+        if (t->tap >= 0) return 0;
+    } else if (0 == strcmp(key, "forward")) {
+        const int fail = tmc_cpus_from_string(&t->forward, value);
+        int ok = !fail && tmc_cpus_count(&t->forward) > 0;
+        for (int n = 0; ok && n < tmc_cpus_count(&t->forward); ++n) {
+            ok = tmc_cpus_has_cpu(online,
+                                  tmc_cpus_find_nth_cpu(&t->forward, n));
+        }
+        *forwardSet = 1;
+        if (ok) return 0;
+    } else if (0 == strcmp(key, "forwarders")) {
+        t->forwarders = atoi(value);
+        *countSet = 1;
+        if (t->forwarders > 0) return 0;
+    } else if (0 == strcmp(key, "pipeline")) {
+        char *end = NULL;
+        t->pipeline = strtol(value, &end, 10);
+        if (end != value && *end == ""[0] && t->pipeline >= 0) return 0;
+    } else if (0 == strcmp(key, "controlforward")) {
+        const int ok = 0 == strcmp(value, "0") || 0 == strcmp(value, "1");
+        t->controlForwards = atoi(value);
+        if (ok) return 0;
+    } else if (0 == strcmp(key, "home")) {
+        for (int n = 0; n < homeCount; ++n) {
+            if (0 == strcmp(value, homeName[n])) {
+                t->home = n;
+                return 0;
+            }
+        }
+    } else {
+        error("__: Unknown topology key '%s' in: " TOPOLOGYFMT, key);
+        return -1;
+    }
+    error("__: Bad topology value %s=%s in: " TOPOLOGYFMT, key, value);
+    return -1;
+}
+
+
+// Put every online CPU except the control and TAP CPUs of t into forward.
+//
+static void defaultForward(const Topology *t, const cpu_set_t *online,
+                           cpu_set_t *forward)
+{
+    tmc_cpus_clear(forward);
+    for (int n = 0; n < tmc_cpus_count(online); ++n) {
+        const int cpu = tmc_cpus_find_nth_cpu(online, n);
+        if (cpu != t->control && cpu != t->tap) {
+            tmc_cpus_add_cpu(forward, cpu);
+        }
+    }
+}
+
+
+// Return 0 if the roles in t do not overlap and there are forwarders and
+// room for the transmit threads.  Otherwise return -1 after reporting an
+// error.
+//
+static int validateTopology(const Topology *t)
+{
+    const int available = tmc_cpus_count(&t->forward) - t->pipeline;
+    const int tapCpu = t->tap != TOPOLOGYCONTROL;
+    if (t->control == t->tap) {
+        error("__: Control and TAP share CPU %d", t->control);
+    } else if (tmc_cpus_has_cpu(&t->forward, t->control)) {
+        error("__: Control CPU %d is also a forward CPU", t->control);
+    } else if (tapCpu && tmc_cpus_has_cpu(&t->forward, t->tap)) {
+        error("__: TAP CPU %d is also a forward CPU", t->tap);
+    } else if (t->forwarders < 1 || t->forwarders > available) {
+        error("__: Cannot run %d forwarders and %d transmit threads "
+              "on %d forward CPUs", t->forwarders, t->pipeline,
+              tmc_cpus_count(&t->forward));
+    } else {
+        return 0;
+    }
+    return -1;
+}
+
+
+int topologyFromString(Topology *t, const char *s)
+{
+    INFO("__: topologyFromString(%p, %s)", t, s);
+    cpu_set_t online;
+    tmc_cpus_get_online_cpus(&online);
+    if (tmc_cpus_count(&online) < 3) {
+        error("__: Need 3 online CPUs but have %d", tmc_cpus_count(&online));
+        return -1;
+    }
+    const Topology defaults = {
+        .control = tmc_cpus_find_nth_cpu(&online, 0),
+        .tap = tmc_cpus_find_nth_cpu(&online, 1),
+        .home = TOPOLOGYHOMEDEFAULT
+    };
+    *t = defaults;
+    char buffer[9999] = "";
+    if (s) {
+        if (strchr(s, '=')) {
+            snprintf(buffer, sizeof buffer, "%s", s);
+        } else if (readTopologyFile(s, buffer, sizeof buffer)) {
+            return -1;
+        }
+    }
+    blankComments(buffer);
+    int forwardSet = 0, countSet = 0;
+    char *save = NULL;
+    for (char *pair = strtok_r(buffer, " \t\r\n;", &save); pair;
+         pair = strtok_r(NULL, " \t\r\n;", &save)) {
+        char *const value = strchr(pair, '=');
+        if (!value) {
+            error("__: Topology needs key=value not '%s' in: " TOPOLOGYFMT,
+                  pair);
+            return -1;
+        }
+        *value = ""[0];
+        const int fail = setTopologyKey(t, &online, pair, value + 1,
+                                        &forwardSet, &countSet);
+        if (fail) return -1;
+    }
+    if (!forwardSet) defaultForward(t, &online, &t->forward);
+    if (!countSet) {
+        t->forwarders = tmc_cpus_count(&t->forward) - t->pipeline;
+    }
+    return validateTopology(t);
+}
+
+
+void topologyShow(const Topology *t)
+{
+    char cpus[999] = "";
+    tmc_cpus_to_string(&t->forward, cpus, sizeof cpus);
+    if (t->tap == TOPOLOGYCONTROL) {
+        show("Topology: control and TAP share CPU %d", t->control);
+    } else {
+        show("Topology: control on CPU %d, TAP on CPU %d",
+             t->control, t->tap);
+    }
+    show("Topology: %d forwarders on CPUs %s%s, %s home",
+         t->forwarders, cpus,
+         t->controlForwards ? " and the control CPU" : "",
+         homeName[t->home]);
+    if (t->pipeline) {
+        show("Topology: pipeline to %d transmit threads "
+             "on the last forward CPUs", t->pipeline);
+    }
+}
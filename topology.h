@@ -0,0 +1,82 @@
+#ifndef INCLUDE_TOPOLOGY_H
+#define INCLUDE_TOPOLOGY_H
+
+
+// Lay out the threads of a switch or tester process on CPU tiles.
+
+
+#include <sched.h>
+
+
+// Where to home the cache lines holding each thread's state.
+//
+// TOPOLOGYHOMEDEFAULT leaves it to the default policy of the kernel.
+// TOPOLOGYHOMEHASH hashes the lines across all tiles.
+// TOPOLOGYHOMETILE homes the state of each thread on its own tile.
+//
+typedef enum TopologyHome {
+    TOPOLOGYHOMEDEFAULT,
+    TOPOLOGYHOMEHASH,
+    TOPOLOGYHOMETILE
+} TopologyHome;
+
+
+// The keys of a topology string with the syntax of their values.  Keys
+// are separated by space, newline, or semicolon, and # starts a comment.
+// The <cpus> are a list of CPUs and ranges like "2-5,12-15".
+//
+#define TOPOLOGYFMT \
+    "control=<cpu> tap=<cpu>|control forward=<cpus> forwarders=<n> " \
+    "controlforward=0|1 pipeline=<n> home=default|hash|tile"
+
+
+// A Topology.tap of TOPOLOGYCONTROL serves the TAP device from the control
+// event loop on the control CPU, which frees the TAP CPU to forward.
+//
+#define TOPOLOGYCONTROL (-1)
+
+
+// A layout of threads on CPU tiles.
+//
+// .control is the CPU of the main() thread that handles control commands.
+// .tap is the CPU of the thread that serves the TAP device or
+//      TOPOLOGYCONTROL.
+// .forward is the set of CPUs available to forwarding threads.
+// .forwarders is the number of forwarding threads to start, which run on
+//             the lowest .forwarders CPUs in .forward.  The rest of
+//             .forward holds spares to start at run time.
+// .controlForwards is true if the first forwarder runs on the control CPU
+//                  and polls for control commands when idle or every
+//                  CONTROLPOLLMASK + 1 packets.
+// .pipeline is 0 to run each packet to completion on one forwarder, or
+//           the number of transmit threads to run on the highest
+//           .pipeline CPUs in .forward.  Then the forwarders only receive
+//           and classify packets, and pass them to the transmit threads
+//           to rewrite and send.
+// .home is where to home the state of each thread.
+//
+typedef struct Topology {
+    int control;
+    int tap;
+    cpu_set_t forward;
+    int forwarders;
+    int controlForwards;
+    int pipeline;
+    TopologyHome home;
+} Topology;
+
+
+// Parse into t the topology described by s, or in the file named s if s
+// has no '='.  Keys missing from s take their defaults: control on the
+// first online CPU, TAP on the next, no pipeline, and forwarders on all
+// the rest.  A null s gets all the defaults.  Return 0 or -1 after
+// reporting an error.
+//
+extern int topologyFromString(Topology *t, const char *s);
+
+// Show the topology t on the INFO log.
+//
+extern void topologyShow(const Topology *t);
+
+
+#endif // INCLUDE_TOPOLOGY_H
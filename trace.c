@@ -0,0 +1,124 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arch/cycle.h>
+
+#include "process.h"
+#include "trace.h"
+#include "util.h"
+
+
+// Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
+//
+// #define INFO(F, ...) info(F, ## __VA_ARGS__)
+#define INFO(F, ...)
+
+
+volatile int traceFrozen;
+
+
+// The process whose rings SIGUSR1 dumps, and the measured cost of one
+// get_cycle_count() and traceRecord() pair.
+//
+static struct Process *traceProcess;
+static unsigned long long cyclesPerRecord;
+
+
+// Freeze the rings in p, dump them into file, then thaw them again.
+// Return 0 on success and -1 on failure.
+//
+// Use only open(), write(), and close() so SIGUSR1 can call this.  An
+// entry being written when the rings freeze may be torn in the dump.
+//
+int traceDump(struct Process *p, const char *file)
+{
+    INFO("__: traceDump(%p, %s)", p, file);
+    const int wasFrozen = traceFrozen;
+    traceFrozen = 1;
+    int result = -1;
+    const int fd = open(file, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (fd >= 0) {
+        TraceFileHeader header = {
+            .magic = TRACEMAGIC,
+            .entryCount = TRACECOUNT,
+            .threadCount = p->threadCount,
+            .cyclesPerRecord = cyclesPerRecord
+        };
+        result = writeAll(fd, &header, sizeof header);
+        for (int n = 0; result == 0 && n < p->threadCount; ++n) {
+            const Thread *const t = p->thread[n];
+            const TraceFileThread tft = {
+                .index = t->index, .cpu = t->cpu, .next = t->trace.next
+            };
+            result = writeAll(fd, &tft, sizeof tft);
+            if (result == 0) {
+                result = writeAll(fd, t->trace.entry, sizeof t->trace.entry);
+            }
+        }
+        close(fd);
+    }
+    traceFrozen = wasFrozen;
+    return result;
+}
+
+
+// Dump the rings on SIGUSR1.
+//
+static void dumpOnSignal(int signal)
+{
+    const int savedErrno = errno;
+    if (traceProcess) traceDump(traceProcess, TRACEFILE);
+    errno = savedErrno;
+}
+
+
+// Time a burst of records into a scratch ring to estimate what the
+// recorder adds to each packet a forwarder handles.
+//
+static void measureRecorder(void)
+{
+    static Trace scratch;
+    static const int count = 4 * TRACECOUNT;
+    const unsigned long long begin = get_cycle_count();
+    for (int n = 0; n < count; ++n) {
+        traceRecord(&scratch, get_cycle_count(), n, n, 0, TRACEFORWARD, 0);
+    }
+    const unsigned long long end = get_cycle_count();
+    cyclesPerRecord = (end - begin) / count;
+}
+
+
+void traceInitialize(struct Process *p)
+{
+    INFO("__: traceInitialize(%p)", p);
+    measureRecorder();
+    traceProcess = p;
+    struct sigaction action = {
+        .sa_handler = dumpOnSignal,
+        .sa_flags = SA_RESTART
+    };
+    sigemptyset(&action.sa_mask);
+    const int fail = sigaction(SIGUSR1, &action, NULL);
+    if (fail) {
+        error("__: sigaction(SIGUSR1, %p, NULL) returned %d with errno %d: %s",
+              &action, fail, errno, strerror(errno));
+    }
+    show("__: kill -USR1 %d to dump the packet trace into %s",
+         getpid(), TRACEFILE);
+}
+
+
+void traceShow(const struct Process *p)
+{
+    INFO("__: traceShow(%p)", p);
+    unsigned long long recorded = 0;
+    for (int n = 0; n < p->threadCount; ++n) {
+        recorded += p->thread[n]->trace.next;
+    }
+    show("Trace recorded %llu packets in rings of %d "
+         "at about %llu cycles per packet",
+         recorded, TRACECOUNT, cyclesPerRecord);
+}
@@ -0,0 +1,135 @@
+#ifndef INCLUDE_TRACE_H
+#define INCLUDE_TRACE_H
+
+
+// Keep an always-on flight recorder of the packets each forwarder handles.
+//
+// Each forwarding thread writes a TraceEntry into its own Trace ring with
+// plain stores for every packet it takes off its NETIO queue.  Nothing
+// reads the rings until a control command or SIGUSR1 freezes them and
+// dumps them all into TRACEFILE for the tracedump program to decode.
+//
+// This header does not depend on Tilera so that tracedump can share the
+// file layout with the switch.
+
+
+// The number of entries in each thread's ring is 1 << TRACELOG2.
+//
+#define TRACELOG2 (10)
+#define TRACECOUNT (1 << TRACELOG2)
+#define TRACEMASK (TRACECOUNT - 1)
+
+// The file into which the switch dumps its rings.
+//
+#define TRACEFILE "./switch-trace.dat"
+
+// The magic string at the start of a TRACEFILE.
+//
+#define TRACEMAGIC "XTRACE1"
+
+
+// What a forwarder did with a packet.
+//
+typedef enum TraceDecision {
+    TRACEFORWARD = 1,
+    TRACEDROP = 2,
+    TRACETAP = 3,
+    TRACEPOLICE = 4
+} TraceDecision;
+
+
+// One packet in a Trace ring.
+//
+// .cycle is the cycle count when the forwarder finished with the packet.
+// .poa is the UDP port of arrival or 0 if the packet was not UDP for us.
+// .length is the L2 length of the packet in bytes.
+// .status is the netio_pkt_status_t of the packet.
+// .decision is a TraceDecision.
+// .result is the netio_error_t returned by the last send or 0.
+//
+typedef struct TraceEntry {
+    unsigned long long cycle;
+    unsigned short poa;
+    unsigned short length;
+    unsigned char status;
+    unsigned char decision;
+    short result;
+} TraceEntry;
+
+
+// A ring of TRACECOUNT entries.  The most recent entry is at
+// .entry[(.next - 1) & TRACEMASK] and there are min(.next, TRACECOUNT)
+// valid entries.
+//
+typedef struct Trace {
+    unsigned long long next;
+    TraceEntry entry[TRACECOUNT];
+} Trace;
+
+
+// The header of a TRACEFILE.  It is followed by .threadCount instances
+// of TraceFileThread each followed by .entryCount TraceEntry records.
+//
+// .magic is TRACEMAGIC.
+// .entryCount is TRACECOUNT in the switch that wrote the file.
+// .threadCount is the number of rings in the file.
+// .cyclesPerRecord is the measured cost of writing one entry.
+//
+typedef struct TraceFileHeader {
+    char magic[8];
+    unsigned int entryCount;
+    unsigned int threadCount;
+    unsigned long long cyclesPerRecord;
+} TraceFileHeader;
+
+// .index and .cpu identify the thread owning the ring that follows.
+// .next is the ring's Trace.next when it was dumped.
+//
+typedef struct TraceFileThread {
+    int index;
+    int cpu;
+    unsigned long long next;
+} TraceFileThread;
+
+
+// True while the rings are frozen for a dump.
+//
+extern volatile int traceFrozen;
+
+// Record one packet in tr at cycle unless the rings are frozen.
+//
+static inline void traceRecord(Trace *tr, unsigned long long cycle,
+                               int poa, unsigned int length, int status,
+                               TraceDecision decision, int result)
+{
+    if (traceFrozen) return;
+    TraceEntry *const e = tr->entry + (tr->next++ & TRACEMASK);
+    e->cycle = cycle;
+    e->poa = poa;
+    e->length = length;
+    e->status = status;
+    e->decision = decision;
+    e->result = result;
+}
+
+
+// Defined in process.h.
+//
+struct Process;
+
+// Measure the cost of traceRecord(), and arrange for SIGUSR1 to dump the
+// rings in p into TRACEFILE.
+//
+extern void traceInitialize(struct Process *p);
+
+// Freeze the rings in p, dump them into file, then thaw them again.
+// Return 0 on success and -1 on failure.  This is async-signal-safe.
+//
+extern int traceDump(struct Process *p, const char *file);
+
+// Show the measured cost of the recorder on the INFO log.
+//
+extern void traceShow(const struct Process *p);
+
+
+#endif // INCLUDE_TRACE_H
@@ -0,0 +1,168 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "util.h"
+
+
+static const char usage[] =
+    "                                                                     \n"
+    "%s: Decode a packet trace dumped by the switch into <file>.          \n"
+    "    You can build and run %s on any Unix system because it does not  \n"
+    "    depend on Tilera libraries.                                      \n"
+    "                                                                     \n"
+    "Usage: %s [<file>]                                                   \n"
+    "                                                                     \n"
+    "Where: <file> is a trace file written when the switch got a 'trace'  \n"
+    "              command or a SIGUSR1 signal.  The default is %s.       \n"
+    "                                                                     \n"
+    "Show one line per packet in cycle order across all the threads.      \n"
+    "                                                                     \n"
+    "Example: %s %s                                                       \n"
+    "                                                                     \n";
+
+// Define INFO(F, ...) as info(F, ## __VA_ARGS__) to enable spew.
+//
+// #define INFO(F, ...) info(F, ## __VA_ARGS__)
+#define INFO(F, ...)
+
+
+// Describe this program's validated command line.
+//
+typedef struct TracedumpCommandLine {
+    const char *av0;
+    const char *file;
+} TracedumpCommandLine;
+
+// Validate the command line (ac, av) and return the results.
+//
+static const TracedumpCommandLine validateTracedumpUsage(int ac,
+                                                         const char *av[])
+{
+    INFO("__: validateTracedumpUsage(%d, %p)", ac, av);
+    const char *av0 = strrchr(av[0], "/"[0]); av0 = av0? 1 + av0: av[0];
+    TracedumpCommandLine result = { .av0 = av0, .file = TRACEFILE };
+    const int ok = ac < 3 && (ac < 2 || av[1][0] != "-"[0]);
+    if (!ok) {
+        fprintf(stderr, usage, av0, av0, av0, TRACEFILE, av0, TRACEFILE);
+        exit(1);
+    }
+    if (ac > 1) result.file = av[1];
+    return result;
+}
+
+
+// A decoded trace entry tagged with the thread that recorded it.
+//
+typedef struct Decoded {
+    int index;
+    int cpu;
+    TraceEntry entry;
+} Decoded;
+
+
+// Order decoded entries by cycle count for qsort().
+//
+static int compareDecoded(const void *vx, const void *vy)
+{
+    const Decoded *const x = vx;
+    const Decoded *const y = vy;
+    if (x->entry.cycle < y->entry.cycle) return -1;
+    if (x->entry.cycle > y->entry.cycle) return  1;
+    return x->index - y->index;
+}
+
+
+// Return a name for decision.
+//
+static const char *decisionName(int decision)
+{
+    switch (decision) {
+    case TRACEFORWARD: return "forward";
+    case TRACEDROP:    return "drop";
+    case TRACETAP:     return "tap";
+    case TRACEPOLICE:  return "police";
+    }
+    return "?";
+}
+
+
+// Read the trace in file s into a new array of decoded entries, and write
+// its size into count.  Return 0 if the file is not a trace.
+//
+static Decoded *readTrace(FILE *s, const char *file, int *count,
+                          TraceFileHeader *header)
+{
+    INFO("__: readTrace(%p, %s, %p, %p)", s, file, count, header);
+    *count = 0;
+    const size_t hSize = fread(header, sizeof *header, 1, s);
+    const int ok = hSize == 1 &&
+        0 == memcmp(header->magic, TRACEMAGIC, sizeof TRACEMAGIC) &&
+        header->entryCount > 0;
+    if (!ok) {
+        error("__: %s is not a trace file", file);
+        return 0;
+    }
+    const size_t limit = (size_t)header->threadCount * header->entryCount;
+    Decoded *const result = calloc(limit ? limit : 1, sizeof *result);
+    TraceEntry *const ring = calloc(header->entryCount, sizeof *ring);
+    for (unsigned int n = 0; n < header->threadCount; ++n) {
+        TraceFileThread tft;
+        const size_t tSize = fread(&tft, sizeof tft, 1, s);
+        const size_t rSize = fread(ring, sizeof *ring, header->entryCount, s);
+        if (tSize != 1 || rSize != header->entryCount) {
+            error("__: %s is truncated at thread %u", file, n);
+            break;
+        }
+        const unsigned long long valid = tft.next < header->entryCount
+            ? tft.next : header->entryCount;
+        for (unsigned long long m = 0; m < valid; ++m) {
+            Decoded *const d = result + *count;
+            d->index = tft.index;
+            d->cpu = tft.cpu;
+            d->entry = ring[m];
+            ++*count;
+        }
+    }
+    free(ring);
+    return result;
+}
+
+
+int main(int ac, const char *av[])
+{
+    INFO("__: main(%d, %p)", ac, av);
+    const TracedumpCommandLine cl = validateTracedumpUsage(ac, av);
+    errorInitialize(cl.av0);
+    FILE *const s = fopen(cl.file, "r");
+    if (!s) {
+        error("__: fopen(%s, \"r\") failed with errno %d: %s",
+              cl.file, errno, strerror(errno));
+        return 1;
+    }
+    TraceFileHeader header;
+    int count = 0;
+    Decoded *const decoded = readTrace(s, cl.file, &count, &header);
+    fclose(s);
+    if (!decoded) return 1;
+    qsort(decoded, count, sizeof *decoded, compareDecoded);
+    printf("# %s: %d packets from %u threads recorded "
+           "at about %llu cycles per packet\n", cl.file, count,
+           header.threadCount, header.cyclesPerRecord);
+    printf("# %20s %12s %3s %3s %5s %6s %6s %-8s %s\n",
+           "cycle", "delta", "thr", "cpu", "poa", "length", "status",
+           "decision", "result");
+    const unsigned long long first = count ? decoded[0].entry.cycle : 0;
+    for (int n = 0; n < count; ++n) {
+        const Decoded *const d = decoded + n;
+        const TraceEntry *const e = &d->entry;
+        printf("%22llu %12llu %3d %3d %5u %6u %6u %-8s %d\n",
+               e->cycle, e->cycle - first, d->index, d->cpu,
+               e->poa, e->length, e->status, decisionName(e->decision),
+               e->result);
+    }
+    free(decoded);
+    return 0;
+}
@@ -6,12 +6,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "util.h"
 
@@ -147,6 +149,31 @@ int validMacString(const char *mac)
 }
 
 
+int interfacesFromString(const char *fif[], int max, const char *s)
+{
+    INFO("__: interfacesFromString(%p, %d, %s)", fif, max, s);
+    int count = 0;
+    while (count < max) {
+        const size_t size = strcspn(s, ",");
+        char *const name = strndup(s, size);
+        unsigned int unit = 0;
+        char more = ""[0];
+        int ok = name &&
+            (1 == sscanf(name, "xgbe/%u%c", &unit, &more) ||
+             1 == sscanf(name, "gbe/%u%c", &unit, &more));
+        for (int n = 0; ok && n < count; ++n) ok = 0 != strcmp(name, fif[n]);
+        if (!ok) {
+            free(name);
+            return -1;
+        }
+        fif[count++] = name;
+        if (s[size] == ""[0]) return count;
+        s += size + 1;
+    }
+    return -1;
+}
+
+
 int bindUdpPort(const char *ips, int port)
 {
     INFO("__: bindUdpPort(%s, %d)", ips, port);
@@ -310,8 +337,53 @@ void systemCommand(const char *cmd, ...)
 }
 
 
+// The monotonic clock in nanoseconds when main() began and when the last
+// startup phase finished.
+//
+static unsigned long long startupBeginNs, startupLastNs;
+
+
+unsigned long long clockNs(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return 1000000000ULL * ts.tv_sec + ts.tv_nsec;
+}
+
+
+void startupBegin(void)
+{
+    startupBeginNs = startupLastNs = clockNs(CLOCK_MONOTONIC);
+}
+
+
+void startupPhase(const char *phase)
+{
+    const unsigned long long nowNs = clockNs(CLOCK_MONOTONIC);
+    if (startupBeginNs == 0) startupBeginNs = startupLastNs = nowNs;
+    show("__: Startup finished %-8s %8llu us after main, %8llu us in phase",
+         phase, (nowNs - startupBeginNs) / 1000,
+         (nowNs - startupLastNs) / 1000);
+    startupLastNs = nowNs;
+}
+
+
 // Just use the first local non-loopback IPv4 address.
 //
+int writeAll(int fd, const void *buffer, size_t size)
+{
+    const char *p = buffer;
+    while (size > 0) {
+        const ssize_t wSize = write(fd, p, size);
+        if (wSize < 0 && errno == EINTR) continue;
+        if (wSize <= 0) return -1;
+        p += wSize;
+        size -= wSize;
+    }
+    return 0;
+}
+
+
 void getControlIp(unsigned char noa[4])
 {
     struct ifaddrs *ifap = NULL;
@@ -344,6 +416,26 @@ void getControlIp(unsigned char noa[4])
 }
 
 
+// Send on fd the size bytes at buffer as a control string to the switch.
+// Write the size and the string in one writev() so they go in one
+// segment on a connection with TCP_NODELAY.
+//
+void sendControl(int fd, const char *buffer, int size)
+{
+    INFO("__: sendControl(%d, %p, %d)", fd, buffer, size);
+    struct iovec iov[2] = {
+        { .iov_base = &size,          .iov_len = sizeof size },
+        { .iov_base = (char *)buffer, .iov_len = size }
+    };
+    const ssize_t wSize = writev(fd, iov, 2);
+    if (wSize != sizeof size + size) {
+        error("__: writev(%d, %p, 2) of %d bytes returned %zd "
+              "with errno %d: %s", fd, iov, (int)sizeof size + size, wSize,
+              errno, strerror(errno));
+    }
+}
+
+
 // Send on fd a size 0 route control string to the switch to shut it down.
 //
 void stopSwitch(int fd)
@@ -6,6 +6,9 @@
 // depend on Tilera.
 
 
+#include <time.h>
+
+
 // Define SLEEP(X) as sleep(X) to slow this bird down for debugging.
 //
 // #define SLEEP(X) sleep(X)
@@ -46,14 +49,54 @@
 #define MACSCANFMT "%x:%x:%x:%x:%x:%x"
 
 
-// Parse or print a JSON route command string.
+// Print a JSON route command string.  The "priority", "egress", "rate",
+// "burst", "shape", and "shapeBurst" are optional when parsing.
 //
 #define JSONROUTEFMT \
     "    { \"from\" : %d ,                 \n" \
     "      \"port\" : %d ,                 \n" \
     "      \"ip\"   : \"" IPFMT "\" ,      \n" \
-    "      \"mac\"  : \"" MACSCANFMT "\" } \n"
-
+    "      \"mac\"  : \"" MACSCANFMT "\" , \n" \
+    "      \"priority\" : %d ,             \n" \
+    "      \"egress\" : %d ,               \n" \
+    "      \"rate\" : %d ,                 \n" \
+    "      \"burst\" : %d ,                \n" \
+    "      \"shape\" : %d ,                \n" \
+    "      \"shapeBurst\" : %d }           \n"
+
+// The switch acks and nacks each command that carries a "seq" number
+// with a JSON string sent back on the control connection.  An ack of seq
+// means the switch has handled every command through seq, and nacked any
+// that failed before it sent the ack.  A nack gives the reason a command
+// failed as one of the CONTROLNACK strings.
+//
+#define JSONACKFMT "{ \"ack\" : %d }"
+#define JSONNACKFMT "{ \"nack\" : %d , \"reason\" : \"%s\" }"
+
+// The switch answers the dump command with a JSON string giving the
+// generation of its routing table and the count of open routes, then one
+// JSON string per open route.  The route strings parse as route
+// commands that would open the route again.  Each also gives the NETIO
+// bucket the route's last packet hashed to, numbered across interfaces
+// as Process.bucket is, or -1 if none has arrived.
+//
+#define JSONDUMPFMT "{ \"dump\" : %u , \"count\" : %d }"
+#define JSONDUMPROUTEFMT \
+    "{\"from\":%d,\"port\":%d,\"ip\":\"" IPFMT "\",\"mac\":\"" MACFMT \
+    "\",\"priority\":%d,\"egress\":%d,\"rate\":%d,\"burst\":%d," \
+    "\"shape\":%d,\"shapeBurst\":%d,\"bucket\":%d}"
+
+// CONTROLNACKPARSE means the command is not a JSON command or route.
+// CONTROLNACKCOMMAND means the switch has no such command.
+// CONTROLNACKARGUMENT means a command argument is missing or invalid.
+// CONTROLNACKEGRESS means a route's egress is not a switch interface.
+// CONTROLNACKFAILED means the switch could not do what a command asked.
+//
+#define CONTROLNACKPARSE "parse"
+#define CONTROLNACKCOMMAND "command"
+#define CONTROLNACKARGUMENT "argument"
+#define CONTROLNACKEGRESS "egress"
+#define CONTROLNACKFAILED "failed"
 
 // Establish whiner as source of error info and show messages if not 0.
 // Return the current whiner.
@@ -96,6 +139,12 @@ extern int validIpString(const char *ips);
 //
 extern int validMacString(const char *mac);
 
+// Split the comma-separated list of interface names s into fif.  Return
+// the count if s names 1 to max distinct Ethernet interfaces like
+// PRODUCTIONINTERFACE or CONVENIENCEINTERFACE.  Otherwise return -1.
+//
+extern int interfacesFromString(const char *fif[], int max, const char *s);
+
 // Return -1 or a UDP socket bound to IPv4 address ip and port (ip:port).
 // A read() from the resulting file descriptor returns a UDP packet sent to
 // the forward ip:port.
@@ -124,11 +173,34 @@ extern int listenTcpPort(const char *ips, int port);
 //
 extern void systemCommand(const char *cmd, ...);
 
+// Return the nanoseconds on clock, such as CLOCK_MONOTONIC.
+//
+extern unsigned long long clockNs(clockid_t clock);
+
+// Note that main() has begun, so startupPhase() can measure from there.
+//
+extern void startupBegin(void);
+
+// Show that startup has finished phase, with the microseconds since
+// startupBegin() and since the last phase, on the monotonic clock.
+//
+extern void startupPhase(const char *phase);
+
+// Write the size bytes at buffer to fd, resuming after short and
+// interrupted writes.  Return 0 or -1 with errno set on error.  This
+// calls only write(), so a signal handler can call it.
+//
+extern int writeAll(int fd, const void *buffer, size_t size);
+
 // Write into noa 4 bytes of the caller's control IPv4 address.  The
 // control address is the one on the network interface managed by Linux.
 //
 extern void getControlIp(unsigned char noa[4]);
 
+// Send on fd the size bytes at buffer as a control string to the switch.
+//
+extern void sendControl(int fd, const char *buffer, int size);
+
 // Send on fd a size 0 route control string to the switch to shut it down.
 //
 extern void stopSwitch(int fd);